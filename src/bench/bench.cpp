@@ -0,0 +1,362 @@
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "bench/histogram.hpp"
+#include "orderbook/orderbook.hpp"
+
+using namespace orderbook;
+using bench::LatencyHistogram;
+
+namespace {
+    /**
+     * @brief Parameters of a generated order flow
+     * Limit prices rest at a normally distributed distance from a fixed mid on their side of the book, or on
+     * the other side for marketable orders: a small spread keeps few levels that are crossed all the time,
+     * a large one builds deep books.
+     */
+    struct Workload
+    {
+        std::string name = "mixed";
+        std::size_t operations = 1000000;
+        std::size_t symbols = 1;
+        std::size_t prefill = 0;   // resting orders added per symbol before timing
+        double cancelRatio = 0.35; // share of cancels of a random live order
+        double marketRatio = 0.05; // share of market orders
+        double crossRatio = 0.1;   // share of limit orders priced through the mid
+        double spread = 10;        // standard deviation of limit prices in ticks
+        int maxQuantity = 200;
+        std::size_t batch = 1;     // operations per apply_batch call in the throughput pass, from runs of one symbol
+        unsigned seed = 1;
+        OrderbookConfig config;
+    };
+
+    // presets, options given after --workload override their fields
+    bool preset(const std::string& name, Workload& workload)
+    {
+        workload.name = name;
+        if (name == "mixed")
+            return true;
+        if (name == "add_only")
+        {
+            workload.cancelRatio = 0;
+            workload.marketRatio = 0;
+            return true;
+        }
+        if (name == "shallow")
+        {
+            workload.spread = 2;
+            workload.cancelRatio = 0.45;
+            return true;
+        }
+        if (name == "deep")
+        {
+            workload.spread = 200;
+            workload.prefill = 100000;
+            workload.cancelRatio = 0.3;
+            workload.marketRatio = 0.02;
+            return true;
+        }
+        if (name == "many_symbols")
+        {
+            workload.symbols = 5000;
+            return true;
+        }
+        return false;
+    }
+
+    enum class OperationKind : std::uint8_t { add, cancel, market };
+    constexpr const char* KindNames[] = {"add", "cancel", "market"};
+
+    struct Operation
+    {
+        OperationKind kind;
+        Orderside side;
+        std::uint32_t symbol;
+        int userId;
+        int orderId;
+        int price;
+        int quantity;
+    };
+
+    constexpr int MidPrice = 10000;
+
+    // orders of the prefill followed by the timed operations, generated ahead so that the random
+    // number generators are not timed
+    std::vector<Operation> generate(const Workload& workload, std::size_t& prefillCount)
+    {
+        std::mt19937 gen{workload.seed};
+        std::normal_distribution<> priceDistribution(0, workload.spread);
+        std::uniform_int_distribution<int> quantityDistribution(1, workload.maxQuantity);
+        std::uniform_real_distribution<> kindDistribution(0, 1);
+        std::vector<Operation> operations;
+        std::vector<std::size_t> live; // operations that may still rest in their book
+        int orderId = 0;
+
+        auto limit = [&](std::uint32_t symbol)
+        {
+            const Orderside side = gen() % 2 ? Orderside::buy : Orderside::sell;
+            const int distance = int(std::lround(std::abs(priceDistribution(gen))));
+            const bool passive = kindDistribution(gen) >= workload.crossRatio;
+            const int price = std::max(1, (side == Orderside::buy) == passive ? MidPrice - distance : MidPrice + 1 + distance);
+            live.push_back(operations.size());
+            operations.push_back(Operation{OperationKind::add, side, symbol, 1 + int(gen() % 100), ++orderId, price, quantityDistribution(gen)});
+        };
+
+        for (std::uint32_t symbol = 0; symbol < workload.symbols; ++symbol)
+            for (std::size_t order = 0; order < workload.prefill; ++order)
+                limit(symbol);
+        prefillCount = operations.size();
+
+        for (std::size_t index = 0; index < workload.operations; ++index)
+        {
+            const double kind = kindDistribution(gen);
+            const auto symbol = std::uint32_t(gen() % workload.symbols);
+            if (kind < workload.cancelRatio && !live.empty())
+            {
+                const std::size_t position = gen() % live.size();
+                Operation cancel = operations[live[position]];
+                cancel.kind = OperationKind::cancel;
+                operations.push_back(cancel);
+                live[position] = live.back();
+                live.pop_back();
+            }
+            else if (kind < workload.cancelRatio + workload.marketRatio)
+            {
+                const Orderside side = gen() % 2 ? Orderside::buy : Orderside::sell;
+                operations.push_back(Operation{OperationKind::market, side, symbol, 1 + int(gen() % 100), ++orderId, 0, quantityDistribution(gen)});
+            }
+            else
+            {
+                limit(symbol);
+            }
+        }
+        return operations;
+    }
+
+    struct FillCounter : OrderbookListener
+    {
+        std::uint64_t fills = 0;
+        void on_fill(Orderside, int, int, int, int, int, int) { ++fills; }
+    };
+
+    struct Result
+    {
+        LatencyHistogram latencies[3];
+        std::uint64_t fills = 0;
+        std::uint64_t cancelHits = 0;
+        double seconds = 0;
+    };
+
+    // runs the operations on fresh books, Timed records the latency of every operation
+    template<bool Timed>
+    Result run(const Workload& workload, const std::vector<Operation>& operations, std::size_t prefillCount)
+    {
+        std::vector<std::unique_ptr<Orderbook>> books;
+        for (std::size_t symbol = 0; symbol < workload.symbols; ++symbol)
+            books.emplace_back(new Orderbook(workload.config));
+        Result result;
+        FillCounter listener;
+        auto apply = [&](const Operation& operation)
+        {
+            Orderbook& book = *books[operation.symbol];
+            if (operation.kind == OperationKind::cancel)
+                result.cancelHits += book.cancel_order(operation.userId, operation.orderId, listener);
+            else
+                book.add_order(operation.side, operation.userId, operation.orderId, operation.price, operation.quantity, listener);
+        };
+
+        for (std::size_t index = 0; index < prefillCount; ++index)
+            apply(operations[index]);
+        listener.fills = 0;
+
+        const auto start = std::chrono::steady_clock::now();
+        if (!Timed && workload.batch > 1)
+        {
+            std::vector<BookCommand> commands;
+            std::unique_ptr<bool[]> accepted(new bool[workload.batch]);
+            for (std::size_t index = prefillCount; index < operations.size();)
+            {
+                const std::uint32_t symbol = operations[index].symbol;
+                commands.clear();
+                for (; index < operations.size() && operations[index].symbol == symbol && commands.size() < workload.batch; ++index)
+                {
+                    const Operation& operation = operations[index];
+                    BookCommand command;
+                    command.type = operation.kind == OperationKind::cancel ? BookCommand::Type::cancel : BookCommand::Type::add;
+                    command.side = operation.side;
+                    command.clientId = operation.userId;
+                    command.orderId = operation.orderId;
+                    command.price = operation.price;
+                    command.quantity = operation.quantity;
+                    commands.push_back(command);
+                }
+                books[symbol]->apply_batch(commands.data(), commands.size(), listener, accepted.get());
+                for (std::size_t command = 0; command < commands.size(); ++command)
+                    result.cancelHits += commands[command].type == BookCommand::Type::cancel && accepted[command];
+            }
+        }
+        for (std::size_t index = prefillCount; index < operations.size() && (Timed || workload.batch <= 1); ++index)
+        {
+            const Operation& operation = operations[index];
+            if (Timed)
+            {
+                const auto before = std::chrono::steady_clock::now();
+                apply(operation);
+                const auto after = std::chrono::steady_clock::now();
+                result.latencies[int(operation.kind)].record(std::uint64_t(std::chrono::duration_cast<std::chrono::nanoseconds>(after - before).count()));
+            }
+            else
+            {
+                apply(operation);
+            }
+        }
+        result.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        result.fills = listener.fills;
+        return result;
+    }
+
+    // cost of reading the clock twice, included in every recorded latency
+    std::uint64_t timer_overhead()
+    {
+        LatencyHistogram overhead;
+        for (int sample = 0; sample < 100000; ++sample)
+        {
+            const auto before = std::chrono::steady_clock::now();
+            const auto after = std::chrono::steady_clock::now();
+            overhead.record(std::uint64_t(std::chrono::duration_cast<std::chrono::nanoseconds>(after - before).count()));
+        }
+        return overhead.percentile(50);
+    }
+
+    void write_latencies(std::ostream& o, const LatencyHistogram& histogram)
+    {
+        o << "{\"count\": " << histogram.count() << ", \"mean\": " << histogram.mean() << ", \"min\": " << histogram.min()
+          << ", \"p50\": " << histogram.percentile(50) << ", \"p90\": " << histogram.percentile(90)
+          << ", \"p99\": " << histogram.percentile(99) << ", \"p99.9\": " << histogram.percentile(99.9)
+          << ", \"p99.99\": " << histogram.percentile(99.99) << ", \"max\": " << histogram.max() << "}";
+    }
+
+    void write_json(std::ostream& o, const Workload& workload, const Result& timed, const Result& throughput, std::uint64_t overhead)
+    {
+        LatencyHistogram all;
+        for (const auto& histogram : timed.latencies)
+            all.merge(histogram);
+        o << "{\n"
+          << "  \"workload\": \"" << workload.name << "\",\n"
+          << "  \"backend\": \"" << (workload.config.backend == LevelsBackend::ladder ? "ladder" : "tree") << "\",\n"
+          << "  \"operations\": " << workload.operations << ",\n"
+          << "  \"symbols\": " << workload.symbols << ",\n"
+          << "  \"prefill\": " << workload.prefill << ",\n"
+          << "  \"cancel_ratio\": " << workload.cancelRatio << ",\n"
+          << "  \"market_ratio\": " << workload.marketRatio << ",\n"
+          << "  \"cross_ratio\": " << workload.crossRatio << ",\n"
+          << "  \"spread\": " << workload.spread << ",\n"
+          << "  \"seed\": " << workload.seed << ",\n"
+          << "  \"batch\": " << workload.batch << ",\n"
+          << "  \"fills\": " << throughput.fills << ",\n"
+          << "  \"cancel_hits\": " << throughput.cancelHits << ",\n"
+          << "  \"elapsed_sec\": " << throughput.seconds << ",\n"
+          << "  \"throughput_ops_per_sec\": " << double(workload.operations) / throughput.seconds << ",\n"
+          << "  \"timer_overhead_ns\": " << overhead << ",\n"
+          << "  \"latency_ns\": {\n    \"all\": ";
+        write_latencies(o, all);
+        for (int kind = 0; kind < 3; ++kind)
+        {
+            o << ",\n    \"" << KindNames[kind] << "\": ";
+            write_latencies(o, timed.latencies[kind]);
+        }
+        o << "\n  }\n}\n";
+    }
+
+    const char* Usage =
+        "Usage: orderbook-bench [--workload=mixed|add_only|shallow|deep|many_symbols] [--operations=N] [--symbols=N]\n"
+        "                       [--prefill=N] [--cancel=RATIO] [--market=RATIO] [--cross=RATIO]\n"
+        "                       [--spread=TICKS] [--batch=N] [--seed=N] [--ladder] [--json=FILE]\n";
+}
+
+int main(int argc, char** argv)
+{
+    Workload workload;
+    std::string jsonFile;
+    for (int arg = 1; arg < argc; ++arg)
+    {
+        const std::string option = argv[arg];
+        const auto equal = option.find('=');
+        const std::string name = option.substr(0, equal);
+        const std::string value = equal == std::string::npos ? std::string() : option.substr(equal + 1);
+        try
+        {
+            if (name == "--workload" && preset(value, workload))
+                continue;
+            else if (name == "--operations")
+                workload.operations = std::stoul(value);
+            else if (name == "--symbols")
+                workload.symbols = std::max<std::size_t>(1, std::stoul(value));
+            else if (name == "--prefill")
+                workload.prefill = std::stoul(value);
+            else if (name == "--cancel")
+                workload.cancelRatio = std::stod(value);
+            else if (name == "--market")
+                workload.marketRatio = std::stod(value);
+            else if (name == "--cross")
+                workload.crossRatio = std::stod(value);
+            else if (name == "--spread")
+                workload.spread = std::stod(value);
+            else if (name == "--batch")
+                workload.batch = std::stoul(value);
+            else if (name == "--seed")
+                workload.seed = unsigned(std::stoul(value));
+            else if (option == "--ladder")
+                workload.config.backend = LevelsBackend::ladder;
+            else if (name == "--json")
+                jsonFile = value;
+            else
+                throw std::invalid_argument(option);
+        }
+        catch (const std::exception&)
+        {
+            std::cerr << "Invalid option " << option << "\n" << Usage;
+            return -1;
+        }
+    }
+
+    std::size_t prefillCount = 0;
+    const auto operations = generate(workload, prefillCount);
+    const std::uint64_t overhead = timer_overhead();
+    const Result throughput = run<false>(workload, operations, prefillCount);
+    const Result timed = run<true>(workload, operations, prefillCount);
+
+    std::cerr << workload.name << ": " << workload.operations << " operations on " << workload.symbols << " symbols, "
+              << double(workload.operations) / throughput.seconds / 1e6 << " M ops/s\n";
+    for (int kind = 0; kind < 3; ++kind)
+    {
+        const auto& histogram = timed.latencies[kind];
+        std::cerr << "  " << KindNames[kind] << ": " << histogram.count() << " ops, p50 " << histogram.percentile(50)
+                  << " ns, p99 " << histogram.percentile(99) << " ns, p99.9 " << histogram.percentile(99.9)
+                  << " ns, max " << histogram.max() << " ns\n";
+    }
+
+    if (jsonFile.empty())
+    {
+        write_json(std::cout, workload, timed, throughput, overhead);
+    }
+    else
+    {
+        std::ofstream file(jsonFile);
+        write_json(file, workload, timed, throughput, overhead);
+        if (!file)
+        {
+            std::cerr << "Cannot write " << jsonFile << "\n";
+            return -1;
+        }
+    }
+    return 0;
+}
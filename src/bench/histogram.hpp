@@ -0,0 +1,89 @@
+#pragma once
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+
+namespace bench {
+    /**
+     * @brief Log linear histogram of latencies in the spirit of HdrHistogram
+     * Values below 2^Precision are counted exactly, above that every power of two is split in
+     * 2^(Precision - 1) buckets, so a recorded value is off by less than 1/64 whatever its magnitude.
+     * Recording is a couple of shifts and an increment, percentiles walk the buckets.
+     */
+    class LatencyHistogram
+    {
+    public:
+        static constexpr int Precision = 7;
+
+        LatencyHistogram() : counts(bucket(~std::uint64_t(0)) + 1) {}
+
+        void record(std::uint64_t value)
+        {
+            ++counts[bucket(value)];
+            ++total;
+            sum += value;
+            maximum = std::max(maximum, value);
+            minimum = std::min(minimum, value);
+        }
+
+        void merge(const LatencyHistogram& other)
+        {
+            for (std::size_t index = 0; index < counts.size(); ++index)
+                counts[index] += other.counts[index];
+            total += other.total;
+            sum += other.sum;
+            maximum = std::max(maximum, other.maximum);
+            minimum = std::min(minimum, other.minimum);
+        }
+
+        // highest value equivalent to the recorded values at percentile in [0, 100]
+        std::uint64_t percentile(double percentile) const
+        {
+            if (total == 0)
+                return 0;
+            const auto target = std::max<std::uint64_t>(1, std::uint64_t(percentile / 100 * double(total) + 0.5));
+            std::uint64_t seen = 0;
+            for (std::size_t index = 0; index < counts.size(); ++index)
+            {
+                seen += counts[index];
+                if (seen >= target)
+                    return std::min(highest_equivalent(index), maximum);
+            }
+            return maximum;
+        }
+
+        std::uint64_t count() const { return total; }
+        std::uint64_t max() const { return maximum; }
+        std::uint64_t min() const { return total ? minimum : 0; }
+        double mean() const { return total ? double(sum) / double(total) : 0; }
+
+    private:
+        static constexpr std::uint64_t Exact = std::uint64_t(1) << Precision;
+        static constexpr std::uint64_t Half = Exact / 2;
+
+        static std::size_t bucket(std::uint64_t value)
+        {
+            if (value < Exact)
+                return std::size_t(value);
+            const int magnitude = 63 - __builtin_clzll(value);
+            const int shift = magnitude - Precision + 1;
+            return std::size_t(Exact + (shift - 1) * Half + ((value >> shift) - Half));
+        }
+
+        static std::uint64_t highest_equivalent(std::size_t index)
+        {
+            if (index < Exact)
+                return index;
+            const std::uint64_t offset = index - Exact;
+            const int shift = int(offset / Half) + 1;
+            const std::uint64_t top = offset % Half + Half;
+            return ((top + 1) << shift) - 1;
+        }
+
+        std::vector<std::uint64_t> counts;
+        std::uint64_t total = 0;
+        std::uint64_t sum = 0;
+        std::uint64_t maximum = 0;
+        std::uint64_t minimum = ~std::uint64_t(0);
+    };
+}
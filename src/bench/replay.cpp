@@ -0,0 +1,161 @@
+#include <algorithm>
+#include <chrono>
+#include <cstddef>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <unistd.h>
+
+#include "engine/commands.hpp"
+#include "engine/output.hpp"
+#include "engine/parser.hpp"
+#include "engine/replay.hpp"
+
+using namespace engine;
+using orderbook::LevelsBackend;
+
+namespace {
+    const char* Usage =
+        "Usage: kraken-replay [--partitions=N] [--ladder | --ladder=SYMBOL,...] [--levels] [--binary] [--golden=FILE] input_file\n"
+        "Replays input_file on N threads, each owning the books of a share of the symbols, and writes the merged output\n"
+        "to stdout, or compares it with the output of a serial run in FILE.\n";
+
+    // line of text at offset, without its new line
+    std::string_view line_at(std::string_view text, std::size_t offset)
+    {
+        const std::size_t end = std::min(text.find('\n', offset), text.size());
+        return text.substr(offset, end - offset);
+    }
+
+    // compares output with the golden output, returns false and describes the first difference
+    bool verify(std::string_view output, std::string_view golden, bool binary, std::ostream& o)
+    {
+        const auto difference = std::mismatch(output.begin(), output.end(), golden.begin(), golden.end());
+        if (difference.first == output.end() && difference.second == golden.end())
+            return true;
+        const std::size_t offset = std::size_t(difference.first - output.begin());
+        if (binary)
+        {
+            o << "output differs from golden at event " << offset / BinarySink::EventSize << "\n";
+            return false;
+        }
+        const std::size_t lineStart = output.rfind('\n', offset == 0 ? 0 : offset - 1);
+        const std::size_t start = lineStart == std::string_view::npos || offset == 0 ? 0 : lineStart + 1;
+        const std::size_t lineNumber = std::size_t(std::count(output.begin(), output.begin() + start, '\n')) + 1;
+        o << "output differs from golden at line " << lineNumber << "\n"
+          << "  expected: " << (start < golden.size() ? line_at(golden, start) : "<end of file>") << "\n"
+          << "  actual  : " << (start < output.size() ? line_at(output, start) : "<end of file>") << "\n";
+        return false;
+    }
+}
+
+int main(int argc, char** argv)
+{
+    OrderbookManager prototype;
+    SymbolTable symbols;
+    prototype.symbols = &symbols;
+    std::size_t partitions = std::max(1u, std::thread::hardware_concurrency());
+    bool binary = false;
+    std::string goldenFile;
+    const char* inputFile = nullptr;
+    for (int arg = 1; arg < argc; ++arg)
+    {
+        const std::string option = argv[arg];
+        const auto equal = option.find('=');
+        const std::string name = option.substr(0, equal);
+        const std::string value = equal == std::string::npos ? std::string() : option.substr(equal + 1);
+        try
+        {
+            if (name == "--partitions")
+                partitions = std::max<std::size_t>(1, std::stoul(value));
+            else if (option == "--ladder")
+                prototype.defaultConfig.backend = LevelsBackend::ladder;
+            else if (name == "--ladder")
+            {
+                std::stringstream names(value);
+                std::string symbol;
+                while (std::getline(names, symbol, ','))
+                    prototype.symbolConfigs[symbols.intern(symbol)].backend = LevelsBackend::ladder;
+            }
+            else if (option == "--levels")
+                prototype.levelFeed = true;
+            else if (option == "--binary")
+                binary = true;
+            else if (name == "--golden")
+                goldenFile = value;
+            else if (option.rfind("--", 0) != 0 && inputFile == nullptr)
+                inputFile = argv[arg];
+            else
+                throw std::invalid_argument(option);
+        }
+        catch (const std::exception&)
+        {
+            std::cerr << "Invalid option " << option << "\n" << Usage;
+            return -1;
+        }
+    }
+    if (inputFile == nullptr)
+    {
+        std::cerr << Usage;
+        return -1;
+    }
+
+    std::vector<Command> commands;
+    std::unique_ptr<MappedFile> golden;
+    const auto start = std::chrono::steady_clock::now();
+    try
+    {
+        const MappedFile input(inputFile);
+        commands = parse_commands(input.begin(), input.end(), symbols);
+        if (!goldenFile.empty())
+            golden.reset(new MappedFile(goldenFile));
+    }
+    catch (const std::exception& e)
+    {
+        std::cerr << e.what() << "\n";
+        return -1;
+    }
+    const double parseSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    // the output is kept in memory when it is verified
+    const int fd = golden ? -1 : STDOUT_FILENO;
+    std::unique_ptr<OutputSink> sink;
+    if (binary)
+        sink.reset(new BinarySink(fd));
+    else
+        sink.reset(new TextSink(fd));
+    ReplayReport report;
+    try
+    {
+        report = replay_partitioned(commands, partitions, prototype, *sink);
+        sink->flush();
+    }
+    catch (const std::exception& e)
+    {
+        std::cerr << e.what() << "\n";
+        return -1;
+    }
+
+    for (std::size_t index = 0; index < report.partitions.size(); ++index)
+    {
+        const ReplayPartition& partition = report.partitions[index];
+        std::cerr << "partition " << index << ": " << partition.symbols << " symbols, " << partition.commands << " commands, "
+                  << partition.seconds << " s, " << double(partition.commands) / std::max(partition.seconds, 1e-9) / 1e6 << " M msgs/s\n";
+    }
+    std::cerr << commands.size() << " commands on " << report.partitions.size() << " partitions: parse " << parseSeconds
+              << " s, execute " << report.executeSeconds << " s, merge " << report.mergeSeconds << " s, "
+              << double(commands.size()) / std::max(report.executeSeconds + report.mergeSeconds, 1e-9) / 1e6 << " M msgs/s\n";
+
+    if (golden)
+    {
+        const std::string_view expected(golden->begin(), golden->size());
+        if (!verify(sink->buffered(), expected, binary, std::cerr))
+            return 1;
+        std::cerr << "output matches " << goldenFile << "\n";
+    }
+    return 0;
+}
@@ -0,0 +1,278 @@
+#include "commands.hpp"
+#include <algorithm>
+#include <iterator>
+#include <string>
+#include <tuple>
+#include <utility>
+
+using namespace engine;
+using orderbook::OrderbookListener;
+
+Orderbook& OrderbookManager::create(SymbolId symbol)
+{
+    if (symbol >= orderbooks.size())
+        orderbooks.resize(symbol + 1);
+    auto config = symbolConfigs.find(symbol);
+    orderbooks[symbol].reset(new Orderbook(config != symbolConfigs.end() ? config->second : defaultConfig));
+    return *orderbooks[symbol];
+}
+
+namespace {
+    using orderbook::OrderbookStats;
+
+    void add_stats(OrderbookStats& total, const OrderbookStats& stats)
+    {
+        auto& counters = total.counters;
+        counters.adds += stats.counters.adds;
+        counters.duplicates += stats.counters.duplicates;
+        counters.aggressiveOrders += stats.counters.aggressiveOrders;
+        counters.fills += stats.counters.fills;
+        counters.replenishments += stats.counters.replenishments;
+        counters.levelsSwept += stats.counters.levelsSwept;
+        counters.levelsCreated += stats.counters.levelsCreated;
+        counters.ordersRested += stats.counters.ordersRested;
+        counters.cancels += stats.counters.cancels;
+        counters.cancelMisses += stats.counters.cancelMisses;
+        counters.modifies += stats.counters.modifies;
+        counters.modifiesInPlace += stats.counters.modifiesInPlace;
+        counters.expired += stats.counters.expired;
+        counters.killed += stats.counters.killed;
+        counters.stopsTriggered += stats.counters.stopsTriggered;
+        counters.lockContended += stats.counters.lockContended;
+        counters.lockWaitNanos += stats.counters.lockWaitNanos;
+        total.askLevels += stats.askLevels;
+        total.bidLevels += stats.bidLevels;
+        total.restingOrders += stats.restingOrders;
+        total.indexedOrders += stats.indexedOrders;
+        total.allocatedNodes += stats.allocatedNodes;
+        total.pendingStops += stats.pendingStops;
+        total.bytesReserved += stats.bytesReserved;
+    }
+
+    void write_book_stats(std::ostream& o, const OrderbookStats& stats)
+    {
+        const auto& counters = stats.counters;
+        o << "levels " << stats.bidLevels << "/" << stats.askLevels << ", orders " << stats.restingOrders
+          << " (indexed " << stats.indexedOrders << ", nodes " << stats.allocatedNodes << "), bytes " << stats.bytesReserved << ", adds " << counters.adds << " (duplicates " << counters.duplicates
+          << ", aggressive " << counters.aggressiveOrders << ", rested " << counters.ordersRested << "), fills " << counters.fills << " (replenishments " << counters.replenishments << ")"
+          << ", levels created " << counters.levelsCreated << " swept " << counters.levelsSwept;
+        if (counters.aggressiveOrders)
+            o << " (" << double(counters.levelsSwept) / double(counters.aggressiveOrders) << " per aggressive order)";
+        o << ", cancels " << counters.cancels << " (misses " << counters.cancelMisses << "), modifies " << counters.modifies
+          << " (in place " << counters.modifiesInPlace << "), expired " << counters.expired << ", killed " << counters.killed << ", stops " << stats.pendingStops
+          << " (triggered " << counters.stopsTriggered << "), lock waits "
+          << counters.lockContended << " (" << counters.lockWaitNanos << " ns)\n";
+    }
+}
+
+void OrderbookManager::write_stats(std::ostream& o, const SymbolTable* symbols, std::size_t busiest) const
+{
+    OrderbookStats total;
+    std::vector<std::pair<SymbolId, OrderbookStats>> books;
+    for (SymbolId symbol = 0; symbol < orderbooks.size(); ++symbol)
+    {
+        if (!orderbooks[symbol])
+            continue;
+        books.emplace_back(symbol, orderbooks[symbol]->stats());
+        add_stats(total, books.back().second);
+    }
+    o << "stats " << books.size() << " books, " << restingOrders.size() << " orders indexed by symbol: ";
+    write_book_stats(o, total);
+
+    auto operations = [](const OrderbookStats& stats) { return stats.counters.adds + stats.counters.cancels; };
+    const std::size_t shown = std::min(busiest, books.size());
+    std::partial_sort(books.begin(), books.begin() + shown, books.end(), [&operations](const auto& left, const auto& right)
+        {
+            return operations(left.second) > operations(right.second);
+        });
+    for (std::size_t index = 0; index < shown; ++index)
+    {
+        o << "  ";
+        if (symbols)
+            o << symbols->name(books[index].first);
+        else
+            o << "#" << books[index].first;
+        o << ": ";
+        write_book_stats(o, books[index].second);
+    }
+}
+
+namespace {
+    // collects the changes of the book reported during a command
+    struct ChangesListener : OrderbookListener
+    {
+        std::vector<PendingChange>& changes;
+        const bool levelFeed;
+        ChangesListener(OrderbookManager& orderbooks) : changes(orderbooks.pendingChanges), levelFeed(orderbooks.levelFeed)
+        {
+            changes.clear();
+        }
+
+        void on_level(Orderside side, int price, int quantity)
+        {
+            if (levelFeed)
+                changes.push_back({ false, side, price, quantity });
+        }
+
+        void on_top_of_book(Orderside side, int price, int quantity)
+        {
+            changes.push_back({ true, side, price, quantity });
+        }
+
+        // the book reports the ask side first, once it is empty the bid side is not written
+        void write_top_of_book(OutputSink& sink) const
+        {
+            for (const auto& change : changes)
+            {
+                if (!change.topOfBook)
+                    continue;
+                sink.top_of_book(change.side, change.price, change.quantity);
+                if (change.side == Orderside::sell && change.quantity == -1)
+                    break;
+            }
+        }
+
+        // written even for an order which is not acknowledged, so that the feed follows every change of the book
+        void write_levels(OutputSink& sink) const
+        {
+            for (const auto& change : changes)
+            {
+                if (!change.topOfBook)
+                    sink.level(change.side, change.price, change.quantity);
+            }
+        }
+    };
+
+    // collects the trades of an order as they are matched and keeps the index of resting orders up to date
+    struct NewOrderListener : ChangesListener
+    {
+        OrderbookManager& orderbooks;
+        std::vector<PendingTrade>& trades;
+        SymbolId symbol;
+        bool rested = false;
+        NewOrderListener(OrderbookManager& orderbooks, SymbolId symbol) : ChangesListener(orderbooks), orderbooks(orderbooks), trades(orderbooks.pendingTrades), symbol(symbol)
+        {
+            trades.clear();
+        }
+
+        void on_fill(Orderside orderside, int bookClientId, int bookClientOrderId, int clientId, int clientOrderId, int price, int quantity)
+        {
+            if (orderside == Orderside::buy)
+                trades.push_back({ clientId, clientOrderId, bookClientId, bookClientOrderId, price, quantity });
+            else
+                trades.push_back({ bookClientId, bookClientOrderId, clientId, clientOrderId, price, quantity });
+        }
+
+        void on_filled(Orderside, int clientId, int orderId)
+        {
+            // the key may also rest in the book of another symbol
+            const auto range = orderbooks.restingOrders.equal_range(order_key(clientId, orderId));
+            for (auto ite = range.first; ite != range.second; ++ite)
+            {
+                if (ite->second.symbol == symbol)
+                {
+                    orderbooks.restingOrders.erase(ite);
+                    if (orderbooks.endedOrders)
+                        orderbooks.endedOrders->push_back(order_key(clientId, orderId));
+                    return;
+                }
+            }
+        }
+
+        void on_rested(int clientId, int orderId, orderbook::OrderHandle order)
+        {
+            orderbooks.restingOrders.emplace(order_key(clientId, orderId), IndexedOrder{ symbol, order });
+            rested = true;
+        }
+    };
+}
+
+namespace {
+    void execute_new_order(const Command& command, OrderbookManager& orderbooks, OutputSink& sink)
+    {
+        const auto& order = command.order;
+        Orderbook& orderbook = orderbooks[order.symbol];
+        NewOrderListener listener(orderbooks, order.symbol);
+        const bool accepted = orderbook.add_order(command.side, order.userId, order.orderId, order.price, order.quantity, listener);
+        if (!listener.rested && orderbooks.endedOrders)
+            orderbooks.endedOrders->push_back(order_key(order.userId, order.orderId));
+        if (accepted)
+        {
+            sink.acknowledged(order.userId, order.orderId);
+            for (const auto& trade : listener.trades)
+                sink.traded(trade.buyerId, trade.buyerOrderId, trade.sellerId, trade.sellerOrderId, trade.price, trade.quantity);
+        }
+        listener.write_levels(sink);
+        if (accepted)
+            listener.write_top_of_book(sink);
+    }
+
+    void cancel_indexed(const Command& command, const IndexedOrder& resting, OrderbookManager& orderbooks, OutputSink& sink)
+    {
+        ChangesListener listener(orderbooks);
+        orderbooks[resting.symbol].cancel_order(resting.handle, listener);
+        sink.cancelled(command.order.userId, command.order.orderId);
+        listener.write_levels(sink);
+        listener.write_top_of_book(sink);
+    }
+
+    void execute_cancel(const Command& command, OrderbookManager& orderbooks, OutputSink& sink)
+    {
+        const auto range = orderbooks.restingOrders.equal_range(order_key(command.order.userId, command.order.orderId));
+        if (range.first == range.second)
+            return;
+        if (orderbooks.endedOrders)
+        {
+            for (auto ite = range.first; ite != range.second; ++ite)
+                orderbooks.endedOrders->push_back(ite->first);
+        }
+        if (std::next(range.first) == range.second)
+        {
+            const IndexedOrder resting = range.first->second;
+            orderbooks.restingOrders.erase(range.first);
+            cancel_indexed(command, resting, orderbooks, sink);
+            return;
+        }
+        // a reused key is cancelled in every book holding it, by symbol name as when the books were kept by name
+        std::vector<std::pair<std::string, IndexedOrder>> resting;
+        for (auto ite = range.first; ite != range.second; ++ite)
+            resting.emplace_back(orderbooks.symbols ? orderbooks.symbols->shared_name(ite->second.symbol) : std::string(), ite->second);
+        orderbooks.restingOrders.erase(range.first, range.second);
+        std::sort(resting.begin(), resting.end(), [](const auto& left, const auto& right)
+            {
+                return std::tie(left.first, left.second.symbol) < std::tie(right.first, right.second.symbol);
+            });
+        for (const auto& order : resting)
+            cancel_indexed(command, order.second, orderbooks, sink);
+    }
+}
+
+void engine::execute(const Command& command, OrderbookManager& orderbooks, OutputSink& sink)
+{
+    switch (command.type)
+    {
+    case CommandType::text:
+        sink.text(command.line(), false);
+        break;
+    case CommandType::print:
+        sink.text(command.line(), true);
+        break;
+    case CommandType::newOrder:
+        execute_new_order(command, orderbooks, sink);
+        break;
+    case CommandType::cancel:
+        execute_cancel(command, orderbooks, sink);
+        break;
+    case CommandType::flush:
+        if (orderbooks.endedOrders)
+        {
+            for (const auto& resting : orderbooks.restingOrders)
+                orderbooks.endedOrders->push_back(resting.first);
+        }
+        orderbooks.clear();
+        sink.flushed();
+        break;
+    case CommandType::none:
+        break;
+    }
+}
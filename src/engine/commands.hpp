@@ -0,0 +1,128 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <ostream>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include "orderbook/orderbook.hpp"
+#include "output.hpp"
+#include "symbols.hpp"
+
+namespace engine {
+    using orderbook::Orderbook;
+    using orderbook::OrderbookConfig;
+    using orderbook::Orderside;
+
+    // trade of a new order, held back until the order is acknowledged
+    struct PendingTrade
+    {
+        int buyerId, buyerOrderId, sellerId, sellerOrderId, price, quantity;
+    };
+
+    // change of the book reported by an order or a cancel, written after its acknowledgement and trades
+    struct PendingChange
+    {
+        bool topOfBook; // best level of side changed, a level otherwise
+        Orderside side;
+        int price, quantity;
+    };
+
+    // (userId, orderId) packed in a single integer
+    inline std::uint64_t order_key(int userId, int orderId)
+    {
+        return (std::uint64_t(std::uint32_t(userId)) << 32) | std::uint32_t(orderId);
+    }
+
+    // resting order in the index of the engine
+    struct IndexedOrder
+    {
+        SymbolId symbol;
+        orderbook::OrderHandle handle; // cancels the order in the book of symbol without looking it up
+    };
+
+    // owns the orderbook of every symbol, books are created on first use with the config of their symbol
+    // cancels go to the book the order rests in, to each of them in order of symbol name if (userId, orderId) was
+    // reused across symbols
+    struct OrderbookManager
+    {
+        std::vector<std::unique_ptr<Orderbook>> orderbooks; // indexed by symbol id, null until first use
+        OrderbookConfig defaultConfig;
+        std::map<SymbolId, OrderbookConfig> symbolConfigs;
+        const SymbolTable* symbols = nullptr; // names of the symbol ids, without it a reused key is cancelled by id
+        // book and handle of every resting order by order_key, updated by execute on add, fill, cancel and flush
+        // a key reused across symbols has an entry per book it rests in
+        std::unordered_multimap<std::uint64_t, IndexedOrder> restingOrders;
+        bool levelFeed = false; // also write the change of every level, not only of the best ones
+        // when set, execute appends the key of every new order once it no longer rests: not rested, filled,
+        // cancelled or flushed, for the router of ShardedEngine
+        std::vector<std::uint64_t>* endedOrders = nullptr;
+        std::vector<PendingTrade> pendingTrades; // scratch space of execute, reused across commands
+        std::vector<PendingChange> pendingChanges;
+
+        Orderbook& operator[](SymbolId symbol)
+        {
+            if (symbol < orderbooks.size() && orderbooks[symbol])
+                return *orderbooks[symbol];
+            return create(symbol);
+        }
+        // writes the totals of every book and the stats of the busiest ones, by adds and cancels
+        // books are named from symbols when given, by id otherwise
+        void write_stats(std::ostream& o, const SymbolTable* symbols, std::size_t busiest = 10) const;
+        auto begin() { return orderbooks.begin(); }
+        auto end() { return orderbooks.end(); }
+        void clear()
+        {
+            orderbooks.clear();
+            restingOrders.clear();
+        }
+
+    private:
+        Orderbook& create(SymbolId symbol);
+    };
+
+    enum class CommandType : std::uint8_t {
+        none,
+        text,     // part of a comment line, more parts follow
+        print,    // last part of a comment line
+        newOrder,
+        cancel,
+        flush
+    };
+
+    /**
+     * @brief Fixed size record of an input command
+     * Symbols are interned by the parser, orders only carry the id.
+     * Comment lines longer than TextCapacity are split in several records, all but the last are of type text.
+     */
+    struct Command
+    {
+        struct OrderFields
+        {
+            int userId;
+            int orderId; // userId and orderId are the only fields of a cancel
+            int price;
+            int quantity;
+            SymbolId symbol;
+        };
+        static constexpr std::size_t TextCapacity = sizeof(OrderFields);
+
+        CommandType type = CommandType::none;
+        std::uint8_t length = 0; // bytes used in text
+        Orderside side = Orderside::buy;
+        union
+        {
+            OrderFields order;
+            char text[TextCapacity];
+        };
+
+        std::string_view line() const { return std::string_view(text, length); }
+    };
+    static_assert(sizeof(Command) == 24, "commands should stay compact");
+
+    // applies command to the books and writes its events to sink
+    void execute(const Command& command, OrderbookManager& orderbooks, OutputSink& sink);
+}
@@ -0,0 +1,402 @@
+#include "journal.hpp"
+#include "little_endian.hpp"
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cinttypes>
+#include <cstdio>
+#include <cstring>
+#include <dirent.h>
+#include <fcntl.h>
+#include <stdexcept>
+#include <unistd.h>
+
+using namespace engine;
+
+namespace {
+    enum RecordKind : std::uint8_t { End = 0, CommandRecord = 1, SymbolPart = 2, SymbolLast = 3 };
+    constexpr std::size_t NameCapacity = 16;
+
+    std::uint8_t check_byte(const char* record)
+    {
+        std::uint32_t value = 2166136261u;
+        for (std::size_t index = 0; index < JournalRecordSize; ++index)
+        {
+            if (index != 1)
+                value = (value ^ static_cast<unsigned char>(record[index])) * 16777619u;
+        }
+        return std::uint8_t(value ^ (value >> 8) ^ (value >> 16) ^ (value >> 24));
+    }
+
+    void seal(JournalRecord& record, RecordKind kind)
+    {
+        record.bytes[0] = char(kind);
+        record.bytes[1] = char(check_byte(record.bytes));
+    }
+
+    JournalRecord encode_command(const Command& command)
+    {
+        JournalRecord record = {};
+        record.bytes[2] = char(command.type);
+        if (command.type == CommandType::text || command.type == CommandType::print)
+        {
+            record.bytes[3] = char(command.length);
+            std::memcpy(record.bytes + 4, command.text, command.length);
+        }
+        else if (command.type == CommandType::newOrder || command.type == CommandType::cancel)
+        {
+            record.bytes[3] = char(command.side);
+            const auto& order = command.order;
+            store_le(record.bytes + 4, order.userId);
+            store_le(record.bytes + 8, order.orderId);
+            if (command.type == CommandType::newOrder)
+            {
+                store_le(record.bytes + 12, order.price);
+                store_le(record.bytes + 16, order.quantity);
+                store_le(record.bytes + 20, std::uint32_t(order.symbol), 4);
+            }
+        }
+        seal(record, CommandRecord);
+        return record;
+    }
+
+    // name of symbol id split in records of NameCapacity bytes
+    template<typename Emit>
+    void encode_symbol(SymbolId id, std::string_view name, Emit emit)
+    {
+        do
+        {
+            const std::size_t length = std::min(name.size(), NameCapacity);
+            JournalRecord record = {};
+            record.bytes[2] = char(length);
+            store_le(record.bytes + 4, id, 4);
+            std::memcpy(record.bytes + 8, name.data(), length);
+            name.remove_prefix(length);
+            seal(record, name.empty() ? SymbolLast : SymbolPart);
+            emit(record);
+        } while (!name.empty());
+    }
+
+    void write_all(int fd, const char* data, std::size_t size, std::size_t offset)
+    {
+        while (size > 0)
+        {
+            const ssize_t count = ::pwrite(fd, data, size, off_t(offset));
+            if (count < 0)
+            {
+                if (errno == EINTR)
+                    continue;
+                throw std::runtime_error(std::string("Cannot write journal: ") + std::strerror(errno));
+            }
+            data += count;
+            size -= std::size_t(count);
+            offset += std::size_t(count);
+        }
+    }
+
+    std::string segment_path(const std::string& directory, std::uint64_t sequence)
+    {
+        char name[48];
+        std::snprintf(name, sizeof(name), "/journal-%020" PRIu64 ".log", sequence);
+        return directory + name;
+    }
+}
+
+JournalWriter::JournalWriter(const std::string& directory, const SymbolTable& symbols, std::uint64_t firstSequence, const JournalConfig& config)
+    : directory(directory), symbols(symbols), config(config), ring(config.ringCapacity), appendedSequence(firstSequence),
+      durableSequence(firstSequence), segmentRecords(config.segmentBytes / JournalRecordSize), writtenSequence(firstSequence)
+{
+    open_segment(firstSequence);
+    thread = std::thread(&JournalWriter::run, this);
+}
+
+JournalWriter::~JournalWriter()
+{
+    try
+    {
+        finish();
+    }
+    catch (const std::exception&)
+    {
+    }
+}
+
+void JournalWriter::push(const JournalRecord& record)
+{
+    JournalRecord copy = record;
+    while (!ring.try_push(std::move(copy)))
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (error)
+                throw std::runtime_error("journal I/O thread stopped");
+        }
+        std::this_thread::yield();
+    }
+}
+
+std::uint64_t JournalWriter::append(const Command& command)
+{
+    if (command.type == CommandType::newOrder)
+    {
+        const SymbolId symbol = command.order.symbol;
+        if (symbol >= journaled.size())
+            journaled.resize(symbol + 1);
+        if (!journaled[symbol])
+        {
+            // the name is copied under the lock of the table, the parsing thread may be interning new symbols
+            encode_symbol(symbol, symbols.shared_name(symbol), [this](const JournalRecord& record) { push(record); });
+            journaled[symbol] = true;
+        }
+    }
+    push(encode_command(command));
+    const std::uint64_t sequence = appendedSequence.load(std::memory_order_relaxed);
+    appendedSequence.store(sequence + 1, std::memory_order_release);
+    // pairs with the fence of the I/O thread going to sleep, so that one of them sees the other
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (sleeping.load(std::memory_order_relaxed))
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        wakeUp.notify_one();
+    }
+    return sequence;
+}
+
+void JournalWriter::wait_durable(std::uint64_t sequence)
+{
+    if (durable() >= sequence)
+        return;
+    std::unique_lock<std::mutex> lock(mutex);
+    progress.wait(lock, [this, sequence]() { return durable() >= sequence || error; });
+    if (durable() < sequence)
+        std::rethrow_exception(error);
+}
+
+void JournalWriter::finish()
+{
+    if (thread.joinable())
+    {
+        stopping.store(true, std::memory_order_release);
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            wakeUp.notify_one();
+        }
+        thread.join();
+        if (!error)
+        {
+            try
+            {
+                close_segment();
+            }
+            catch (...)
+            {
+                error = std::current_exception();
+            }
+        }
+    }
+    if (error)
+    {
+        const std::exception_ptr failed = error;
+        error = nullptr;
+        std::rethrow_exception(failed);
+    }
+}
+
+void JournalWriter::run()
+{
+    const std::size_t batchRecords = std::max<std::size_t>(1, config.batchBytes / JournalRecordSize);
+    std::vector<JournalRecord> batch;
+    batch.reserve(batchRecords);
+    try
+    {
+        while (true)
+        {
+            batch.clear();
+            JournalRecord record;
+            while (batch.size() < batchRecords && ring.try_pop(record))
+                batch.push_back(record);
+            if (!batch.empty())
+            {
+                write_batch(batch);
+                continue;
+            }
+            if (stopping.load(std::memory_order_acquire))
+            {
+                // everything pushed before finish was called is in the ring
+                if (!ring.try_pop(record))
+                    break;
+                batch.push_back(record);
+                write_batch(batch);
+                continue;
+            }
+            std::unique_lock<std::mutex> lock(mutex);
+            sleeping.store(true, std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            if (appendedSequence.load(std::memory_order_acquire) == writtenSequence && !stopping.load(std::memory_order_acquire))
+                wakeUp.wait_for(lock, std::chrono::milliseconds(1)); // bounded, symbol records do not wake it up
+            sleeping.store(false, std::memory_order_relaxed);
+        }
+    }
+    catch (...)
+    {
+        publish(writtenSequence, std::current_exception());
+    }
+}
+
+void JournalWriter::write_batch(const std::vector<JournalRecord>& batch)
+{
+    std::size_t index = 0;
+    while (index < batch.size())
+    {
+        if (segmentUsed == segmentRecords)
+        {
+            close_segment();
+            open_segment(writtenSequence);
+        }
+        const std::size_t count = std::min(batch.size() - index, segmentRecords - segmentUsed);
+        write_all(fd, batch[index].bytes, count * JournalRecordSize, segmentUsed * JournalRecordSize);
+        for (std::size_t written = index; written < index + count; ++written)
+        {
+            const char* record = batch[written].bytes;
+            if (record[0] == CommandRecord)
+            {
+                ++writtenSequence;
+                continue;
+            }
+            // names are kept to start the next segments with them
+            const SymbolId id = SymbolId(load_le(record + 4, 4));
+            if (id >= names.size())
+                names.resize(id + 1);
+            if (partial.empty())
+                names[id].clear();
+            names[id].append(record + 8, std::size_t(std::uint8_t(record[2])));
+            if (record[0] == SymbolPart)
+                partial.push_back(batch[written]);
+            else
+                partial.clear();
+        }
+        segmentUsed += count;
+        index += count;
+    }
+    // preallocated segments do not change size, a data sync is enough
+    if (config.sync == JournalSync::group && ::fdatasync(fd) != 0)
+        throw std::runtime_error(std::string("Cannot sync journal: ") + std::strerror(errno));
+    publish(writtenSequence);
+}
+
+void JournalWriter::open_segment(std::uint64_t sequence)
+{
+    const std::string path = segment_path(directory, sequence);
+    fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_EXCL, 0644);
+    if (fd < 0)
+        throw std::runtime_error("Cannot create journal segment " + path + ": " + std::strerror(errno));
+    const std::size_t bytes = segmentRecords * JournalRecordSize;
+    const int allocated = ::posix_fallocate(fd, 0, off_t(bytes));
+    if (allocated != 0 && ::ftruncate(fd, off_t(bytes)) != 0)
+        throw std::runtime_error("Cannot preallocate journal segment " + path + ": " + std::strerror(allocated));
+    // the new file must survive a crash as well as its content
+    const int directoryFd = ::open(directory.c_str(), O_RDONLY | O_DIRECTORY);
+    if (directoryFd >= 0)
+    {
+        ::fsync(directoryFd);
+        ::close(directoryFd);
+    }
+
+    // the known names and the beginning of a split one come first so that replay can start here
+    std::vector<JournalRecord> preamble;
+    for (SymbolId id = 0; id < names.size(); ++id)
+    {
+        const bool beingSplit = !partial.empty() && SymbolId(load_le(partial.front().bytes + 4, 4)) == id;
+        if (!names[id].empty() && !beingSplit)
+            encode_symbol(id, names[id], [&preamble](const JournalRecord& record) { preamble.push_back(record); });
+    }
+    preamble.insert(preamble.end(), partial.begin(), partial.end());
+    if (preamble.size() >= segmentRecords)
+        throw std::runtime_error("journal segments are too small for the symbols");
+    if (!preamble.empty())
+        write_all(fd, preamble.front().bytes, preamble.size() * JournalRecordSize, 0);
+    segmentUsed = preamble.size();
+}
+
+void JournalWriter::close_segment()
+{
+    if (fd < 0)
+        return;
+    const int synced = ::fdatasync(fd);
+    ::close(fd);
+    fd = -1;
+    if (synced != 0)
+        throw std::runtime_error(std::string("Cannot sync journal: ") + std::strerror(errno));
+}
+
+void JournalWriter::publish(std::uint64_t sequence, std::exception_ptr failure)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    durableSequence.store(sequence, std::memory_order_release);
+    if (failure)
+        error = failure;
+    progress.notify_all();
+}
+
+JournalReader::JournalReader(const std::string& directory)
+{
+    DIR* listing = ::opendir(directory.c_str());
+    if (listing == nullptr)
+        throw std::runtime_error("Cannot read journal directory " + directory);
+    while (const dirent* entry = ::readdir(listing))
+    {
+        const std::string name = entry->d_name;
+        constexpr std::size_t NameLength = 8 + 20 + 4; // journal-<sequence>.log
+        if (name.size() != NameLength || name.compare(0, 8, "journal-") != 0 || name.compare(28, 4, ".log") != 0)
+            continue;
+        segments.push_back(Segment{std::strtoull(name.c_str() + 8, nullptr, 10), directory + "/" + name});
+    }
+    ::closedir(listing);
+    std::sort(segments.begin(), segments.end(), [](const Segment& left, const Segment& right) { return left.sequence < right.sequence; });
+}
+
+JournalReader::Decoded JournalReader::decode(const char* record, SymbolTable& symbols, Command& command)
+{
+    const auto kind = std::uint8_t(record[0]);
+    if (kind == End || kind > SymbolLast || std::uint8_t(record[1]) != check_byte(record))
+        return Decoded::end;
+    if (kind != CommandRecord)
+    {
+        pendingName.append(record + 8, std::min<std::size_t>(std::uint8_t(record[2]), NameCapacity));
+        if (kind == SymbolLast)
+        {
+            const SymbolId id = SymbolId(load_le(record + 4, 4));
+            if (id >= remap.size())
+                remap.resize(id + 1, SymbolTable::None);
+            remap[id] = symbols.intern(pendingName);
+            pendingName.clear();
+        }
+        return Decoded::symbol;
+    }
+
+    command = Command();
+    command.type = CommandType(record[2]);
+    if (command.type == CommandType::text || command.type == CommandType::print)
+    {
+        command.length = std::min<std::uint8_t>(std::uint8_t(record[3]), std::uint8_t(Command::TextCapacity));
+        std::memcpy(command.text, record + 4, command.length);
+    }
+    else if (command.type == CommandType::newOrder || command.type == CommandType::cancel)
+    {
+        command.side = Orderside(record[3]);
+        auto& order = command.order;
+        order.userId = load_le(record + 4);
+        order.orderId = load_le(record + 8);
+        order.price = load_le(record + 12);
+        order.quantity = load_le(record + 16);
+        order.symbol = SymbolTable::None;
+        if (command.type == CommandType::newOrder)
+        {
+            const SymbolId id = SymbolId(load_le(record + 20, 4));
+            if (id >= remap.size() || remap[id] == SymbolTable::None)
+                throw std::runtime_error("journal order on an unknown symbol");
+            order.symbol = remap[id];
+        }
+    }
+    return Decoded::command;
+}
@@ -0,0 +1,172 @@
+#pragma once
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "commands.hpp"
+#include "parser.hpp"
+#include "spsc_queue.hpp"
+#include "symbols.hpp"
+
+namespace engine {
+    enum class JournalSync : std::uint8_t {
+        group, // one fdatasync per batch of records, output waits for its commands to be synced
+        async  // records are written without waiting for the disk, segments are synced when closed
+    };
+
+    struct JournalConfig
+    {
+        JournalSync sync = JournalSync::group;
+        std::size_t segmentBytes = std::size_t(64) << 20; // preallocated size of a segment file
+        std::size_t batchBytes = std::size_t(256) << 10;  // most bytes written per write and sync
+        std::size_t ringCapacity = std::size_t(1) << 16;  // records between the executing and the I/O thread
+    };
+
+    /**
+     * Journal format: segment files journal-<sequence of their first command, 20 digits>.log, preallocated and
+     * filled with RecordSize bytes records, a record starting with a zero byte ends the segment:
+     * - byte 0 : kind, 1 command, 2 part of a symbol name, 3 last part of a symbol name
+     * - byte 1 : check byte of the other 23 bytes
+     * - command : type (u8), side (u8) or text length (u8), then userId, orderId, price, quantity, symbol (i32)
+     *   or up to 20 bytes of text
+     * - symbol : name length in this record (u8), padding (u8), id (u32), up to 16 bytes of name
+     * Commands are numbered from the sequence of their segment. Symbol ids are the ones of the writer, every
+     * segment starts with the names of the symbols used before it so that replay can start from any segment.
+     */
+    constexpr std::size_t JournalRecordSize = 24;
+    struct JournalRecord
+    {
+        char bytes[JournalRecordSize];
+    };
+
+    /**
+     * @brief Append only journal of the executed commands, written by a dedicated I/O thread
+     * The executing thread only encodes records into a ring buffer. The I/O thread writes everything it finds in
+     * the ring with a single write, syncs it in group mode and then publishes how many commands are durable.
+     */
+    class JournalWriter
+    {
+    public:
+        // starts a new segment in directory numbered from firstSequence, throws std::runtime_error if it can not be created
+        JournalWriter(const std::string& directory, const SymbolTable& symbols, std::uint64_t firstSequence, const JournalConfig& config = JournalConfig());
+        JournalWriter(const JournalWriter&) = delete;
+        JournalWriter& operator=(const JournalWriter&) = delete;
+        // finishes the journal, errors are lost, call finish to get them
+        ~JournalWriter();
+
+        // adds command to the journal and returns its sequence, from the executing thread only
+        std::uint64_t append(const Command& command);
+        // sequence after the last appended command
+        std::uint64_t appended() const { return appendedSequence.load(std::memory_order_acquire); }
+        // sequence after the last command durable in the journal, written but maybe not synced in async mode
+        std::uint64_t durable() const { return durableSequence.load(std::memory_order_acquire); }
+        // blocks until the commands before sequence are durable, throws std::runtime_error if the I/O thread failed
+        void wait_durable(std::uint64_t sequence);
+        // writes and syncs the commands appended so far and stops the I/O thread, throws its error
+        void finish();
+
+    private:
+        void push(const JournalRecord& record);
+        void run();
+        void write_batch(const std::vector<JournalRecord>& batch);
+        void open_segment(std::uint64_t sequence);
+        void close_segment();
+        void publish(std::uint64_t sequence, std::exception_ptr failure = nullptr);
+
+        const std::string directory;
+        const SymbolTable& symbols;
+        const JournalConfig config;
+        SpscQueue<JournalRecord> ring;
+        std::vector<bool> journaled; // symbols whose name was appended, by id
+
+        // executing thread
+        std::atomic<std::uint64_t> appendedSequence;
+        // I/O thread
+        std::atomic<std::uint64_t> durableSequence;
+        std::vector<std::string> names; // of the journaled symbols, written again at the start of every segment
+        std::vector<JournalRecord> partial; // records of a name whose last part was not written yet
+        int fd = -1;
+        std::size_t segmentRecords = 0; // capacity of a segment
+        std::size_t segmentUsed = 0;
+        std::uint64_t writtenSequence; // after the last command written
+
+        std::atomic<bool> stopping{false};
+        std::atomic<bool> sleeping{false};
+        std::mutex mutex;
+        std::condition_variable wakeUp;  // records were pushed while the I/O thread was sleeping
+        std::condition_variable progress; // durableSequence advanced or error was set
+        std::exception_ptr error;
+        std::thread thread;
+    };
+
+    /**
+     * @brief Reads the commands of a journal directory back from its mapped segments
+     */
+    class JournalReader
+    {
+    public:
+        // lists the segments of directory, throws std::runtime_error if it can not be read
+        explicit JournalReader(const std::string& directory);
+
+        // calls emit(const Command&) for every command from sequence from on, with its symbol interned in symbols
+        // returns the sequence after the last command, a torn record ends the journal if nothing follows it
+        // throws std::runtime_error if segments are missing, overlap or are corrupted
+        template<typename Emit>
+        std::uint64_t replay(SymbolTable& symbols, std::uint64_t from, Emit emit);
+
+    private:
+        struct Segment
+        {
+            std::uint64_t sequence; // of its first command
+            std::string path;
+        };
+        enum class Decoded { end, command, symbol };
+        // decodes record, symbol names are collected until their last part
+        Decoded decode(const char* record, SymbolTable& symbols, Command& command);
+
+        std::vector<Segment> segments; // by sequence
+        std::vector<SymbolId> remap;   // journal symbol id to id in symbols, None if unknown
+        std::string pendingName;
+    };
+
+    template<typename Emit>
+    std::uint64_t JournalReader::replay(SymbolTable& symbols, std::uint64_t from, Emit emit)
+    {
+        // the last segment starting at or before from holds it
+        std::size_t first = 0;
+        while (first + 1 < segments.size() && segments[first + 1].sequence <= from)
+            ++first;
+        remap.clear();
+        std::uint64_t sequence = first < segments.size() ? segments[first].sequence : from;
+        if (sequence > from)
+            throw std::runtime_error("journal starts after the requested sequence");
+        for (std::size_t index = first; index < segments.size(); ++index)
+        {
+            if (segments[index].sequence != sequence)
+                throw std::runtime_error("journal segment " + segments[index].path + " does not follow the previous one");
+            const MappedFile file(segments[index].path);
+            pendingName.clear(); // a name split at the end of the previous segment is repeated at the start of this one
+            Command command;
+            for (const char* record = file.begin(); record + JournalRecordSize <= file.end(); record += JournalRecordSize)
+            {
+                const Decoded decoded = decode(record, symbols, command);
+                if (decoded == Decoded::end)
+                {
+                    if (record[0] != 0 && index + 1 < segments.size())
+                        throw std::runtime_error("corrupted journal segment " + segments[index].path);
+                    break;
+                }
+                if (decoded == Decoded::command && sequence++ >= from)
+                    emit(command);
+            }
+        }
+        return sequence;
+    }
+}
@@ -0,0 +1,25 @@
+#pragma once
+#include <cstdint>
+
+namespace engine {
+    // fixed width little endian fields of the binary formats, independent of the host byte order
+
+    inline void store_le(char* out, std::uint64_t value, int bytes)
+    {
+        for (int index = 0; index < bytes; ++index)
+            out[index] = char(value >> (8 * index));
+    }
+    inline std::uint64_t load_le(const char* in, int bytes)
+    {
+        const auto data = reinterpret_cast<const unsigned char*>(in);
+        std::uint64_t value = 0;
+        for (int index = 0; index < bytes; ++index)
+            value |= std::uint64_t(data[index]) << (8 * index);
+        return value;
+    }
+
+    inline void store_le(char* out, std::int32_t value) { store_le(out, std::uint32_t(value), 4); }
+    inline std::int32_t load_le(const char* in) { return std::int32_t(std::uint32_t(load_le(in, 4))); }
+    inline void store_le64(char* out, std::uint64_t value) { store_le(out, value, 8); }
+    inline std::uint64_t load_le64(const char* in) { return load_le(in, 8); }
+}
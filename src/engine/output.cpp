@@ -0,0 +1,279 @@
+#include "output.hpp"
+#include "little_endian.hpp"
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <unistd.h>
+
+using namespace engine;
+
+OutputSink::OutputSink(int fd, std::size_t capacity) : fd(fd), buffer(capacity)
+{
+}
+
+OutputSink::~OutputSink()
+{
+    try
+    {
+        flush();
+    }
+    catch (const std::exception&)
+    {
+    }
+}
+
+void OutputSink::flush()
+{
+    if (fd < 0 || used == 0)
+        return;
+    if (beforeWrite)
+        beforeWrite();
+    std::size_t written = 0;
+    while (written < used)
+    {
+        const ssize_t count = ::write(fd, buffer.data() + written, used - written);
+        if (count < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            used = 0;
+            throw std::runtime_error(std::string("Cannot write output: ") + std::strerror(errno));
+        }
+        written += std::size_t(count);
+    }
+    used = 0;
+}
+
+void OutputSink::make_room(std::size_t bytes)
+{
+    if (fd >= 0)
+        flush();
+    if (buffer.size() - used < bytes)
+        buffer.resize(std::max(buffer.size() * 2, used + bytes));
+}
+
+namespace {
+    // longest text event: "T, " and six integers with their separators
+    constexpr std::size_t MaxLineSize = 3 + 6 * (11 + 2) + 1;
+
+    char* append(char* out, const char* text, std::size_t length)
+    {
+        std::memcpy(out, text, length);
+        return out + length;
+    }
+
+    template<std::size_t Length>
+    char* append(char* out, const char (&text)[Length])
+    {
+        return append(out, text, Length - 1);
+    }
+
+    // integer to decimal ascii, digits are produced backwards in a small scratch buffer
+    char* append(char* out, int value)
+    {
+        char digits[12];
+        char* position = digits + sizeof(digits);
+        unsigned magnitude = value < 0 ? 0u - unsigned(value) : unsigned(value);
+        do
+        {
+            *--position = char('0' + magnitude % 10);
+            magnitude /= 10;
+        } while (magnitude);
+        if (value < 0)
+            *--position = '-';
+        return append(out, position, std::size_t(digits + sizeof(digits) - position));
+    }
+}
+
+void TextSink::acknowledged(int userId, int orderId)
+{
+    char* out = reserve(MaxLineSize);
+    out = append(out, "A, ");
+    out = append(out, userId);
+    out = append(out, ", ");
+    out = append(out, orderId);
+    *out++ = '\n';
+    commit(out);
+}
+
+void TextSink::cancelled(int userId, int orderId)
+{
+    char* out = reserve(MaxLineSize);
+    out = append(out, "C, ");
+    out = append(out, userId);
+    out = append(out, ", ");
+    out = append(out, orderId);
+    *out++ = '\n';
+    commit(out);
+}
+
+void TextSink::traded(int buyerId, int buyerOrderId, int sellerId, int sellerOrderId, int price, int quantity)
+{
+    char* out = reserve(MaxLineSize);
+    out = append(out, "T, ");
+    out = append(out, buyerId);
+    out = append(out, ", ");
+    out = append(out, buyerOrderId);
+    out = append(out, ", ");
+    out = append(out, sellerId);
+    out = append(out, ", ");
+    out = append(out, sellerOrderId);
+    out = append(out, ", ");
+    out = append(out, price);
+    out = append(out, ", ");
+    out = append(out, quantity);
+    *out++ = '\n';
+    commit(out);
+}
+
+void TextSink::top_of_book(Orderside side, int price, int quantity)
+{
+    char* out = reserve(MaxLineSize);
+    out = append(out, side == Orderside::buy ? "B, B, " : "B, S, ");
+    if (quantity == -1)
+    {
+        out = append(out, "-, -");
+    }
+    else
+    {
+        out = append(out, price);
+        out = append(out, ", ");
+        out = append(out, quantity);
+    }
+    *out++ = '\n';
+    commit(out);
+}
+
+void TextSink::level(Orderside side, int price, int quantity)
+{
+    char* out = reserve(MaxLineSize);
+    out = append(out, side == Orderside::buy ? "L, B, " : "L, S, ");
+    out = append(out, price);
+    out = append(out, ", ");
+    out = append(out, quantity);
+    *out++ = '\n';
+    commit(out);
+}
+
+void TextSink::text(std::string_view text, bool endOfLine)
+{
+    char* out = append(reserve(text.size() + 1), text.data(), text.size());
+    if (endOfLine)
+        *out++ = '\n';
+    commit(out);
+}
+
+void TextSink::flushed()
+{
+    char* out = reserve(1);
+    *out++ = '\n';
+    commit(out);
+}
+
+char* BinarySink::event(EventType type, std::uint8_t detail)
+{
+    char* out = reserve(EventSize);
+    std::memset(out, 0, EventSize);
+    out[0] = char(type);
+    out[1] = char(detail);
+    commit(out + EventSize);
+    return out + 4;
+}
+
+void BinarySink::acknowledged(int userId, int orderId)
+{
+    char* fields = event(EventType::acknowledged, 0);
+    store_le(fields, userId);
+    store_le(fields + 4, orderId);
+}
+
+void BinarySink::cancelled(int userId, int orderId)
+{
+    char* fields = event(EventType::cancelled, 0);
+    store_le(fields, userId);
+    store_le(fields + 4, orderId);
+}
+
+void BinarySink::traded(int buyerId, int buyerOrderId, int sellerId, int sellerOrderId, int price, int quantity)
+{
+    char* fields = event(EventType::traded, 0);
+    store_le(fields, buyerId);
+    store_le(fields + 4, buyerOrderId);
+    store_le(fields + 8, sellerId);
+    store_le(fields + 12, sellerOrderId);
+    store_le(fields + 16, price);
+    store_le(fields + 20, quantity);
+}
+
+void BinarySink::top_of_book(Orderside side, int price, int quantity)
+{
+    char* fields = event(EventType::topOfBook, side == Orderside::buy ? 0 : 1);
+    store_le(fields, price);
+    store_le(fields + 4, quantity);
+}
+
+void BinarySink::level(Orderside side, int price, int quantity)
+{
+    char* fields = event(EventType::level, side == Orderside::buy ? 0 : 1);
+    store_le(fields, price);
+    store_le(fields + 4, quantity);
+}
+
+void BinarySink::text(std::string_view text, bool endOfLine)
+{
+    do
+    {
+        const std::size_t length = std::min(text.size(), TextCapacity);
+        text.remove_prefix(length);
+        const bool last = endOfLine && text.empty();
+        char* fields = event(last ? EventType::textLine : EventType::text, std::uint8_t(length));
+        std::memcpy(fields, text.data() - length, length);
+    } while (!text.empty());
+}
+
+void BinarySink::flushed()
+{
+    event(EventType::flushed, 0);
+}
+
+void engine::replay_events(std::string_view events, OutputSink& sink)
+{
+    if (events.size() % BinarySink::EventSize)
+        throw std::runtime_error("truncated event stream");
+    for (const char* event = events.data(); event != events.data() + events.size(); event += BinarySink::EventSize)
+    {
+        const char* fields = event + 4;
+        const auto detail = std::uint8_t(event[1]);
+        switch (EventType(event[0]))
+        {
+        case EventType::acknowledged:
+            sink.acknowledged(load_le(fields), load_le(fields + 4));
+            break;
+        case EventType::cancelled:
+            sink.cancelled(load_le(fields), load_le(fields + 4));
+            break;
+        case EventType::traded:
+            sink.traded(load_le(fields), load_le(fields + 4), load_le(fields + 8), load_le(fields + 12), load_le(fields + 16), load_le(fields + 20));
+            break;
+        case EventType::topOfBook:
+            sink.top_of_book(detail ? Orderside::sell : Orderside::buy, load_le(fields), load_le(fields + 4));
+            break;
+        case EventType::level:
+            sink.level(detail ? Orderside::sell : Orderside::buy, load_le(fields), load_le(fields + 4));
+            break;
+        case EventType::text:
+        case EventType::textLine:
+            if (detail > BinarySink::TextCapacity)
+                throw std::runtime_error("malformed text event");
+            sink.text(std::string_view(fields, detail), EventType(event[0]) == EventType::textLine);
+            break;
+        case EventType::flushed:
+            sink.flushed();
+            break;
+        default:
+            throw std::runtime_error("unknown event type");
+        }
+    }
+}
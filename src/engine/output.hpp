@@ -0,0 +1,132 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <string_view>
+#include <vector>
+
+#include "orderbook/orderside.hpp"
+
+namespace engine {
+    using orderbook::Orderside;
+
+    /**
+     * @brief Destination of the events produced by the engine
+     * Events are encoded into a reusable buffer which is written to the file descriptor with a single
+     * write when it is full or on flush. Without a file descriptor the buffer keeps growing and can be
+     * read back with buffered().
+     */
+    class OutputSink
+    {
+    public:
+        static constexpr std::size_t DefaultCapacity = 1 << 20;
+
+        explicit OutputSink(int fd = -1, std::size_t capacity = DefaultCapacity);
+        OutputSink(const OutputSink&) = delete;
+        OutputSink& operator=(const OutputSink&) = delete;
+        // writes what is left in the buffer
+        virtual ~OutputSink();
+
+        // order was accepted
+        virtual void acknowledged(int userId, int orderId) = 0;
+        // order was cancelled
+        virtual void cancelled(int userId, int orderId) = 0;
+        virtual void traded(int buyerId, int buyerOrderId, int sellerId, int sellerOrderId, int price, int quantity) = 0;
+        // best level of side changed, (-1, -1) when the side is empty
+        virtual void top_of_book(Orderside side, int price, int quantity) = 0;
+        // aggregated quantity of a level changed, 0 when the level was removed
+        virtual void level(Orderside side, int price, int quantity) = 0;
+        // part of a comment line of the input
+        virtual void text(std::string_view text, bool endOfLine) = 0;
+        // books were flushed
+        virtual void flushed() = 0;
+
+        // writes the buffer to the file descriptor, throws std::runtime_error if writing fails
+        void flush();
+        // called before the buffer is written to the file descriptor, to hold the output back until the commands
+        // which produced it are durable
+        void set_barrier(std::function<void()> barrier) { beforeWrite = std::move(barrier); }
+        std::string_view buffered() const { return std::string_view(buffer.data(), used); }
+        void clear() { used = 0; }
+
+    protected:
+        // returns room for at least bytes at the end of the buffer, to be committed with commit(end)
+        char* reserve(std::size_t bytes)
+        {
+            if (buffer.size() - used < bytes)
+                make_room(bytes);
+            return buffer.data() + used;
+        }
+        void commit(const char* end) { used = std::size_t(end - buffer.data()); }
+
+    private:
+        void make_room(std::size_t bytes);
+
+        int fd;
+        std::function<void()> beforeWrite;
+        std::vector<char> buffer;
+        std::size_t used = 0;
+    };
+
+    /**
+     * @brief Writes events as text lines
+     */
+    class TextSink final : public OutputSink
+    {
+    public:
+        using OutputSink::OutputSink;
+
+        void acknowledged(int userId, int orderId) override;
+        void cancelled(int userId, int orderId) override;
+        void traded(int buyerId, int buyerOrderId, int sellerId, int sellerOrderId, int price, int quantity) override;
+        void top_of_book(Orderside side, int price, int quantity) override;
+        void level(Orderside side, int price, int quantity) override;
+        void text(std::string_view text, bool endOfLine) override;
+        void flushed() override;
+    };
+
+    enum class EventType : std::uint8_t {
+        acknowledged = 1,
+        cancelled,
+        traded,
+        topOfBook,
+        text,      // part of a comment, more parts follow
+        textLine,  // last part of a comment
+        flushed,
+        level
+    };
+
+    /**
+     * @brief Writes events in a fixed width little endian binary format
+     * Every event takes EventSize bytes: type (u8), side (u8, 0 buy 1 sell) of topOfBook and level or text length (u8), 2 bytes padding
+     * and 6 i32 fields:
+     * - acknowledged, cancelled : userId, orderId
+     * - traded : buyerId, buyerOrderId, sellerId, sellerOrderId, price, quantity
+     * - topOfBook : price, quantity, both -1 if the side is empty
+     * - level : price, quantity, 0 if the level was removed
+     * - text, textLine : up to 24 bytes of text instead of the fields
+     * - flushed : no fields
+     */
+    class BinarySink final : public OutputSink
+    {
+    public:
+        static constexpr std::size_t EventSize = 28;
+        static constexpr std::size_t TextCapacity = 24;
+
+        using OutputSink::OutputSink;
+
+        void acknowledged(int userId, int orderId) override;
+        void cancelled(int userId, int orderId) override;
+        void traded(int buyerId, int buyerOrderId, int sellerId, int sellerOrderId, int price, int quantity) override;
+        void top_of_book(Orderside side, int price, int quantity) override;
+        void level(Orderside side, int price, int quantity) override;
+        void text(std::string_view text, bool endOfLine) override;
+        void flushed() override;
+
+    private:
+        char* event(EventType type, std::uint8_t detail);
+    };
+
+    // decodes events written by a BinarySink and passes them to sink, throws std::runtime_error on malformed input
+    void replay_events(std::string_view events, OutputSink& sink);
+}
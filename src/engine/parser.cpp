@@ -0,0 +1,119 @@
+#include "parser.hpp"
+#include <fcntl.h>
+#include <stdexcept>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+using namespace engine;
+
+MappedFile::MappedFile(const std::string& path)
+{
+    const int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+        throw std::runtime_error("Cannot open input file " + path);
+    struct stat status;
+    if (::fstat(fd, &status) != 0)
+    {
+        ::close(fd);
+        throw std::runtime_error("Cannot stat input file " + path);
+    }
+    length = std::size_t(status.st_size);
+    if (length > 0)
+    {
+        void* address = ::mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (address == MAP_FAILED)
+        {
+            ::close(fd);
+            throw std::runtime_error("Cannot map input file " + path);
+        }
+        ::madvise(address, length, MADV_SEQUENTIAL);
+        mapping = static_cast<const char*>(address);
+    }
+    ::close(fd);
+}
+
+MappedFile::~MappedFile()
+{
+    if (mapping)
+        ::munmap(const_cast<char*>(mapping), length);
+}
+
+namespace {
+    // field scanner over one line, fields are separated by commas and optional blanks
+    struct FieldScanner
+    {
+        const char* position;
+        const char* end;
+
+        void skip_separator()
+        {
+            while (position < end && (*position == ' ' || *position == '\t'))
+                ++position;
+            if (position < end && *position == ',')
+                ++position;
+            while (position < end && (*position == ' ' || *position == '\t'))
+                ++position;
+        }
+
+        bool integer(int& value)
+        {
+            skip_separator();
+            const bool negative = position < end && *position == '-';
+            position += negative;
+            const char* first = position;
+            unsigned result = 0;
+            while (position < end && unsigned(*position - '0') < 10)
+                result = result * 10 + unsigned(*position++ - '0');
+            value = negative ? -int(result) : int(result);
+            return position != first;
+        }
+
+        bool token(const char*& tokenBegin, std::size_t& tokenLength)
+        {
+            skip_separator();
+            tokenBegin = position;
+            while (position < end && *position != ',' && *position != ' ' && *position != '\t')
+                ++position;
+            tokenLength = std::size_t(position - tokenBegin);
+            return tokenLength > 0;
+        }
+    };
+}
+
+bool CommandParser::parse_new_order(const char* position, const char* end, Command& command)
+{
+    // N, userId, symbol, price, quantity, side, orderId
+    FieldScanner scanner{position, end};
+    auto& order = command.order;
+    const char* symbol;
+    std::size_t symbolLength;
+    const char* side;
+    std::size_t sideLength;
+    if (!scanner.integer(order.userId) || !scanner.token(symbol, symbolLength) || !scanner.integer(order.price) ||
+        !scanner.integer(order.quantity) || !scanner.token(side, sideLength) || !scanner.integer(order.orderId))
+        return false;
+    order.symbol = symbols.intern(std::string_view(symbol, symbolLength));
+    command.side = *side == 'B' ? Orderside::buy : Orderside::sell;
+    command.type = CommandType::newOrder;
+    return true;
+}
+
+bool CommandParser::parse_cancel(const char* position, const char* end, Command& command)
+{
+    // C, userId, orderId
+    FieldScanner scanner{position, end};
+    if (!scanner.integer(command.order.userId) || !scanner.integer(command.order.orderId))
+        return false;
+    command.type = CommandType::cancel;
+    return true;
+}
+
+std::vector<Command> engine::parse_commands(const char* begin, const char* end, SymbolTable& symbols)
+{
+    std::vector<Command> commands;
+    // lines are at least a dozen bytes in practice, avoids regrowing the vector on big files
+    commands.reserve(std::size_t(end - begin) / 24);
+    CommandParser(symbols).parse(begin, end, true, [&commands](const Command& command) { commands.push_back(command); });
+    return commands;
+}
@@ -0,0 +1,109 @@
+#pragma once
+#include <algorithm>
+#include <cstddef>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include "commands.hpp"
+#include "symbols.hpp"
+
+namespace engine {
+    /**
+     * @brief Read only memory mapping of a whole file
+     */
+    class MappedFile
+    {
+        const char* mapping = nullptr;
+        std::size_t length = 0;
+
+    public:
+        MappedFile() = default;
+        // throws std::runtime_error if the file can not be mapped
+        explicit MappedFile(const std::string& path);
+        MappedFile(const MappedFile&) = delete;
+        MappedFile& operator=(const MappedFile&) = delete;
+        ~MappedFile();
+
+        const char* begin() const { return mapping; }
+        const char* end() const { return mapping + length; }
+        std::size_t size() const { return length; }
+    };
+
+    /**
+     * @brief Parses input lines in place into Command records
+     * Fields are scanned directly from the buffer, lines are found with memchr and symbols are interned in symbols.
+     * Malformed order and cancel lines are skipped.
+     */
+    class CommandParser
+    {
+    public:
+        explicit CommandParser(SymbolTable& symbols) : symbols(symbols)
+        {
+        }
+
+        // parses every complete line of [begin, end) and calls emit(const Command&) for each record
+        // when last is true a line without trailing new line at the end is parsed too
+        // returns the position after the last parsed line
+        template<typename Emit>
+        const char* parse(const char* begin, const char* end, bool last, Emit&& emit)
+        {
+            while (begin < end)
+            {
+                const char* newLine = static_cast<const char*>(std::memchr(begin, '\n', end - begin));
+                if (newLine == nullptr && !last)
+                    break;
+                const char* lineEnd = newLine ? newLine : end;
+                parse_line(begin, lineEnd, emit);
+                begin = newLine ? newLine + 1 : end;
+            }
+            return begin;
+        }
+
+        template<typename Emit>
+        void parse_line(const char* begin, const char* end, Emit&& emit)
+        {
+            if (begin == end)
+                return;
+            Command command;
+            switch (*begin)
+            {
+            case '#':
+                // comments are kept verbatim, split in records of TextCapacity bytes
+                do
+                {
+                    const std::size_t length = std::min<std::size_t>(end - begin, Command::TextCapacity);
+                    std::memcpy(command.text, begin, length);
+                    command.length = std::uint8_t(length);
+                    begin += length;
+                    command.type = begin == end ? CommandType::print : CommandType::text;
+                    emit(static_cast<const Command&>(command));
+                } while (begin != end);
+                return;
+            case 'N':
+                if (parse_new_order(begin + 1, end, command))
+                    emit(static_cast<const Command&>(command));
+                return;
+            case 'C':
+                if (parse_cancel(begin + 1, end, command))
+                    emit(static_cast<const Command&>(command));
+                return;
+            case 'F':
+                command.type = CommandType::flush;
+                emit(static_cast<const Command&>(command));
+                return;
+            default:
+                return;
+            }
+        }
+
+    private:
+        bool parse_new_order(const char* position, const char* end, Command& command);
+        static bool parse_cancel(const char* position, const char* end, Command& command);
+
+        SymbolTable& symbols;
+    };
+
+    // parses a whole buffer into records
+    std::vector<Command> parse_commands(const char* begin, const char* end, SymbolTable& symbols);
+}
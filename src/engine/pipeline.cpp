@@ -0,0 +1,75 @@
+#include "pipeline.hpp"
+#include "parser.hpp"
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <unistd.h>
+
+using namespace engine;
+
+namespace {
+    // unwinds the parser once run stopped the pipeline
+    struct Stopped {};
+}
+
+bool CommandPipeline::push(Command&& command)
+{
+    while (!queue.try_push(std::move(command)))
+    {
+        if (stopped.load(std::memory_order_relaxed))
+            return false;
+        std::this_thread::yield();
+    }
+    return true;
+}
+
+void CommandPipeline::produce(int fd)
+{
+    try
+    {
+        parse(fd);
+    }
+    catch (const Stopped&)
+    {
+        return;
+    }
+    catch (...)
+    {
+        error = std::current_exception();
+    }
+    push(Command());
+}
+
+void CommandPipeline::parse(int fd)
+{
+    std::vector<char> buffer(readSize);
+    std::size_t pending = 0; // bytes of an incomplete line kept at the front of buffer
+    CommandParser parser(symbols);
+    auto enqueue = [this](const Command& command)
+    {
+        if (!push(Command(command)))
+            throw Stopped();
+    };
+    while (true)
+    {
+        // a line longer than the buffer grows it
+        if (pending == buffer.size())
+            buffer.resize(buffer.size() * 2);
+        const ssize_t count = ::read(fd, buffer.data() + pending, buffer.size() - pending);
+        if (count < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            throw std::runtime_error(std::string("Cannot read input: ") + std::strerror(errno));
+        }
+        const char* begin = buffer.data();
+        const char* end = begin + pending + std::size_t(count);
+        const bool last = count == 0;
+        const char* parsed = parser.parse(begin, end, last, enqueue);
+        if (last)
+            break;
+        pending = std::size_t(end - parsed);
+        std::memmove(buffer.data(), parsed, pending);
+    }
+}
@@ -0,0 +1,71 @@
+#pragma once
+#include <atomic>
+#include <cstddef>
+#include <exception>
+#include <thread>
+#include <vector>
+
+#include "commands.hpp"
+#include "spsc_queue.hpp"
+#include "symbols.hpp"
+
+namespace engine {
+    /**
+     * @brief Streams commands from a file descriptor through a bounded ring of records
+     * A producer thread reads the input in chunks and parses it while the calling thread consumes the
+     * records, so memory stays constant for any input size and parsing overlaps with matching.
+     * Symbols are interned in symbols by the producer thread, which must not be used elsewhere during run.
+     */
+    class CommandPipeline
+    {
+    public:
+        static constexpr std::size_t DefaultCapacity = 1 << 14; // records in flight
+        static constexpr std::size_t DefaultReadSize = 1 << 20; // bytes per read
+
+        explicit CommandPipeline(SymbolTable& symbols, std::size_t capacity = DefaultCapacity, std::size_t readSize = DefaultReadSize)
+            : queue(capacity), symbols(symbols), readSize(readSize)
+        {
+        }
+
+        // reads fd until end of file and calls consume(const Command&) on the calling thread for every record
+        // throws std::runtime_error if reading fails, an exception of consume stops the producer and is rethrown
+        template<typename Consume>
+        void run(int fd, Consume&& consume)
+        {
+            error = nullptr;
+            stopped.store(false, std::memory_order_relaxed);
+            std::thread producer([this, fd]() { produce(fd); });
+            Command command;
+            try
+            {
+                for (queue.pop(command); command.type != CommandType::none; queue.pop(command))
+                    consume(static_cast<const Command&>(command));
+            }
+            catch (...)
+            {
+                // the producer may wait for room in the queue, it gives up once stopped
+                stopped.store(true, std::memory_order_relaxed);
+                producer.join();
+                while (queue.try_pop(command))
+                    ;
+                throw;
+            }
+            producer.join();
+            if (error)
+                std::rethrow_exception(error);
+        }
+
+    private:
+        // parses fd into the queue, terminated by a record of type none unless run stopped it
+        void produce(int fd);
+        void parse(int fd);
+        // waits for room in the queue, false once run stopped
+        bool push(Command&& command);
+
+        SpscQueue<Command> queue;
+        SymbolTable& symbols;
+        std::size_t readSize;
+        std::atomic<bool> stopped{false};
+        std::exception_ptr error; // of the producer, rethrown by run
+    };
+}
@@ -0,0 +1,130 @@
+#include "replay.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <numeric>
+#include <string_view>
+#include <thread>
+#include <utility>
+
+using namespace engine;
+
+namespace {
+    using Clock = std::chrono::steady_clock;
+
+    struct Partition
+    {
+        std::vector<Command> commands;
+        std::vector<std::size_t> ends; // end of the events of every command in events
+        OrderbookManager orderbooks;
+        BinarySink events;
+        ReplayPartition stats;
+        std::size_t next = 0;   // next command whose events are merged
+        std::size_t cursor = 0; // start of its events
+
+        void run()
+        {
+            ends.reserve(commands.size());
+            const auto start = Clock::now();
+            for (const Command& command : commands)
+            {
+                execute(command, orderbooks, events);
+                ends.push_back(events.buffered().size());
+            }
+            stats.commands = commands.size();
+            stats.seconds = std::chrono::duration<double>(Clock::now() - start).count();
+        }
+
+        // events of the next command
+        std::string_view take()
+        {
+            const std::size_t end = ends[next++];
+            const std::string_view taken = events.buffered().substr(cursor, end - cursor);
+            cursor = end;
+            return taken;
+        }
+    };
+}
+
+ReplayReport engine::replay_partitioned(const std::vector<Command>& commands, std::size_t partitionCount, const OrderbookManager& prototype, OutputSink& sink)
+{
+    partitionCount = std::max<std::size_t>(partitionCount, 1);
+    std::vector<std::unique_ptr<Partition>> partitions;
+    for (std::size_t index = 0; index < partitionCount; ++index)
+    {
+        partitions.emplace_back(new Partition);
+        auto& orderbooks = partitions.back()->orderbooks;
+        orderbooks.defaultConfig = prototype.defaultConfig;
+        orderbooks.levelFeed = prototype.levelFeed;
+        orderbooks.symbolConfigs = prototype.symbolConfigs;
+        orderbooks.symbols = prototype.symbols;
+        // each book is owned by a single thread
+        orderbooks.defaultConfig.threadSafe = false;
+        for (auto& symbolConfig : orderbooks.symbolConfigs)
+            symbolConfig.second.threadSafe = false;
+    }
+
+    // orders placed per symbol, cancels and fills follow them
+    std::vector<std::size_t> load;
+    for (const Command& command : commands)
+    {
+        if (command.type != CommandType::newOrder)
+            continue;
+        if (command.order.symbol >= load.size())
+            load.resize(command.order.symbol + 1);
+        ++load[command.order.symbol];
+    }
+    std::vector<SymbolId> busiest(load.size());
+    std::iota(busiest.begin(), busiest.end(), SymbolId(0));
+    std::stable_sort(busiest.begin(), busiest.end(), [&load](SymbolId a, SymbolId b) { return load[a] > load[b]; });
+    std::vector<std::uint32_t> owners(load.size(), 0);
+    std::vector<std::size_t> partitionLoads(partitionCount, 0);
+    for (const SymbolId symbol : busiest)
+    {
+        if (load[symbol] == 0)
+            break;
+        const auto target = std::size_t(std::min_element(partitionLoads.begin(), partitionLoads.end()) - partitionLoads.begin());
+        owners[symbol] = std::uint32_t(target);
+        partitionLoads[target] += load[symbol];
+        ++partitions[target]->stats.symbols;
+    }
+
+    CommandRouter router(partitionCount, std::move(owners));
+    std::vector<Route> routes;
+    routes.reserve(commands.size());
+    for (const Command& command : commands)
+    {
+        routes.push_back(router.dispatch(command, [&partitions, &command](std::size_t partition) { partitions[partition]->commands.push_back(command); }));
+        // nothing rests with the key after a cancel nor anything after a flush, the fills are only known once executed
+        // and a cancel of a filled order reaches the partitions of the adds of its key since then, which write nothing
+        if (command.type == CommandType::cancel)
+            router.forget(order_key(command.order.userId, command.order.orderId));
+        else if (command.type == CommandType::flush)
+            router.forget();
+    }
+
+    ReplayReport report;
+    const auto start = Clock::now();
+    std::vector<std::thread> threads;
+    for (auto& partition : partitions)
+        threads.emplace_back(&Partition::run, partition.get());
+    for (auto& thread : threads)
+        thread.join();
+    const auto executed = Clock::now();
+    report.executeSeconds = std::chrono::duration<double>(executed - start).count();
+
+    const auto take = [&partitions, &sink](std::size_t partition, bool print)
+        {
+            const std::string_view events = partitions[partition]->take();
+            if (print)
+                replay_events(events, sink);
+        };
+    for (std::size_t index = 0; index < commands.size(); ++index)
+        router.merge(commands[index], routes[index], take, sink);
+    report.mergeSeconds = std::chrono::duration<double>(Clock::now() - executed).count();
+    for (const auto& partition : partitions)
+        report.partitions.push_back(partition->stats);
+    return report;
+}
@@ -0,0 +1,34 @@
+#pragma once
+#include <cstddef>
+#include <vector>
+
+#include "commands.hpp"
+#include "output.hpp"
+#include "router.hpp"
+
+namespace engine {
+    struct ReplayPartition
+    {
+        std::size_t symbols = 0;  // books owned by the partition
+        std::size_t commands = 0; // executed by the partition, flushes included
+        double seconds = 0;       // spent executing them on its thread
+    };
+
+    struct ReplayReport
+    {
+        std::vector<ReplayPartition> partitions;
+        double executeSeconds = 0; // until the slowest partition finished
+        double mergeSeconds = 0;
+    };
+
+    /**
+     * @brief Replays a whole capture on independent sets of books, one thread per partition
+     * Symbols are split by their number of commands, the busiest first going to the least loaded partition, so each
+     * partition replays its own books without any synchronization. Commands are routed and merged by a CommandRouter,
+     * as in ShardedEngine, before any partition starts: a cancel goes to the partitions of the adds of its key since
+     * its previous cancel or flush, usually the one of its last add. Each partition keeps its events in the
+     * binary format with the end of the events of every command, they are then merged in input order, which makes
+     * the output the same as executing the commands serially and comparable byte for byte with a golden file.
+     */
+    ReplayReport replay_partitioned(const std::vector<Command>& commands, std::size_t partitionCount, const OrderbookManager& prototype, OutputSink& sink);
+}
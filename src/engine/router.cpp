@@ -0,0 +1,67 @@
+#include "router.hpp"
+
+#include <algorithm>
+#include <iterator>
+#include <utility>
+
+using namespace engine;
+
+CommandRouter::CommandRouter(std::size_t partitionCount, std::vector<std::uint32_t> owners)
+    : owners(std::move(owners)), partitionCount(std::uint32_t(std::max<std::size_t>(partitionCount, 1)))
+{
+}
+
+Route CommandRouter::route(const Command& command)
+{
+    Route routed;
+    switch (command.type)
+    {
+    case CommandType::newOrder:
+    {
+        routed.kind = Route::Kind::one;
+        routed.partition = owner(command.order.symbol);
+        const auto range = placed.equal_range(order_key(command.order.userId, command.order.orderId));
+        auto ite = range.first;
+        while (ite != range.second && ite->second.partition != routed.partition)
+            ++ite;
+        if (ite != range.second)
+            ++ite->second.orders;
+        else
+            placed.emplace(order_key(command.order.userId, command.order.orderId), PlacedOrders{ routed.partition, 1 });
+    }
+    break;
+    case CommandType::cancel:
+    {
+        const auto range = placed.equal_range(order_key(command.order.userId, command.order.orderId));
+        if (range.first == range.second)
+            break;
+        routed.kind = std::next(range.first) == range.second ? Route::Kind::one : Route::Kind::cancel;
+        routed.partition = range.first->second.partition;
+    }
+    break;
+    case CommandType::flush:
+        routed.kind = Route::Kind::flush;
+        break;
+    case CommandType::text:
+    case CommandType::print:
+        routed.kind = Route::Kind::merger;
+        break;
+    case CommandType::none:
+        break;
+    }
+    return routed;
+}
+
+void CommandRouter::ended(std::uint64_t key, std::uint32_t partition)
+{
+    const auto range = placed.equal_range(key);
+    for (auto ite = range.first; ite != range.second; ++ite)
+    {
+        if (ite->second.partition == partition)
+        {
+            if (--ite->second.orders == 0)
+                placed.erase(ite);
+            return;
+        }
+    }
+}
@@ -0,0 +1,111 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <unordered_map>
+#include <vector>
+
+#include "commands.hpp"
+#include "output.hpp"
+
+namespace engine {
+    // partitions of the books executing a command and how their output is merged
+    struct Route
+    {
+        enum class Kind : std::uint8_t {
+            none,   // nothing to execute nor to write
+            one,    // new order executed by the partition owning its symbol, or cancel of a key placed on one partition
+            cancel, // key placed on several partitions, executed by every one, each writes what it found in its books
+            flush,  // executed by every partition, the output is written once
+            merger  // comment, written by the merge
+        };
+        Kind kind = Kind::none;
+        std::uint32_t partition = 0; // of kind one
+    };
+
+    /**
+     * @brief Routes the commands to partitions of the books and merges their output, for ShardedEngine and
+     * replay_partitioned
+     * A new order goes to the partition owning its symbol. A cancel does not name its symbol and goes to the
+     * partitions its key was placed on: the router counts the orders of every key sent to each partition until the
+     * caller reports them ended, a cancel of a key without orders is dropped. A key placed on several partitions is
+     * cancelled by every partition, as are the ones whose ended orders are not reported yet, which write nothing.
+     * Flushes go to every partition and comments are written by the merge.
+     * Merging the outputs of the commands in input order gives the output of a serial run, except that a key resting
+     * on books of several partitions is cancelled in partition order.
+     */
+    class CommandRouter
+    {
+        // orders of a key sent to a partition and not reported ended
+        struct PlacedOrders
+        {
+            std::uint32_t partition;
+            std::uint32_t orders;
+        };
+
+        std::vector<std::uint32_t> owners; // partition of every symbol id, the symbols after them are hashed
+        std::uint32_t partitionCount;
+        std::unordered_multimap<std::uint64_t, PlacedOrders> placed; // by order_key, an entry per partition
+
+    public:
+        explicit CommandRouter(std::size_t partitionCount, std::vector<std::uint32_t> owners = {});
+
+        std::size_t partitions() const { return partitionCount; }
+        std::uint32_t owner(SymbolId symbol) const { return symbol < owners.size() ? owners[symbol] : symbol % partitionCount; }
+
+        // routes command, counting a new order as placed on its partition
+        Route route(const Command& command);
+        // an order of key placed on partition no longer rests in it: not rested, filled, cancelled or flushed
+        void ended(std::uint64_t key, std::uint32_t partition);
+        // forgets the orders placed with key, or every order, once the caller knows that none of them rest anymore
+        void forget(std::uint64_t key) { placed.erase(key); }
+        void forget() { placed.clear(); }
+        // keys with orders placed
+        std::size_t keys() const { return placed.size(); }
+
+        // routes command and calls send(partition) for every partition which executes it
+        template<typename Send>
+        Route dispatch(const Command& command, Send send)
+        {
+            const Route routed = route(command);
+            if (routed.kind == Route::Kind::one)
+                send(routed.partition);
+            else if (routed.kind == Route::Kind::cancel || routed.kind == Route::Kind::flush)
+            {
+                for (std::uint32_t partition = 0; partition < partitionCount; ++partition)
+                    send(partition);
+            }
+            return routed;
+        }
+
+        // writes the output of command to sink, take(partition, print) is called in partition order for every
+        // partition which executed it, to consume its events and write them to sink if print
+        template<typename Take>
+        void merge(const Command& command, const Route& routed, Take take, OutputSink& sink) const
+        {
+            switch (routed.kind)
+            {
+            case Route::Kind::one:
+                take(routed.partition, true);
+                break;
+            case Route::Kind::cancel:
+                // only the partitions holding the order wrote something
+                for (std::uint32_t partition = 0; partition < partitionCount; ++partition)
+                    take(partition, true);
+                break;
+            case Route::Kind::flush:
+                // every partition executed it, the output is written once
+                for (std::uint32_t partition = 0; partition < partitionCount; ++partition)
+                    take(partition, partition == 0);
+                break;
+            case Route::Kind::merger:
+            {
+                OrderbookManager unused;
+                execute(command, unused, sink);
+            }
+            break;
+            case Route::Kind::none:
+                break;
+            }
+        }
+    };
+}
@@ -0,0 +1,140 @@
+#include "sharded_engine.hpp"
+
+#include <cstdint>
+#include <string>
+
+using namespace engine;
+
+namespace {
+    constexpr std::size_t QueueCapacity = 4096;
+    constexpr std::size_t EndedCapacity = 1 << 16;
+}
+
+// where the merge thread takes the output of the next command from
+struct ShardedEngine::Routed
+{
+    Route route;
+    Command command;
+    bool end = true; // stops the merge thread
+};
+
+struct ShardedEngine::Shard
+{
+    // a command of type none stops the worker
+    SpscQueue<Command> tasks{QueueCapacity};
+    SpscQueue<std::string> outputs{QueueCapacity};
+    // buffers of the outputs written by the merge thread, handed back to be reused
+    SpscQueue<std::string> spares{QueueCapacity};
+    // keys of the orders which no longer rest in the books, for the router of the submitting thread
+    SpscQueue<std::uint64_t> ended{EndedCapacity};
+    std::vector<std::uint64_t> endedOrders; // not handed over yet, the worker does not wait for the router
+    OrderbookManager orderbooks;
+
+    void run()
+    {
+        BinarySink events(-1, 1 << 12);
+        Command command;
+        std::string output;
+        orderbooks.endedOrders = &endedOrders;
+        for (tasks.pop(command); command.type != CommandType::none; tasks.pop(command))
+        {
+            execute(command, orderbooks, events);
+            // a new buffer is only allocated until the first outputs come back
+            spares.try_pop(output);
+            output.assign(events.buffered());
+            outputs.push(std::move(output));
+            events.clear();
+            std::size_t handed = 0;
+            while (handed < endedOrders.size() && ended.try_push(std::uint64_t(endedOrders[handed])))
+                ++handed;
+            endedOrders.erase(endedOrders.begin(), endedOrders.begin() + handed);
+        }
+    }
+};
+
+ShardedEngine::ShardedEngine(std::size_t shardCount, const OrderbookManager& prototype, OutputSink& sink)
+    : router(shardCount), routes(new SpscQueue<Routed>(QueueCapacity))
+{
+    for (std::size_t index = 0; index < router.partitions(); ++index)
+    {
+        shards.emplace_back(new Shard);
+        shards.back()->orderbooks.defaultConfig = prototype.defaultConfig;
+        shards.back()->orderbooks.levelFeed = prototype.levelFeed;
+        shards.back()->orderbooks.symbolConfigs = prototype.symbolConfigs;
+        shards.back()->orderbooks.symbols = prototype.symbols;
+        // each book is owned by a single worker
+        shards.back()->orderbooks.defaultConfig.threadSafe = false;
+        for (auto& symbolConfig : shards.back()->orderbooks.symbolConfigs)
+            symbolConfig.second.threadSafe = false;
+    }
+    for (auto& shard : shards)
+        workers.emplace_back(&Shard::run, shard.get());
+
+    merger = std::thread([this, &sink]()
+        {
+            std::string output;
+            // writes the output of the next command of shard if print, then gives its buffer back
+            const auto take = [this, &output, &sink](std::size_t shard, bool print)
+                {
+                    shards[shard]->outputs.pop(output);
+                    if (print)
+                        replay_events(output, sink);
+                    shards[shard]->spares.try_push(std::move(output));
+                };
+            Routed routed;
+            for (routes->pop(routed); !routed.end; routes->pop(routed))
+                router.merge(routed.command, routed.route, take, sink);
+        });
+}
+
+ShardedEngine::~ShardedEngine()
+{
+    finish();
+}
+
+void ShardedEngine::submit(const Command& command)
+{
+    // a late report only sends a cancel to a shard which no longer holds its key
+    std::uint64_t key;
+    for (std::uint32_t shard = 0; shard < shards.size(); ++shard)
+    {
+        while (shards[shard]->ended.try_pop(key))
+            router.ended(key, shard);
+    }
+    Routed routed;
+    routed.route = router.dispatch(command, [this, &command](std::size_t shard) { shards[shard]->tasks.push(Command(command)); });
+    if (routed.route.kind == Route::Kind::none)
+        return;
+    routed.command = command;
+    routed.end = false;
+    routes->push(std::move(routed));
+}
+
+void ShardedEngine::finish()
+{
+    if (finished)
+        return;
+    finished = true;
+    for (auto& shard : shards)
+        shard->tasks.push(Command());
+    routes->push(Routed());
+    for (auto& worker : workers)
+        worker.join();
+    merger.join();
+}
+
+void ShardedEngine::run(const std::vector<Command>& commands)
+{
+    for (const Command& command : commands)
+        submit(command);
+    finish();
+}
+
+void ShardedEngine::write_stats(std::ostream& o, const SymbolTable* symbols, std::size_t busiest) const
+{
+    for (std::size_t index = 0; index < shards.size(); ++index)
+    {
+        o << "shard " << index << " ";
+        shards[index]->orderbooks.write_stats(o, symbols, busiest);
+    }
+}
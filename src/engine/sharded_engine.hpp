@@ -0,0 +1,54 @@
+#pragma once
+#include <cstddef>
+#include <memory>
+#include <ostream>
+#include <thread>
+#include <vector>
+
+#include "commands.hpp"
+#include "output.hpp"
+#include "router.hpp"
+#include "spsc_queue.hpp"
+
+namespace engine {
+    /**
+     * @brief Executes commands on worker threads, each owning the books of the symbols hashed to it
+     * The submitting thread routes the commands to the shards through SPSC queues and a merge thread writes
+     * the output of every command in input order, so the output is the same as executing them serially.
+     * Workers encode their events in the binary format, the merge thread decodes them into the sink.
+     * Symbols are hashed to the shards and commands routed by a CommandRouter: a cancel goes to the shards its key was
+     * placed on, flushes go to every shard. Workers report the keys of the orders leaving their books back to the
+     * submitting thread, which prunes them from the router.
+     */
+    class ShardedEngine
+    {
+    public:
+        // starts the threads, books are created with the configs of prototype
+        ShardedEngine(std::size_t shardCount, const OrderbookManager& prototype, OutputSink& sink);
+        ShardedEngine(const ShardedEngine&) = delete;
+        ShardedEngine& operator=(const ShardedEngine&) = delete;
+        ~ShardedEngine();
+
+        // routes the next command, must always be called from the same thread
+        void submit(const Command& command);
+        // waits until the output of every submitted command is written and stops the threads
+        void finish();
+
+        // submits all commands and finishes
+        void run(const std::vector<Command>& commands);
+
+        // stats of the books of every shard, only once finished
+        void write_stats(std::ostream& o, const SymbolTable* symbols, std::size_t busiest = 10) const;
+
+    private:
+        struct Shard;
+        struct Routed;
+
+        CommandRouter router;
+        std::vector<std::unique_ptr<Shard>> shards;
+        std::unique_ptr<SpscQueue<Routed>> routes;
+        std::vector<std::thread> workers;
+        std::thread merger;
+        bool finished = false;
+    };
+}
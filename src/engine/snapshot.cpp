@@ -0,0 +1,270 @@
+#include "snapshot.hpp"
+#include "little_endian.hpp"
+#include "parser.hpp"
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <stdexcept>
+#include <unistd.h>
+
+using namespace engine;
+using orderbook::Orderside;
+using orderbook::RestingOrder;
+
+namespace {
+    constexpr char Magic[8] = {'O', 'B', 'S', 'N', 'A', 'P', '0', '2'};
+
+    std::uint64_t checksum(const char* data, std::size_t size)
+    {
+        std::uint64_t value = 14695981039346656037ull;
+        for (std::size_t index = 0; index < size; ++index)
+        {
+            value ^= static_cast<unsigned char>(data[index]);
+            value *= 1099511628211ull;
+        }
+        return value;
+    }
+
+    void append_u32(std::string& out, std::uint32_t value)
+    {
+        char bytes[4];
+        store_le(bytes, value, 4);
+        out.append(bytes, 4);
+    }
+
+    void append_i32(std::string& out, int value)
+    {
+        append_u32(out, std::uint32_t(value));
+    }
+
+    // levels of one side, orders must be grouped by level from the best one
+    void append_side(std::string& out, const RestingOrder* begin, const RestingOrder* end)
+    {
+        const std::size_t levelCountAt = out.size();
+        append_u32(out, 0);
+        std::uint32_t levelCount = 0;
+        for (const RestingOrder* level = begin; level != end;)
+        {
+            const RestingOrder* levelEnd = level;
+            while (levelEnd != end && levelEnd->price == level->price)
+                ++levelEnd;
+            append_i32(out, level->price);
+            append_u32(out, std::uint32_t(levelEnd - level));
+            for (; level != levelEnd; ++level)
+            {
+                append_i32(out, level->clientId);
+                append_i32(out, level->orderId);
+                append_i32(out, level->quantity);
+                append_i32(out, level->hidden);
+                append_i32(out, level->display);
+            }
+            ++levelCount;
+        }
+        store_le(&out[levelCountAt], levelCount, 4);
+    }
+
+    void append_stops(std::string& out, const std::vector<orderbook::PendingStop>& stops)
+    {
+        append_u32(out, std::uint32_t(stops.size()));
+        for (const auto& stop : stops)
+        {
+            append_u32(out, stop.side == Orderside::sell ? 1 : 0);
+            append_i32(out, stop.clientId);
+            append_i32(out, stop.orderId);
+            append_i32(out, stop.stopPrice);
+            append_i32(out, stop.price);
+            append_i32(out, stop.quantity);
+        }
+    }
+
+    // bounds checked reads of a mapped snapshot
+    struct Reader
+    {
+        const char* position;
+        const char* end;
+
+        const char* take(std::size_t bytes)
+        {
+            if (std::size_t(end - position) < bytes)
+                throw std::runtime_error("truncated snapshot");
+            const char* taken = position;
+            position += bytes;
+            return taken;
+        }
+        std::uint32_t u32() { return std::uint32_t(load_le(take(4), 4)); }
+        int i32() { return load_le(take(4)); }
+        std::uint64_t u64() { return load_le64(take(8)); }
+    };
+}
+
+Snapshot engine::capture_snapshot(const OrderbookManager& orderbooks, const SymbolTable& symbols, std::uint64_t sequence)
+{
+    Snapshot snapshot;
+    snapshot.sequence = sequence;
+    for (SymbolId symbol = 0; symbol < orderbooks.orderbooks.size(); ++symbol)
+    {
+        const auto& orderbook = orderbooks.orderbooks[symbol];
+        if (!orderbook)
+            continue;
+        Snapshot::Book book;
+        orderbook->export_orders(book.orders);
+        orderbook->export_stops(book.stops);
+        if (book.orders.empty() && book.stops.empty())
+            continue;
+        book.symbol = symbols.shared_name(symbol);
+        snapshot.books.push_back(std::move(book));
+    }
+    return snapshot;
+}
+
+std::string engine::encode_snapshot(const Snapshot& snapshot)
+{
+    std::size_t orderCount = 0;
+    for (const auto& book : snapshot.books)
+        orderCount += book.orders.size() + book.stops.size();
+    std::string out;
+    out.reserve(28 + snapshot.books.size() * 36 + orderCount * 28);
+
+    out.append(Magic, sizeof(Magic));
+    char sequence[8];
+    store_le64(sequence, snapshot.sequence);
+    out.append(sequence, 8);
+    append_u32(out, std::uint32_t(snapshot.books.size()));
+    for (const auto& book : snapshot.books)
+    {
+        append_u32(out, std::uint32_t(book.symbol.size()));
+        out.append(book.symbol);
+        // export_orders gives the asks before the bids
+        const RestingOrder* begin = book.orders.data();
+        const RestingOrder* end = begin + book.orders.size();
+        const RestingOrder* bids = begin;
+        while (bids != end && bids->side == Orderside::sell)
+            ++bids;
+        append_side(out, begin, bids);
+        append_side(out, bids, end);
+        append_stops(out, book.stops);
+    }
+    char sum[8];
+    store_le64(sum, checksum(out.data(), out.size()));
+    out.append(sum, 8);
+    return out;
+}
+
+void engine::write_snapshot(const Snapshot& snapshot, const std::string& path)
+{
+    const std::string encoded = encode_snapshot(snapshot);
+    const std::string temporary = path + ".tmp";
+    const int fd = ::open(temporary.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+        throw std::runtime_error("Cannot create snapshot " + temporary + ": " + std::strerror(errno));
+    std::size_t written = 0;
+    while (written < encoded.size())
+    {
+        const ssize_t count = ::write(fd, encoded.data() + written, encoded.size() - written);
+        if (count < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            const int error = errno;
+            ::close(fd);
+            throw std::runtime_error("Cannot write snapshot " + temporary + ": " + std::strerror(error));
+        }
+        written += std::size_t(count);
+    }
+    // a crash leaves either the previous snapshot or the new one complete
+    if (::fsync(fd) != 0 || ::close(fd) != 0)
+        throw std::runtime_error("Cannot sync snapshot " + temporary + ": " + std::strerror(errno));
+    if (std::rename(temporary.c_str(), path.c_str()) != 0)
+        throw std::runtime_error("Cannot rename snapshot to " + path + ": " + std::strerror(errno));
+}
+
+std::uint64_t engine::restore_snapshot(const std::string& path, OrderbookManager& orderbooks, SymbolTable& symbols)
+{
+    const MappedFile file(path);
+    if (file.size() < sizeof(Magic) + 8 + 4 + 8)
+        throw std::runtime_error("not a snapshot: " + path);
+    if (std::memcmp(file.begin(), Magic, sizeof(Magic)) != 0)
+        throw std::runtime_error("not a snapshot: " + path);
+    const std::size_t body = file.size() - 8;
+    if (checksum(file.begin(), body) != load_le64(file.begin() + body))
+        throw std::runtime_error("corrupted snapshot: " + path);
+
+    orderbooks.clear();
+    Reader reader{file.begin() + sizeof(Magic), file.begin() + body};
+    const std::uint64_t sequence = reader.u64();
+    for (std::uint32_t bookCount = reader.u32(); bookCount > 0; --bookCount)
+    {
+        const std::uint32_t length = reader.u32();
+        const SymbolId symbol = symbols.intern(std::string_view(reader.take(length), length));
+        Orderbook& orderbook = orderbooks[symbol];
+        for (Orderside side : {Orderside::sell, Orderside::buy})
+        {
+            for (std::uint32_t levelCount = reader.u32(); levelCount > 0; --levelCount)
+            {
+                RestingOrder order;
+                order.side = side;
+                order.price = reader.i32();
+                for (std::uint32_t orderCount = reader.u32(); orderCount > 0; --orderCount)
+                {
+                    order.clientId = reader.i32();
+                    order.orderId = reader.i32();
+                    order.quantity = reader.i32();
+                    order.hidden = reader.i32();
+                    order.display = reader.i32();
+                    const orderbook::OrderHandle handle = orderbook.restore_order(order);
+                    if (handle == nullptr)
+                        throw std::runtime_error("invalid order in snapshot: " + path);
+                    orderbooks.restingOrders.emplace(order_key(order.clientId, order.orderId), IndexedOrder{ symbol, handle });
+                }
+            }
+        }
+        for (std::uint32_t stopCount = reader.u32(); stopCount > 0; --stopCount)
+        {
+            const Orderside side = reader.u32() ? Orderside::sell : Orderside::buy;
+            const int clientId = reader.i32();
+            const int orderId = reader.i32();
+            const int stopPrice = reader.i32();
+            const int price = reader.i32();
+            if (!orderbook.add_stop_order(side, clientId, orderId, stopPrice, price, reader.i32()))
+                throw std::runtime_error("invalid stop order in snapshot: " + path);
+        }
+    }
+    if (reader.position != reader.end)
+        throw std::runtime_error("trailing data in snapshot: " + path);
+    return sequence;
+}
+
+SnapshotWriter::~SnapshotWriter()
+{
+    if (thread.joinable())
+        thread.join();
+}
+
+void SnapshotWriter::write(Snapshot&& snapshot, const std::string& path)
+{
+    finish();
+    thread = std::thread([this, path](Snapshot snapshot)
+        {
+            try
+            {
+                write_snapshot(snapshot, path);
+            }
+            catch (...)
+            {
+                error = std::current_exception();
+            }
+        }, std::move(snapshot));
+}
+
+void SnapshotWriter::finish()
+{
+    if (thread.joinable())
+        thread.join();
+    if (error)
+    {
+        const std::exception_ptr failed = error;
+        error = nullptr;
+        std::rethrow_exception(failed);
+    }
+}
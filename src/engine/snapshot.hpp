@@ -0,0 +1,71 @@
+#pragma once
+#include <cstdint>
+#include <exception>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "commands.hpp"
+#include "symbols.hpp"
+
+namespace engine {
+    /**
+     * @brief Resting and pending stop orders of every book, taken between two commands
+     * sequence is the number of commands executed before it was taken, a restart replays the commands after it.
+     */
+    struct Snapshot
+    {
+        struct Book
+        {
+            std::string symbol;
+            std::vector<orderbook::RestingOrder> orders; // in the order of Orderbook::export_orders
+            std::vector<orderbook::PendingStop> stops;   // in the order of Orderbook::export_stops
+        };
+        std::uint64_t sequence = 0;
+        std::vector<Book> books; // books holding orders or stops, by symbol id
+    };
+
+    // copies the resting and pending stop orders of every book, the only part of a snapshot done on the executing thread
+    // may run while the parsing thread interns new symbols
+    Snapshot capture_snapshot(const OrderbookManager& orderbooks, const SymbolTable& symbols, std::uint64_t sequence);
+
+    /**
+     * Snapshot file format, little endian:
+     * - header : magic "OBSNAP02" (8 bytes), sequence (u64), book count (u32)
+     * - book : symbol length (u32) and bytes, then the asks and the bids from their best level, then the stops
+     *   - side : level count (u32), each level is price (i32), order count (u32) and its orders in time priority
+     *   - order : clientId, orderId, displayed quantity, hidden quantity, display size (i32), both 0 but for icebergs
+     *   - stops : stop count (u32), each stop is side (u32, 0 for a buy), clientId, orderId, stop price, limit price,
+     *     quantity (i32), in the order of Orderbook::export_stops
+     * - checksum : FNV-1a of everything before it (u64)
+     */
+    std::string encode_snapshot(const Snapshot& snapshot);
+    // writes the encoded snapshot to a temporary file renamed to path once synced, throws std::runtime_error
+    void write_snapshot(const Snapshot& snapshot, const std::string& path);
+    // maps the snapshot at path and rebuilds its books and order index in orderbooks, which are cleared first
+    // symbols are interned again so the ids may differ from the ones of the snapshot, returns its sequence
+    // throws std::runtime_error if the file can not be read or is corrupted
+    std::uint64_t restore_snapshot(const std::string& path, OrderbookManager& orderbooks, SymbolTable& symbols);
+
+    /**
+     * @brief Writes snapshots on a background thread so that the engine only pays for capture_snapshot
+     * A new snapshot waits for the previous one to be written.
+     */
+    class SnapshotWriter
+    {
+    public:
+        SnapshotWriter() = default;
+        SnapshotWriter(const SnapshotWriter&) = delete;
+        SnapshotWriter& operator=(const SnapshotWriter&) = delete;
+        ~SnapshotWriter();
+
+        // throws the error of the previous snapshot if it failed
+        void write(Snapshot&& snapshot, const std::string& path);
+        // waits for the snapshot being written, throws its error if it failed
+        void finish();
+
+    private:
+        std::thread thread;
+        std::exception_ptr error;
+    };
+}
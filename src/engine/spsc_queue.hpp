@@ -0,0 +1,74 @@
+#pragma once
+#include <atomic>
+#include <cstddef>
+#include <memory>
+#include <thread>
+
+namespace engine {
+    /**
+     * @brief Bounded lock free queue between one producer thread and one consumer thread
+     * Capacity is rounded up to a power of two, slots are reused so pushing and popping does not allocate.
+     */
+    template<typename T>
+    class SpscQueue
+    {
+        std::unique_ptr<T[]> slots;
+        std::size_t mask;
+        alignas(64) std::atomic<std::size_t> head{0}; // next slot to pop, written by consumer
+        std::size_t cachedTail = 0; // consumer copy of tail
+        alignas(64) std::atomic<std::size_t> tail{0}; // next slot to push, written by producer
+        std::size_t cachedHead = 0; // producer copy of head
+
+    public:
+        explicit SpscQueue(std::size_t capacity)
+        {
+            std::size_t size = 2;
+            while (size < capacity)
+                size *= 2;
+            slots.reset(new T[size]);
+            mask = size - 1;
+        }
+        SpscQueue(const SpscQueue&) = delete;
+        SpscQueue& operator=(const SpscQueue&) = delete;
+
+        bool try_push(T&& value)
+        {
+            const std::size_t current = tail.load(std::memory_order_relaxed);
+            if (current - cachedHead > mask)
+            {
+                cachedHead = head.load(std::memory_order_acquire);
+                if (current - cachedHead > mask)
+                    return false;
+            }
+            slots[current & mask] = std::move(value);
+            tail.store(current + 1, std::memory_order_release);
+            return true;
+        }
+
+        bool try_pop(T& value)
+        {
+            const std::size_t current = head.load(std::memory_order_relaxed);
+            if (current == cachedTail)
+            {
+                cachedTail = tail.load(std::memory_order_acquire);
+                if (current == cachedTail)
+                    return false;
+            }
+            value = std::move(slots[current & mask]);
+            head.store(current + 1, std::memory_order_release);
+            return true;
+        }
+
+        // blocking versions, spin and yield while the queue is full or empty
+        void push(T&& value)
+        {
+            while (!try_push(std::move(value)))
+                std::this_thread::yield();
+        }
+        void pop(T& value)
+        {
+            while (!try_pop(value))
+                std::this_thread::yield();
+        }
+    };
+}
@@ -0,0 +1,61 @@
+#include "symbols.hpp"
+#include <mutex>
+
+using namespace engine;
+
+std::size_t SymbolTable::hash(std::string_view name)
+{
+    // FNV-1a, symbols are short
+    std::size_t value = 14695981039346656037ull;
+    for (const char c : name)
+        value = (value ^ static_cast<unsigned char>(c)) * 1099511628211ull;
+    return value;
+}
+
+std::size_t SymbolTable::slot(std::string_view name, std::size_t hashValue) const
+{
+    const std::size_t mask = slots.size() - 1;
+    for (std::size_t index = hashValue & mask;; index = (index + 1) & mask)
+    {
+        const SymbolId id = slots[index];
+        if (id == None || (hashes[id] == hashValue && names[id] == name))
+            return index;
+    }
+}
+
+SymbolId SymbolTable::find(std::string_view name) const
+{
+    if (slots.empty())
+        return None;
+    return slots[slot(name, hash(name))];
+}
+
+SymbolId SymbolTable::intern(std::string_view name)
+{
+    // keeps the table at most half full
+    if (2 * (names.size() + 1) > slots.size())
+        rehash();
+    const std::size_t hashValue = hash(name);
+    SymbolId& id = slots[slot(name, hashValue)];
+    if (id == None)
+    {
+        id = SymbolId(names.size());
+        std::unique_lock<std::shared_mutex> lock(namesMutex);
+        names.emplace_back(name);
+        hashes.push_back(hashValue);
+    }
+    return id;
+}
+
+void SymbolTable::rehash()
+{
+    slots.assign(slots.empty() ? 64 : 2 * slots.size(), None);
+    const std::size_t mask = slots.size() - 1;
+    for (SymbolId id = 0; id < names.size(); ++id)
+    {
+        std::size_t index = hashes[id] & mask;
+        while (slots[index] != None)
+            index = (index + 1) & mask;
+        slots[index] = id;
+    }
+}
@@ -0,0 +1,46 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <shared_mutex>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace engine {
+    using SymbolId = std::uint32_t;
+
+    /**
+     * @brief Interns symbol names into dense ids, in order of first appearance
+     * Names are found through an open addressing table of ids, so interning a known symbol does not allocate.
+     * Not thread safe: ids are assigned by the parsing thread and only the ids travel with the commands.
+     * Other threads can only read the names of the ids they received through shared_name.
+     */
+    class SymbolTable
+    {
+    public:
+        static constexpr SymbolId None = SymbolId(-1);
+
+        // returns the id of name, assigning the next one on first use
+        SymbolId intern(std::string_view name);
+        // returns the id of name or None
+        SymbolId find(std::string_view name) const;
+        const std::string& name(SymbolId id) const { return names[id]; }
+        // copy of the name of an id assigned before, safe while the parsing thread interns new symbols
+        std::string shared_name(SymbolId id) const
+        {
+            std::shared_lock<std::shared_mutex> lock(namesMutex);
+            return names[id];
+        }
+        std::size_t size() const { return names.size(); }
+
+    private:
+        static std::size_t hash(std::string_view name);
+        std::size_t slot(std::string_view name, std::size_t hashValue) const;
+        void rehash();
+
+        std::vector<std::string> names;
+        mutable std::shared_mutex namesMutex; // held exclusively by intern while it adds a name
+        std::vector<std::size_t> hashes; // of every name, to rehash and skip most string compares
+        std::vector<SymbolId> slots;     // power of two, None when empty
+    };
+}
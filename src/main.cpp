@@ -1,204 +1,296 @@
 #include <iostream>
 #include <memory>
-#include <fstream>
-#include <algorithm>
 #include <string>
 #include <sstream>
-#include "orderbook/orderbook.hpp"
+#include <fcntl.h>
+#include <unistd.h>
+#include "engine/commands.hpp"
+#include "engine/journal.hpp"
+#include "engine/output.hpp"
+#include "engine/parser.hpp"
+#include "engine/pipeline.hpp"
+#include "engine/sharded_engine.hpp"
+#include "engine/snapshot.hpp"
 
-using namespace orderbook;
-using namespace std::placeholders;
+using namespace engine;
+using orderbook::LevelsBackend;
 
-using OrderbookManager = std::map<std::string, Orderbook>;
-
-// interface which will help us to parse and execute commands later
-struct InputCommand
-{
-    virtual void execute(OrderbookManager& orderbooks, std::ostream& o) const = 0;
-};
-
-struct OrderbookChangesTracker
-{
-    
-    std::pair<int, int> minAsk, maxBid;
-    OrderbookChangesTracker(const Orderbook& orderbook) : minAsk(orderbook.get_min_ask()), maxBid(orderbook.get_max_bid())
-    {
-    }
-
-    void check(const Orderbook& orderbook, std::ostream& o) const
+int main(int argc, char** argv) {
+    OrderbookManager orderbooks;
+    SymbolTable symbols;
+    orderbooks.symbols = &symbols;
+    std::size_t shards = 0;
+    bool stream = false;
+    bool binary = false;
+    std::size_t statsInterval = 0;
+    std::string snapshotFile;
+    std::size_t snapshotInterval = 0;
+    std::string restoreFile;
+    std::string journalDirectory;
+    JournalConfig journalConfig;
+    std::string replayDirectory;
+    const char* inputFile = nullptr;
+    for (int arg = 1; arg < argc; ++arg)
     {
-        std::pair<int, int> newMinAsk(orderbook.get_min_ask()), newMaxBid(orderbook.get_max_bid());
-        if (newMinAsk != minAsk)
+        const std::string option = argv[arg];
+        if (option == "--ladder")
         {
-            if (newMinAsk.second == -1)
-            {
-                o << "B, S, -, -\n";
-                return;
-            }
-            o << "B, S, " << newMinAsk.first << ", " << newMinAsk.second << "\n";
+            // every book uses the tick ladder
+            orderbooks.defaultConfig.backend = LevelsBackend::ladder;
         }
-        if (newMaxBid != maxBid)
+        else if (option.rfind("--ladder=", 0) == 0)
         {
-            if (newMaxBid.second == -1)
+            // comma separated list of symbols using the tick ladder
+            std::stringstream names(option.substr(9));
+            std::string symbol;
+            while (std::getline(names, symbol, ','))
             {
-                o << "B, B, -, -\n";
-                return;
+                orderbooks.symbolConfigs[symbols.intern(symbol)].backend = LevelsBackend::ladder;
             }
-            o << "B, B, " << newMaxBid.first << ", " << newMaxBid.second << "\n";
+        }
+        else if (option.rfind("--shards=", 0) == 0)
+        {
+            // number of worker threads matching the books
+            shards = std::stoul(option.substr(9));
+        }
+        else if (option == "--stream")
+        {
+            // parse on a second thread while executing, in constant memory
+            stream = true;
+        }
+        else if (option.rfind("--stats=", 0) == 0)
+        {
+            // stats of the books on stderr every N commands and at the end
+            statsInterval = std::stoul(option.substr(8));
+        }
+        else if (option.rfind("--snapshot=", 0) == 0)
+        {
+            // snapshot of the books written at the end, and every --snapshot-interval commands
+            snapshotFile = option.substr(11);
+        }
+        else if (option.rfind("--snapshot-interval=", 0) == 0)
+        {
+            snapshotInterval = std::stoul(option.substr(20));
+        }
+        else if (option.rfind("--restore=", 0) == 0)
+        {
+            // start from a snapshot, skipping the commands of the input it already holds
+            restoreFile = option.substr(10);
+        }
+        else if (option.rfind("--journal=", 0) == 0)
+        {
+            // journal of the executed commands, their output is written once they are durable
+            journalDirectory = option.substr(10);
+        }
+        else if (option == "--journal-sync=async")
+        {
+            // the output does not wait for the journal
+            journalConfig.sync = JournalSync::async;
+        }
+        else if (option.rfind("--replay=", 0) == 0)
+        {
+            // commands are read from a journal instead of an input file
+            replayDirectory = option.substr(9);
+        }
+        else if (option == "--levels")
+        {
+            // every level change after the top of book changes
+            orderbooks.levelFeed = true;
+        }
+        else if (option == "--binary")
+        {
+            // fixed width binary events instead of text lines
+            binary = true;
+        }
+        else if (inputFile == nullptr)
+        {
+            inputFile = argv[arg];
+        }
+        else
+        {
+            inputFile = nullptr;
+            break;
         }
     }
-};
-
-void print_matched_transaction(std::ostream& o, Orderside orderside, int bookClientId, int bookClientOrderId, int clientId, int clientOrderId, int price, int quantity)
-{
-    const auto buyer = (orderside == Orderside::buy ? std::make_pair(clientId, clientOrderId) : std::make_pair(bookClientId, bookClientOrderId));
-    const auto seller = (orderside == Orderside::sell ? std::make_pair(clientId, clientOrderId) : std::make_pair(bookClientId, bookClientOrderId));
-    o << "T, " << buyer.first << ", " << buyer.second << ", " << seller.first << ", " << seller.second << ", " << price << ", " << quantity << "\n";
-}
-
-// This will help us print the comments in input file
-struct PrintCommand : InputCommand
-{
-    std::string line;
-    PrintCommand(std::string&& line) : line(std::move(line))
+    // snapshots are taken between two commands of the executing thread, which the workers of the sharded engine are not
+    if (shards > 0 && (!snapshotFile.empty() || !restoreFile.empty()))
+        inputFile = nullptr;
+    if (snapshotInterval && snapshotFile.empty())
+        inputFile = nullptr;
+    const bool replay = !replayDirectory.empty() && inputFile == nullptr && journalDirectory.empty();
+    if (inputFile == nullptr && !replay)
     {
+        std::cout << "Input format is command [--ladder | --ladder=SYMBOL,...] [--shards=N] [--stream] [--binary] [--levels] [--stats=N]"
+                     " [--snapshot=FILE [--snapshot-interval=N]] [--restore=FILE] [--journal=DIRECTORY [--journal-sync=async]]"
+                     " input_file|-|--replay=DIRECTORY\n";
+        return -1;
     }
 
-    virtual void execute(OrderbookManager&, std::ostream& o) const override
+    std::uint64_t restoredSequence = 0;
+    if (!restoreFile.empty())
     {
-        o << line << "\n";
+        try
+        {
+            restoredSequence = restore_snapshot(restoreFile, orderbooks, symbols);
+        }
+        catch (const std::exception& e)
+        {
+            std::cerr << e.what() << "\n";
+            return -1;
+        }
     }
-};
 
-struct NewOrderCommand : InputCommand
-{
-    int userId;
-    std::string symbol;
-    int price;
-    int quantity;
-    Orderside side;
-    int orderId;
-    NewOrderCommand(int userId, const std::string& symbol, int price, int quantity, Orderside side, int orderId)
-        : userId(userId), symbol(symbol), price(price), quantity(quantity), side(side), orderId(orderId)
+    // outlives the sink, whose last flush may wait for it
+    std::unique_ptr<JournalWriter> journal;
+    if (!journalDirectory.empty())
     {
+        try
+        {
+            journal.reset(new JournalWriter(journalDirectory, symbols, restoredSequence, journalConfig));
+        }
+        catch (const std::exception& e)
+        {
+            std::cerr << e.what() << "\n";
+            return -1;
+        }
     }
-
-    virtual void execute(OrderbookManager& orderbooks, std::ostream& o) const override
+    std::unique_ptr<OutputSink> sink;
+    if (binary)
+        sink.reset(new BinarySink(STDOUT_FILENO));
+    else
+        sink.reset(new TextSink(STDOUT_FILENO));
+    if (journal && journalConfig.sync == JournalSync::group)
     {
-        OrderbookChangesTracker tracker(orderbooks[symbol]);
-        std::stringstream matchOrderSS;
-        Orderbook::MatchFunctor matchFunctor = [&matchOrderSS](Orderside orderside, int bookClientId, int bookClientOrderId, int clientId, int clientOrderId, int price, int quantity) -> bool
-        {
-            print_matched_transaction(matchOrderSS, orderside, bookClientId, bookClientOrderId, clientId, clientOrderId, price, quantity);
-            return true;
-        };
-        if (orderbooks[symbol].add_order(side, userId, orderId, price, quantity, matchFunctor))
-        {
-            o << "A, " << userId << ", " << orderId << "\n";
-            auto matchedString = matchOrderSS.str();
-            if (!matchedString.empty())
-            {
-                o << matchedString;
-            }
-            tracker.check(orderbooks[symbol], o);
-        }
+        // the buffered output only comes from commands appended to the journal so far
+        JournalWriter* durableJournal = journal.get();
+        sink->set_barrier([durableJournal]() { durableJournal->wait_durable(durableJournal->appended()); });
     }
-};
-
-struct CancelOrderCommand : InputCommand
-{
-    int userId;
-    int orderId;
-    CancelOrderCommand(int userId, int orderId) : userId(userId), orderId(orderId)
-    {}
-
-    virtual void execute(OrderbookManager& orderbooks, std::ostream& o) const override
+    std::unique_ptr<ShardedEngine> shardedEngine;
+    if (shards > 0)
     {
-        std::for_each(orderbooks.begin(), orderbooks.end(), [this, &o](auto& orderbook)
-            {
-                OrderbookChangesTracker tracker(orderbook.second);
-                if (orderbook.second.cancel_order(userId, orderId))
-                {
-                    o << "C, " << userId << ", " << orderId << "\n";
-                    tracker.check(orderbook.second, o);
-                }
-            });
+        shardedEngine.reset(new ShardedEngine(shards, orderbooks, *sink));
     }
-};
+    const bool fromStdin = !replay && std::string(inputFile) == "-";
+    stream = !replay && (stream || fromStdin);
+    // the journal starts after the commands of the restored snapshot
+    std::uint64_t executed = replay ? restoredSequence : 0;
+    SnapshotWriter snapshotWriter;
+    auto consume = [&](const Command& command)
+    {
+        if (executed < restoredSequence)
+        {
+            // already applied to the restored books
+            ++executed;
+            return;
+        }
+        if (journal)
+            journal->append(command);
+        if (shardedEngine)
+        {
+            shardedEngine->submit(command);
+            return;
+        }
+        execute(command, orderbooks, *sink);
+        ++executed;
+        if (statsInterval && executed % statsInterval == 0)
+        {
+            // while streaming the symbols are interned by the parsing thread, books are named by id
+            orderbooks.write_stats(std::cerr, stream ? nullptr : &symbols);
+        }
+        if (snapshotInterval && executed % snapshotInterval == 0)
+        {
+            // only the copy of the orders is done here, the file is written in the background
+            snapshotWriter.write(capture_snapshot(orderbooks, symbols, executed), snapshotFile);
+        }
+    };
 
-struct FlushCommand : InputCommand
-{
-    virtual void execute(OrderbookManager& orderbooks, std::ostream& o) const override
+    if (replay)
     {
-        orderbooks.clear();
-        o << "\n";
+        try
+        {
+            JournalReader(replayDirectory).replay(symbols, restoredSequence, consume);
+        }
+        catch (const std::exception& e)
+        {
+            std::cerr << e.what() << "\n";
+            return -1;
+        }
     }
-};
-
-using InputCommandPtr = std::unique_ptr<InputCommand>;
-std::vector<InputCommandPtr> ParseInputCommands(std::istream& stream)
-{
-    std::string line;
-    std::vector<InputCommandPtr> commands;
-    while (std::getline(stream, line))
+    else if (stream)
     {
-        if (line.empty())
-            continue;
-        switch (*line.begin())
+        const int fd = fromStdin ? STDIN_FILENO : ::open(inputFile, O_RDONLY);
+        if (fd < 0)
         {
-        case '#':
-            commands.push_back(InputCommandPtr(new PrintCommand(std::move(line))));
-            break;
-        case 'N':
-        {
-            int userId;
-            char symbol[100];
-            int price;
-            int quantity;
-            char side;
-            int orderId;
-            auto ret = sscanf(line.c_str(), "N, %d, %s %d, %d, %c, %d", &userId, symbol, &price, &quantity, &side, &orderId);
-            Orderside orderside = side == 'B' ? Orderside::buy : Orderside::sell;
-            commands.push_back(InputCommandPtr(new NewOrderCommand(userId, symbol, price, quantity, orderside, orderId)));
-        }
-        break;
-        case 'C':
-        {
-            int userId, orderId;
-            auto ret = sscanf(line.c_str(), "C, %d, %d", &userId, &orderId);
-            commands.push_back(InputCommandPtr(new CancelOrderCommand(userId, orderId)));
-        }
-        break;
-        case 'F':
-            commands.push_back(InputCommandPtr(new FlushCommand));
-            break;
-        default:
-            break;
+            std::cout << "Cannot open input file " << inputFile << " please check if the location exists";
+            return -1;
+        }
+        CommandPipeline pipeline(symbols);
+        try
+        {
+            pipeline.run(fd, consume);
+        }
+        catch (const std::exception& e)
+        {
+            std::cerr << e.what() << "\n";
+            return -1;
         }
+        if (!fromStdin)
+            ::close(fd);
     }
-    return commands;
-}
+    else
+    {
+        std::unique_ptr<MappedFile> mappedFile;
+        try
+        {
+            mappedFile.reset(new MappedFile(inputFile));
+        }
+        catch (const std::exception&)
+        {
+            std::cout << "Cannot open input file " << inputFile << " please check if the location exists";
+            return -1;
+        }
 
-int main(int argc, char** argv) {
-    if (argc != 2)
+        const auto commands = parse_commands(mappedFile->begin(), mappedFile->end(), symbols);
+        mappedFile.reset();
+        try
+        {
+            for (const Command& command : commands)
+            {
+                consume(command);
+            }
+        }
+        catch (const std::exception& e)
+        {
+            std::cerr << e.what() << "\n";
+            return -1;
+        }
+    }
+    if (shardedEngine)
     {
-        std::cout << "Input format is command input_file\n";
-        return -1;
+        shardedEngine->finish();
     }
-
-    std::fstream inFile(argv[1], std::ios_base::in);
-    if (!inFile.is_open())
+    if (statsInterval)
     {
-        std::cout << "Cannot open input file " << argv[1] << " please check if the location exists";
+        if (shardedEngine)
+            shardedEngine->write_stats(std::cerr, &symbols);
+        else
+            orderbooks.write_stats(std::cerr, &symbols);
     }
-
-    auto commands = ParseInputCommands(inFile);
-    inFile.close();
-
-    OrderbookManager orderbooks;
-    for (const auto& command : commands)
+    try
+    {
+        if (!snapshotFile.empty())
+        {
+            snapshotWriter.write(capture_snapshot(orderbooks, symbols, executed), snapshotFile);
+            snapshotWriter.finish();
+        }
+        sink->flush();
+        if (journal)
+            journal->finish();
+    }
+    catch (const std::exception& e)
     {
-        command->execute(orderbooks, std::cout);
+        std::cerr << e.what() << "\n";
+        return -1;
     }
     return 0;
 }
@@ -0,0 +1,103 @@
+#pragma once
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+#include "pricelevels.hpp"
+#include "seqlock.hpp"
+
+namespace orderbook {
+    // number of levels per side kept in the depth cache
+    constexpr std::size_t MaxDepth = 16;
+
+    /**
+     * @brief Best levels of one side, from best to worst price
+     */
+    struct SideDepth
+    {
+        std::uint32_t count = 0;
+        DepthLevel levels[MaxDepth];
+    };
+
+    /**
+     * @brief Aggregated sizes of the MaxDepth best levels of one side of an orderbook
+     * The writer updates its own copy in place for every level change inside the cached range and publishes it
+     * through a SeqLock once per operation, only if it changed. When a level leaves a full cache the level after
+     * the last cached one is unknown, the cache is then refilled from the price levels before being published.
+     * While count is below MaxDepth the cache holds every level of the side.
+     */
+    template<typename Compare>
+    class DepthCache
+    {
+        SideDepth depth;
+        bool changed = false;
+        bool truncated = false; // a level was removed from a full cache
+        SeqLock<SideDepth> published;
+
+    public:
+        // new aggregated size of the level at price, 0 once the level is removed
+        void update(int price, int size)
+        {
+            if(truncated)
+                return; // rebuilt on publish
+            std::uint32_t index = 0;
+            while(index < depth.count && Compare()(depth.levels[index].price, price))
+                ++index;
+            if(index < depth.count && depth.levels[index].price == price)
+            {
+                if(size > 0)
+                {
+                    depth.levels[index].quantity = size;
+                }
+                else
+                {
+                    truncated = depth.count == MaxDepth;
+                    std::memmove(depth.levels + index, depth.levels + index + 1, (depth.count - index - 1) * sizeof(DepthLevel));
+                    --depth.count;
+                }
+                changed = true;
+            }
+            else if(size > 0 && index < MaxDepth)
+            {
+                // new level inside the cached range, the worst one falls out of a full cache
+                const std::uint32_t kept = std::min<std::uint32_t>(depth.count, MaxDepth - 1);
+                std::memmove(depth.levels + index + 1, depth.levels + index, (kept - index) * sizeof(DepthLevel));
+                depth.levels[index] = DepthLevel{price, size};
+                depth.count = kept + 1;
+                changed = true;
+            }
+        }
+
+        // publishes the changes since the last call
+        void publish(const PriceLevels<Compare>& levels)
+        {
+            if(truncated)
+            {
+                depth.count = std::uint32_t(levels.best_levels(depth.levels, MaxDepth));
+                truncated = false;
+            }
+            if(changed)
+            {
+                published.store(depth);
+                changed = false;
+            }
+        }
+
+        void clear()
+        {
+            depth.count = 0;
+            truncated = false;
+            changed = true;
+        }
+
+        // copies up to count levels of the last published depth to out, never blocks the writer
+        std::size_t load(DepthLevel* out, std::size_t count) const
+        {
+            const SideDepth snapshot = published.load();
+            const std::size_t copied = std::min<std::size_t>(count, snapshot.count);
+            std::memcpy(out, snapshot.levels, copied * sizeof(DepthLevel));
+            return copied;
+        }
+    };
+}
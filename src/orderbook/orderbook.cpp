@@ -1,193 +1,322 @@
 #include "orderbook.hpp"
-#include <iostream>
+#include <algorithm>
+#include <chrono>
 #include <mutex>
 using namespace orderbook;
 
-bool Orderbook::add_order(Orderside side, int clientId, int orderId, int price, int quantity, MatchFunctor matchFunctor)
+Orderbook::Orderbook(const OrderbookConfig& config)
+    : asks(arena, config.backend, config.ladderTicks), bids(arena, config.backend, config.ladderTicks), threadSafe(config.threadSafe)
 {
-    const auto orderKey = std::make_pair(clientId, orderId);
-    if(placedOrders.count(orderKey))
-        return false; // order already exists
+}
 
-    std::unique_lock<std::shared_mutex> lk(mtx);
-    if (match(side, clientId, orderId, price, quantity, matchFunctor)) // check if order matches any exisiting orders
-        return true;
-    if(price == 0)
-        return false;
+Orderbook::~Orderbook()
+{
+    flush();
+}
 
-    bool orderAdded = false;
-    // add order functor
-    auto addOrder = [](auto& container, int clientId, int orderId, int price, int quantity) -> bool
+namespace {
+    // calls the match functor for every fill
+    struct FunctorListener : OrderbookListener
     {
-        auto ite = container.find(price);
-        if(ite == container.end())
-        {
-            std::unique_ptr<Orders> orders(new Orders);
-            orders->add_order(clientId, orderId, quantity);
-            container.insert(std::make_pair(price, std::move(orders)));
-            return true;
-        }
-        else
+        const Orderbook::MatchFunctor& matchFunctor;
+        explicit FunctorListener(const Orderbook::MatchFunctor& matchFunctor) : matchFunctor(matchFunctor) {}
+
+        void on_fill(Orderside side, int bookClientId, int bookOrderId, int clientId, int orderId, int price, int quantity)
         {
-            return ite->second->add_order(clientId, orderId, quantity);
+            if(matchFunctor)
+                matchFunctor(side, bookClientId, bookOrderId, clientId, orderId, price, quantity);
         }
     };
+}
 
-    if (side == Orderside::sell)
-    {
-        orderAdded = addOrder(asks, clientId, orderId, price, quantity);
-    }
-    else if(side == Orderside::buy)
+bool Orderbook::add_order(Orderside side, int clientId, int orderId, int price, int quantity, const MatchFunctor& matchFunctor)
+{
+    FunctorListener listener(matchFunctor);
+    return add_order(side, clientId, orderId, price, quantity, listener);
+}
+
+bool Orderbook::add_stop_order(Orderside side, int clientId, int orderId, int stopPrice, int price, int quantity)
+{
+    if((side != Orderside::sell && side != Orderside::buy) || stopPrice <= 0 || price < 0 || quantity <= 0)
+        return false;
+    auto lk = write_lock();
+    const OrderKey orderKey = make_key(clientId, orderId);
+    count(&OrderbookCounters::adds);
+    if(placedOrders.count(orderKey) || stopOrders.count(orderKey))
     {
-        orderAdded = addOrder(bids, clientId, orderId, price, quantity);
+        count(&OrderbookCounters::duplicates);
+        return false;
     }
-    else
+    // only trades after this one trigger it
+    const auto stop = side == Orderside::buy ? buyStops.emplace(stopPrice, StopOrder{clientId, orderId, price, quantity, side})
+                                             : sellStops.emplace(-stopPrice, StopOrder{clientId, orderId, price, quantity, side});
+    stopOrders.emplace(orderKey, stop);
+    return true;
+}
+
+void Orderbook::release_stops()
+{
+    if(tradedHigh > 0)
     {
-        return false;
+        // a key reached by the trades is at the front, releasing costs one erase per triggered stop
+        auto release = [this](StopQueue& stops, int reached)
+        {
+            while(!stops.empty() && stops.begin()->first <= reached)
+            {
+                const StopOrder& stop = stops.begin()->second;
+                stopOrders.erase(make_key(stop.clientId, stop.orderId));
+                triggered.push_back(stop);
+                stops.erase(stops.begin());
+            }
+        };
+        release(buyStops, tradedHigh);
+        release(sellStops, -tradedLow);
     }
-    auto [_ite, addedInPlacedOrder] = placedOrders.insert(std::make_pair(orderKey, std::make_pair(price, side)));
-    return orderAdded && addedInPlacedOrder;
+    tradedLow = std::numeric_limits<int>::max();
+    tradedHigh = 0;
 }
 
 bool Orderbook::cancel_order(int clientId, int orderId)
 {
-    const auto orderKey = std::make_pair(clientId, orderId);
-    auto iteOrder = placedOrders.find(orderKey);
-    if(iteOrder == placedOrders.end())
-        return false;
-    
-    int price = iteOrder->second.first;
-    Orderside side = iteOrder->second.second;
-    bool orderErased = false;
-    std::unique_lock lk(mtx);
-
-    // remove order functor
-    auto removeOrder = [](auto& container, int clientId, int orderId, int price) -> bool
+    OrderbookListener listener;
+    return cancel_order(clientId, orderId, listener);
+}
+
+bool Orderbook::modify_order(int clientId, int orderId, int price, int quantity)
+{
+    OrderbookListener listener;
+    return modify_order(clientId, orderId, price, quantity, listener);
+}
+
+void Orderbook::flush()
+{
+    auto lk = write_lock();
+    const BestLevels before = best_levels();
+    asks.clear();
+    bids.clear();
+    askDepth.clear();
+    bidDepth.clear();
+    for(auto& [orderKey, node] : placedOrders)
+        delete_node(node);
+    placedOrders.clear();
+    reserves.clear();
+    stopOrders.clear();
+    buyStops.clear();
+    sellStops.clear();
+    tradedLow = std::numeric_limits<int>::max();
+    tradedHigh = 0;
+    OrderbookListener listener;
+    notify_changes(before, listener);
+}
+
+void Orderbook::reserve(std::size_t maxOrders, std::size_t maxLevels)
+{
+    auto lk = write_lock();
+    placedOrders.reserve(maxOrders);
+    // a sweep changes every level of a side and the level of the order
+    changedLevels.reserve(2 * maxLevels + 2);
+
+    // node types of the containers are implementation defined and may share size classes with OrderNode,
+    // so everything is reserved by holding temporary entries at the same time and releasing them together:
+    // their blocks are left on the free lists of the arena
+    const std::size_t placedCount = placedOrders.size();
+    std::vector<OrderNode*> temporaryNodes;
+    std::vector<OrderKey> temporaryKeys;
+    temporaryNodes.reserve(maxOrders);
+    temporaryKeys.reserve(maxOrders);
+    for(OrderKey key = 0; placedCount + temporaryKeys.size() < maxOrders; ++key)
+    {
+        if(placedOrders.emplace(key, nullptr).second)
+        {
+            temporaryKeys.push_back(key);
+            temporaryNodes.push_back(new_node());
+        }
+    }
+
+    // levels outside of a ladder window live in the tree
+    const auto temporaryAsks = asks.hold_tree_levels(maxLevels);
+    const auto temporaryBids = bids.hold_tree_levels(maxLevels);
+
+    // queue arrays of every level for the average depth, a queue only doubles its capacity when more than half
+    // of it is live so it stays under 4 times its depth
+    const std::size_t depth = (maxOrders + std::max<std::size_t>(maxLevels, 1) - 1) / std::max<std::size_t>(maxLevels, 1);
+    std::vector<std::pair<int*, OrderNode**>> temporaryQueues;
+    std::vector<std::uint32_t> temporaryCapacities;
+    for(std::uint32_t capacity = Orders::InitialCapacity; capacity < 4 * depth && Arena::can_allocate(capacity * sizeof(OrderNode*)); capacity *= 2)
     {
-        auto ite = container.find(price);
-        if(ite == container.end())
+        for(std::size_t level = 0; level < 2 * maxLevels; ++level)
         {
-            return false;
+            temporaryQueues.emplace_back(arena.allocate_array<int>(capacity), arena.allocate_array<OrderNode*>(capacity));
+            temporaryCapacities.push_back(capacity);
         }
-        else
+    }
+    for(std::size_t index = 0; index < temporaryQueues.size(); ++index)
+    {
+        arena.deallocate_array(temporaryQueues[index].first, temporaryCapacities[index]);
+        arena.deallocate_array(temporaryQueues[index].second, temporaryCapacities[index]);
+    }
+
+    asks.release_tree_levels(temporaryAsks);
+    bids.release_tree_levels(temporaryBids);
+    for(OrderKey key : temporaryKeys)
+        placedOrders.erase(key);
+    for(OrderNode* node : temporaryNodes)
+        delete_node(node);
+}
+
+void Orderbook::export_orders(std::vector<RestingOrder>& out) const
+{
+    std::shared_lock<std::shared_mutex> lock;
+    if(threadSafe)
+        lock = std::shared_lock<std::shared_mutex>(mtx);
+    out.reserve(out.size() + placedOrders.size());
+    auto exportLevel = [this, &out](const Orders& level)
+    {
+        for(std::uint32_t slot = level.head; slot < level.tail; ++slot)
         {
-            bool orderRemoved = ite->second->remove_order(clientId, orderId);
-            if(ite->second->size == 0)
+            if(const OrderNode* node = level.nodes[slot])
             {
-                container.erase(ite);
+                out.push_back(RestingOrder{node->clientId, node->orderId, node->price, level.quantities[slot], node->side});
+                if(node->iceberg)
+                {
+                    const Reserve& reserve = reserves.find(make_key(node->clientId, node->orderId))->second;
+                    out.back().hidden = reserve.hidden;
+                    out.back().display = reserve.display;
+                }
             }
-            return orderRemoved;
         }
+        return true;
     };
+    asks.for_each_level(exportLevel);
+    bids.for_each_level(exportLevel);
+}
+
+void Orderbook::export_stops(std::vector<PendingStop>& out) const
+{
+    std::shared_lock<std::shared_mutex> lock;
+    if(threadSafe)
+        lock = std::shared_lock<std::shared_mutex>(mtx);
+    out.reserve(out.size() + stopOrders.size());
+    for(const auto& [key, stop] : buyStops)
+        out.push_back(PendingStop{stop.clientId, stop.orderId, key, stop.price, stop.quantity, stop.side});
+    // sell stops are keyed by their negated price
+    for(const auto& [key, stop] : sellStops)
+        out.push_back(PendingStop{stop.clientId, stop.orderId, -key, stop.price, stop.quantity, stop.side});
+}
+
+OrderHandle Orderbook::restore_order(const RestingOrder& order)
+{
+    if((order.side != Orderside::sell && order.side != Orderside::buy) || order.price <= 0 || order.quantity <= 0 || order.hidden < 0
+        || (order.hidden > 0 && order.display <= 0))
+        return nullptr;
+    auto lk = write_lock();
+    const OrderKey orderKey = make_key(order.clientId, order.orderId);
+    if(placedOrders.count(orderKey) || stopOrders.count(orderKey))
+        return nullptr;
 
-    if (side == Orderside::sell)
+    const BestLevels before = best_levels();
+    OrderNode* node = new_node();
+    node->clientId = order.clientId;
+    node->orderId = order.orderId;
+    node->price = order.price;
+    node->side = order.side;
+    if(order.hidden > 0)
     {
-        orderErased = removeOrder(asks, clientId, orderId, price);
+        reserves.emplace(orderKey, Reserve{order.display, order.hidden});
+        node->iceberg = true;
     }
-    else if(side == Orderside::buy)
+    OrderbookListener listener;
+    auto restore = [this, &order, &listener, node](auto& container, auto& depth)
     {
-        orderErased = removeOrder(bids, clientId, orderId, price);
-    }
+        Orders& level = container.level(order.price);
+        level.hidden += order.hidden;
+        container.add_order(level, node, order.quantity);
+        level_changed(order.side, container, depth, level, listener);
+    };
+    if(order.side == Orderside::sell)
+        restore(asks, askDepth);
     else
-    {
-        return false;
-    }
+        restore(bids, bidDepth);
+    placedOrders.emplace(orderKey, node);
+    notify_changes(before, listener);
+    return node;
+}
 
-    return placedOrders.erase(orderKey) == 1 && orderErased;
+OrderNode* Orderbook::new_node()
+{
+    ++liveNodes;
+    return new (arena.allocate(sizeof(OrderNode))) OrderNode;
 }
-void Orderbook::flush()
+
+void Orderbook::delete_node(OrderNode* node)
 {
-    std::unique_lock lk(mtx);
-    asks.clear();
-    bids.clear();
-    placedOrders.clear();
+    --liveNodes;
+    node->~OrderNode();
+    arena.deallocate(node, sizeof(OrderNode));
 }
 
 std::pair<int, int> Orderbook::get_min_ask() const
 {
-    if(asks.empty())
-        return std::make_pair(-1, -1);
-    std::shared_lock lk(mtx);
-    return std::make_pair( asks.begin()->first, asks.begin()->second->size);
+    const TopOfBook top = topOfBook.load();
+    return std::make_pair(top.askPrice, top.askQuantity);
 }
 std::pair<int, int> Orderbook::get_max_bid() const
 {
-    if(bids.empty())
-        return std::make_pair(-1, -1);
-    std::shared_lock lk(mtx);
-    return std::make_pair( bids.begin()->first, bids.begin()->second->size);
+    const TopOfBook top = topOfBook.load();
+    return std::make_pair(top.bidPrice, top.bidQuantity);
 }
 
-bool Orderbook::match(Orderside side, int clientId, int orderId, int price, int& quantity, MatchFunctor& matchFunctor)
+void Orderbook::publish_top_of_book(const BestLevels& levels)
 {
-    // compares the current order price with min ask or max bid
-    auto comparator = [](const Orderside side, int price, const auto& asks, const auto& bids) -> bool
-    {
-        if (side == Orderside::buy) // <- will get min ask
-        {
-            return asks.size() > 0 && (asks.begin()->first <= price || price == 0);
-        }
-        else if (side == Orderside::sell) // <- will get max bid
-        {
-            return bids.size() > 0 && (bids.begin()->first >= price || price == 0);
-        }
-        return false;
-    };
+    TopOfBook top;
+    top.askPrice = levels.ask.first;
+    top.askQuantity = levels.ask.second;
+    top.bidPrice = levels.bid.first;
+    top.bidQuantity = levels.bid.second;
+    top.sequence = topOfBook.version() + 1;
+    topOfBook.store(top);
+}
 
-    // consume the begin of ask or bid depending on orderside
-    auto consume = [side](auto& container, int clientId, int orderId, int& quantity, MatchFunctor& matchFunctor)
+std::size_t Orderbook::depth(Orderside side, std::size_t levels, DepthLevel* out) const
+{
+    return side == Orderside::sell ? askDepth.load(out, levels) : bidDepth.load(out, levels);
+}
+
+OrderbookStats Orderbook::stats() const
+{
+    std::shared_lock<std::shared_mutex> lock;
+    if(threadSafe)
+        lock = std::shared_lock<std::shared_mutex>(mtx);
+    OrderbookStats stats;
+    stats.counters = counters;
+    stats.askLevels = asks.size();
+    stats.bidLevels = bids.size();
+    auto countOrders = [&stats](const Orders& level)
     {
-        auto ite = container.begin();
-        int book_price = ite->first;
-        auto& details = ite->second;
-        bool eraseIterator = false;
-        if (details->size > quantity)
-        {
-            auto current = details->orderDetails.begin();
-            while(current != details->orderDetails.end() && quantity > 0)
-            {
-                if(matchFunctor)
-                {
-                    matchFunctor(side, current->clientId, current->orderId, clientId, orderId, book_price, std::min(current->quantity, quantity));
-                }
-                
-                if(current->quantity > quantity)
-                {
-                    current->quantity -= quantity;
-                    details->size -= quantity;
-                    quantity = 0;
-                    break;
-                }
-                quantity -= current->quantity;
-                details->size -= current->quantity;
-                ++current;
-            }
-            details->orderDetails.erase(details->orderDetails.begin(), current);
-        }
-        else
-        {
-            quantity -= details->size;
-            if(matchFunctor)
-            {
-                for (const auto& detail : details->orderDetails)
-                {
-                    matchFunctor(side, detail.clientId, detail.orderId, clientId, orderId, book_price, detail.quantity);
-                }
-            }
-            container.erase(ite);
-        }
+        stats.restingOrders += level.count;
+        return true;
     };
+    asks.for_each_level(countOrders);
+    bids.for_each_level(countOrders);
+    stats.indexedOrders = placedOrders.size();
+    stats.allocatedNodes = liveNodes;
+    stats.pendingStops = stopOrders.size();
+    stats.bytesReserved = arena.bytes_reserved();
+    return stats;
+}
 
-    while (quantity > 0 && comparator(side, price, asks, bids))
+void Orderbook::wait_lock(std::unique_lock<std::shared_mutex>& lock)
+{
+    if constexpr (CountStats)
     {
-        if (side == Orderside::buy)
-        {
-            consume(asks, clientId, orderId, quantity, matchFunctor);
-        }
-        else if (side == Orderside::sell)
-        {
-            consume(bids, clientId, orderId, quantity, matchFunctor);
-        }
+        const auto start = std::chrono::steady_clock::now();
+        lock.lock();
+        // counted once the lock is held
+        ++counters.lockContended;
+        counters.lockWaitNanos += std::uint64_t(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count());
     }
-    return quantity > 0 ? false : true;
-}
\ No newline at end of file
+    else
+    {
+        lock.lock();
+    }
+}
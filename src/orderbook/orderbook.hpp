@@ -2,49 +2,440 @@
 
 #include <vector>
 #include <map>
+#include <unordered_map>
 #include <functional>
+#include <mutex>
 #include <shared_mutex>
+#include <cstdint>
+#include <type_traits>
+#include <limits>
 
+#include "depth.hpp"
 #include "orders.hpp"
 #include "orderside.hpp"
+#include "pool.hpp"
+#include "pricelevels.hpp"
+#include "seqlock.hpp"
 #include <memory>
 
+// counters of the hot paths, on by default, build with ORDERBOOK_STATS=0 to compile them out
+#ifndef ORDERBOOK_STATS
+#define ORDERBOOK_STATS 1
+#endif
+
 namespace orderbook {
+    // what happens to the quantity of an order which is not matched on arrival
+    enum class TimeInForce : std::uint8_t {
+        gtc, // rests in the book at the limit price, market orders drop it
+        ioc, // immediate or cancel, dropped
+        fok  // fill or kill, the order is dropped without trading unless it fills entirely
+    };
+
+    /**
+     * @brief Settings chosen per orderbook at construction
+     */
+    struct OrderbookConfig
+    {
+        LevelsBackend backend = LevelsBackend::tree;
+        int ladderTicks = 2048; // width of the ladder window in ticks
+        bool threadSafe = true; // take the lock in every operation, not needed when a single thread owns the book
+    };
+
+    /**
+     * @brief Best bid and ask of an orderbook, (-1, -1) for an empty side
+     */
+    struct TopOfBook
+    {
+        int bidPrice = -1;
+        int bidQuantity = -1;
+        int askPrice = -1;
+        int askQuantity = -1;
+        std::uint64_t sequence = 0; // incremented every time the top of book changes
+    };
+
+    /**
+     * @brief Event counters of an orderbook since its construction, all zero when built with ORDERBOOK_STATS=0
+     */
+    struct OrderbookCounters
+    {
+        std::uint64_t adds = 0;             // add_order calls
+        std::uint64_t duplicates = 0;       // adds rejected because the order already rests in the book
+        std::uint64_t aggressiveOrders = 0; // adds that matched at least one resting order
+        std::uint64_t fills = 0;
+        std::uint64_t replenishments = 0;   // display slices of iceberg orders queued again after a fill
+        std::uint64_t levelsSwept = 0;      // levels emptied by matching
+        std::uint64_t levelsCreated = 0;
+        std::uint64_t ordersRested = 0;     // adds whose remaining quantity was queued
+        std::uint64_t cancels = 0;
+        std::uint64_t cancelMisses = 0;     // cancels of orders not in the book
+        std::uint64_t modifies = 0;         // modify_order calls which changed a resting order
+        std::uint64_t modifiesInPlace = 0;  // modifies which only reduced the quantity, keeping the time priority
+        std::uint64_t expired = 0;          // immediate or cancel orders whose remaining quantity was dropped
+        std::uint64_t killed = 0;           // fill or kill orders dropped for lack of liquidity
+        std::uint64_t stopsTriggered = 0;   // stop orders released into the book by a trade
+        std::uint64_t lockContended = 0;    // write locks that had to wait
+        std::uint64_t lockWaitNanos = 0;    // time spent waiting for them
+    };
+
+    /**
+     * @brief Snapshot of the counters and the current size of an orderbook
+     */
+    struct OrderbookStats
+    {
+        OrderbookCounters counters;
+        std::size_t askLevels = 0;
+        std::size_t bidLevels = 0;
+        std::size_t restingOrders = 0;  // live orders queued in the levels
+        std::size_t indexedOrders = 0;  // entries of the order index, always restingOrders
+        std::size_t allocatedNodes = 0; // order nodes taken from the arena, always restingOrders
+        std::size_t pendingStops = 0;   // stop orders waiting for their trigger, not counted above
+        std::size_t bytesReserved = 0; // memory taken by the arena of the book
+    };
+
+    // resting order of a book as handed out to its listeners, valid until the order is filled or cancelled or the
+    // book is flushed
+    using OrderHandle = const OrderNode*;
+
+    /**
+     * @brief Receives the events of an orderbook
+     * Listeners are template arguments of the orderbook methods so that the callbacks are resolved at
+     * compile time and inlined in the matching loop. Derive from it and hide the callbacks of interest.
+     */
+    struct OrderbookListener
+    {
+        // called for every fill of a resting order
+        // with orderside, clientIdInBook, clientOrderIdInBook, clientId, OrderderId, price, quantity
+        void on_fill(Orderside, int, int, int, int, int, int) {}
+        // called after the last fill of a resting order, once it left the book, with the side of the resting order
+        void on_filled(Orderside, int /*clientId*/, int /*orderId*/) {}
+        // called when the remaining quantity of an order rests in the book
+        void on_add(Orderside, int /*clientId*/, int /*orderId*/, int /*price*/, int /*quantity*/) {}
+        // called after on_add when a new order rests in the book, with the handle cancel_order takes instead of its ids
+        void on_rested(int /*clientId*/, int /*orderId*/, OrderHandle) {}
+        // called when a resting order is cancelled with its remaining quantity
+        void on_cancel(Orderside, int /*clientId*/, int /*orderId*/, int /*price*/, int /*quantity*/) {}
+        // called when the next display slice of an iceberg order is queued at the back of its level, after the
+        // previous one was filled, with the quantity of the slice
+        void on_replenish(Orderside, int /*clientId*/, int /*orderId*/, int /*price*/, int /*quantity*/) {}
+        // called when a trade reaches the stop price of a stop order, right before it is added to the book with its
+        // limit price, 0 for a market order
+        void on_triggered(Orderside, int /*clientId*/, int /*orderId*/, int /*price*/, int /*quantity*/) {}
+        // called when the quantity of an immediate or cancel or fill or kill order left after matching is dropped
+        void on_expired(Orderside, int /*clientId*/, int /*orderId*/, int /*quantity*/) {}
+        // called when the quantity of a resting order is reduced in place, with its new remaining quantity
+        // an order modified to another price or to a larger quantity is reported as cancelled and added again
+        void on_modify(Orderside, int /*clientId*/, int /*orderId*/, int /*price*/, int /*quantity*/) {}
+        // called at the end of an operation for each level it changed, once per level with its aggregated quantity at
+        // that point, 0 if the level was removed, in the order the levels first changed
+        // the changes are only tracked for listeners which hide on_level
+        void on_level(Orderside, int /*price*/, int /*quantity*/) {}
+        // called at the end of an operation for each side whose best (price, quantity) changed during it, after the
+        // on_level events, (-1, -1) if the side is empty
+        void on_top_of_book(Orderside, int /*price*/, int /*quantity*/) {}
+    };
+
+    /**
+     * @brief Operation of a batch applied with Orderbook::apply_batch
+     * A cancel only uses clientId and orderId, a modify gives the new price and quantity of a resting order.
+     */
+    struct BookCommand
+    {
+        enum class Type : std::uint8_t { add, cancel, modify };
+        Type type = Type::add;
+        Orderside side = Orderside::buy;
+        TimeInForce timeInForce = TimeInForce::gtc; // of an add
+        int display = 0; // of an add, displayed quantity of an iceberg order, 0 displays all of it
+        int clientId = 0;
+        int orderId = 0;
+        int price = 0;
+        int quantity = 0;
+    };
+
+    /**
+     * @brief Order resting in a book, as exported to and restored from a snapshot
+     */
+    struct RestingOrder
+    {
+        int clientId = 0;
+        int orderId = 0;
+        int price = 0;
+        int quantity = 0; // displayed
+        Orderside side = Orderside::buy;
+        int hidden = 0;  // quantity of an iceberg order still in reserve
+        int display = 0; // size of the display slices of an iceberg order
+    };
+
+    /**
+     * @brief Stop order waiting for its trigger, as exported to and restored from a snapshot
+     */
+    struct PendingStop
+    {
+        int clientId = 0;
+        int orderId = 0;
+        int stopPrice = 0;
+        int price = 0; // limit price once triggered, 0 for a market order
+        int quantity = 0;
+        Orderside side = Orderside::buy;
+    };
+
     /**
      * @brief Orderbook to track bid and ask orders
      * Orders must follow assumptions that there are no two orders with same side, clientId and orderId
      */
     class Orderbook
     {
+        // order_key i.e (clientId, orderId) packed in a single integer
+        using OrderKey = std::uint64_t;
+
+        using OrderIndex = std::unordered_map<OrderKey, OrderNode*, std::hash<OrderKey>, std::equal_to<OrderKey>, PoolAllocator<std::pair<const OrderKey, OrderNode*>>>;
+        // hidden part of a resting iceberg order
+        struct Reserve
+        {
+            int display; // size of a slice
+            int hidden;  // quantity not displayed yet, never 0
+        };
+        using ReserveIndex = std::unordered_map<OrderKey, Reserve, std::hash<OrderKey>, std::equal_to<OrderKey>, PoolAllocator<std::pair<const OrderKey, Reserve>>>;
+        // stop order waiting for its trigger
+        struct StopOrder
+        {
+            int clientId;
+            int orderId;
+            int price; // limit price once triggered, 0 for a market order
+            int quantity;
+            Orderside side;
+        };
+        // pending stops of a side by trigger key, in time priority within a key
+        using StopQueue = std::multimap<int, StopOrder, std::less<int>, PoolAllocator<std::pair<const int, StopOrder>>>;
+        using StopIndex = std::unordered_map<OrderKey, StopQueue::iterator, std::hash<OrderKey>, std::equal_to<OrderKey>, PoolAllocator<std::pair<const OrderKey, StopQueue::iterator>>>;
+
+        // memory for order nodes, price levels and index entries / must outlive the containers below
+        Arena arena;
         // to store asks
-        std::map<int, std::unique_ptr<Orders>> asks;
+        PriceLevels<std::less<int>> asks;
         // to store bids
-        std::map<int, std::unique_ptr<Orders>, std::greater<int>> bids;
-        // to map order_key i.e (clientId, orderId) -> (price, side) / used for cancel
-        std::map<std::pair<int, int>, std::pair<int, Orderside>> placedOrders;
+        PriceLevels<std::greater<int>> bids;
+        // to map order_key -> resting order node / used for cancel
+        OrderIndex placedOrders{0, std::hash<OrderKey>(), std::equal_to<OrderKey>(), PoolAllocator<int>(arena)};
+        // order_key -> reserve of the iceberg orders, only looked up for nodes flagged iceberg
+        ReserveIndex reserves{0, std::hash<OrderKey>(), std::equal_to<OrderKey>(), PoolAllocator<int>(arena)};
+        // iceberg orders whose displayed slice was filled by the sweep of a level, queued again once it is done
+        std::vector<OrderNode*> replenished;
+        // pending stop orders, a buy stop is keyed by its stop price and a sell stop by its negated stop price, so the
+        // stops reached by a trade are always at the front of their queue
+        StopQueue buyStops{PoolAllocator<int>(arena)};
+        StopQueue sellStops{PoolAllocator<int>(arena)};
+        // order_key -> pending stop order / used for cancel
+        StopIndex stopOrders{0, std::hash<OrderKey>(), std::equal_to<OrderKey>(), PoolAllocator<int>(arena)};
+        // stops released by the trades of the current operation, executed in turn by trigger_stops
+        std::vector<StopOrder> triggered;
+        // lowest and highest prices traded since the stops were last checked, highest is 0 without trades
+        int tradedLow = std::numeric_limits<int>::max();
+        int tradedHigh = 0;
         // to support multiple threads
         mutable std::shared_mutex mtx;
+        const bool threadSafe;
+        // published by the writer after every change, read without locking
+        SeqLock<TopOfBook> topOfBook;
+        // best levels of each side, published with the top of book
+        DepthCache<std::less<int>> askDepth;
+        DepthCache<std::greater<int>> bidDepth;
+        // updated under the write lock
+        OrderbookCounters counters;
+        // order nodes taken from the arena and not released yet
+        std::size_t liveNodes = 0;
+        // level changed by the current operation with its last size, sequence orders the changes
+        struct ChangedLevel
+        {
+            Orderside side;
+            int price;
+            int size;
+            std::uint32_t sequence;
+        };
+        // levels changed by the current operation, reported once each by notify_changes
+        std::vector<ChangedLevel> changedLevels;
+        // up to this many levels a change updates the entry of its level, later ones are deduplicated by notify_changes
+        static constexpr std::size_t SmallChanges = 8;
 
     public:
+        explicit Orderbook(const OrderbookConfig& config = OrderbookConfig());
+        Orderbook(const Orderbook&) = delete;
+        Orderbook& operator=(const Orderbook&) = delete;
+        ~Orderbook();
+
         // functor which is called in case of match
         // calls with orderside, clientIdInBook, clientOrderIdInBook, clientId, OrderderId, price, quantity
         using MatchFunctor = std::function<bool(Orderside orderside, int, int, int, int, int, int)>;
 
-        // To add order to orderbook
-        bool add_order(Orderside side, int clientId, int orderId, int price, int quantity, MatchFunctor matchFunctor);
-        // to remove order from orderbook
+        // listeners must derive from OrderbookListener
+        template<typename Listener>
+        using IfListener = std::enable_if_t<std::is_base_of_v<OrderbookListener, Listener>, bool>;
+
+        // To add order to orderbook, price 0 is a market order
+        // returns true if the order rested or filled entirely, an immediate or cancel order is accepted if it traded
+        // and a fill or kill order is checked against the liquidity of the book before anything is matched
+        template<typename Listener>
+        IfListener<Listener> add_order(Orderside side, int clientId, int orderId, int price, int quantity, Listener& listener, TimeInForce timeInForce = TimeInForce::gtc);
+        bool add_order(Orderside side, int clientId, int orderId, int price, int quantity, const MatchFunctor& matchFunctor);
+        // To add an iceberg order which displays at most display of its quantity, once a displayed slice is filled the next
+        // one is taken from the hidden rest and queued at the back of the level, the levels only count displayed quantity
+        // an order which matches entirely or with at most display left is a regular order
+        template<typename Listener>
+        IfListener<Listener> add_iceberg_order(Orderside side, int clientId, int orderId, int price, int quantity, int display, Listener& listener);
+        // To add a stop order, held outside of the book until a trade at stopPrice or beyond, at or above it for a buy and
+        // at or below it for a sell, then added with its limit price, 0 for a market order, in the same operation
+        // returns false if the order already exists or a price or the quantity is not valid
+        bool add_stop_order(Orderside side, int clientId, int orderId, int stopPrice, int price, int quantity);
+        // to remove order from orderbook, or a stop order not triggered yet
+        template<typename Listener>
+        IfListener<Listener> cancel_order(int clientId, int orderId, Listener& listener);
         bool cancel_order(int clientId, int orderId);
+        // to remove a resting order by the handle given to on_rested, without looking it up
+        template<typename Listener>
+        IfListener<Listener> cancel_order(OrderHandle order, Listener& listener);
+        // changes the price and quantity of a resting order, returns false if it does not rest in the book or the
+        // price or quantity is not positive
+        // a smaller quantity at the same price is changed in place and keeps the time priority of the order, otherwise
+        // the order is moved to the back of the queue of its new price, matching first if it crosses the other side
+        template<typename Listener>
+        IfListener<Listener> modify_order(int clientId, int orderId, int price, int quantity, Listener& listener);
+        bool modify_order(int clientId, int orderId, int price, int quantity);
+        // applies size commands in order under a single lock, with the same results and listener events as
+        // calling add_order, cancel_order and modify_order one by one
+        // returns the number of accepted commands, accepted[i] is set to the result of commands[i] if given
+        template<typename Listener>
+        std::size_t apply_batch(const BookCommand* commands, std::size_t size, Listener& listener, bool* accepted = nullptr);
         // to clear orderbook
         void flush();
+        // appends every resting order to out, asks then bids from the best level and in time priority within a level
+        // takes the lock in shared mode, only from the owning thread if the book is not thread safe
+        void export_orders(std::vector<RestingOrder>& out) const;
+        // appends every pending stop order to out, the buys then the sells in the order they trigger, add_stop_order
+        // called with them in the same order rebuilds the same stops
+        // takes the lock in shared mode, only from the owning thread if the book is not thread safe
+        void export_stops(std::vector<PendingStop>& out) const;
+        // queues order at the back of its level without matching, the orders of export_orders restored in the same
+        // order rebuild the same book, returns the handle of the order or nullptr if it already rests in the book or
+        // can not rest
+        OrderHandle restore_order(const RestingOrder& order);
+        // preallocate memory so that up to maxOrders resting orders on maxLevels price levels per side
+        // can be added, matched and cancelled without calling the global allocator
+        void reserve(std::size_t maxOrders, std::size_t maxLevels);
         // Get max (price, quantity) in ask orders
         std::pair<int, int> get_min_ask() const;
         // Get min (price, quantity) in bid orders
         std::pair<int, int> get_max_bid() const;
+        // Get consistent best bid and ask, never blocks the writer
+        TopOfBook top_of_book() const { return topOfBook.load(); }
+        // copies up to levels best (price, aggregated quantity) of side to out, from best to worst, never blocks the writer
+        // returns the number of levels copied, at most MaxDepth
+        std::size_t depth(Orderside side, std::size_t levels, DepthLevel* out) const;
+        // counters and sizes, takes the lock in shared mode, only from the owning thread if the book is not thread safe
+        OrderbookStats stats() const;
 
     private:
+        static OrderKey make_key(int clientId, int orderId)
+        {
+            return (OrderKey(std::uint32_t(clientId)) << 32) | std::uint32_t(orderId);
+        }
+        // best (price, quantity) of both sides, used to notify top of book changes
+        struct BestLevels
+        {
+            std::pair<int, int> ask, bid;
+        };
+        static std::pair<int, int> level_top(const Orders* level)
+        {
+            return level ? std::make_pair(level->price, level->size) : std::make_pair(-1, -1);
+        }
+        BestLevels best_levels() const { return BestLevels{level_top(asks.best()), level_top(bids.best())}; }
+        // listeners which do not hide on_level are not told about the levels, their changes are not tracked
+        template<typename Listener>
+        static constexpr bool ReportsLevels = !std::is_same_v<decltype(&Listener::on_level), decltype(&OrderbookListener::on_level)>;
+        // called by the public methods once their operation is done: notifies the listener of the levels it changed,
+        // publishes the depth and the top of book and notifies the sides whose best level changed since before
+        template<typename Listener>
+        void notify_changes(const BestLevels& before, Listener& listener);
+        void publish_top_of_book(const BestLevels& levels);
+
+        // exclusive lock on mtx unless the book is owned by a single thread
+        std::unique_lock<std::shared_mutex> write_lock()
+        {
+            if (!threadSafe)
+                return std::unique_lock<std::shared_mutex>();
+            std::unique_lock<std::shared_mutex> lock(mtx, std::try_to_lock);
+            if (!lock.owns_lock())
+                wait_lock(lock);
+            return lock;
+        }
+        // blocks until lock is acquired, counting the wait
+        void wait_lock(std::unique_lock<std::shared_mutex>& lock);
+
+        static constexpr bool CountStats = ORDERBOOK_STATS;
+        void count(std::uint64_t OrderbookCounters::*counter, std::uint64_t value = 1)
+        {
+            if constexpr (CountStats)
+                counters.*counter += value;
+        }
+
+        // operations of the public methods, called with the write lock held, their changes are reported by notify_changes
+        template<typename Listener>
+        bool add_locked(Orderside side, int clientId, int orderId, int price, int quantity, Listener& listener, TimeInForce timeInForce, int display = 0);
+        template<typename Listener>
+        bool cancel_locked(int clientId, int orderId, Listener& listener);
+        // removes node from its level and frees it, its index entry must already be erased
+        template<typename Listener>
+        void cancel_node(OrderNode* node, Listener& listener);
+        template<typename Listener>
+        bool modify_locked(int clientId, int orderId, int price, int quantity, Listener& listener);
+
+        // queues node at the back of the level of its price, creating the level if needed
+        // with a display below quantity the node becomes an iceberg order, returns the displayed quantity
+        template<typename Listener>
+        int queue_order(OrderNode* node, int quantity, int display, Listener& listener);
+        // removes node from its level, erasing the level once empty, the node stays indexed and allocated
+        // the reserve of an iceberg order is dropped, returns its display size or 0
+        template<typename Listener>
+        int unqueue_order(OrderNode* node, Listener& listener);
+
+        // updates the running sums and the depth cache of side and remembers level for the on_level events
+        template<typename Levels, typename Depth, typename Listener>
+        void level_changed(Orderside side, Levels& levels, Depth& depth, const Orders& level, Listener&)
+        {
+            levels.resized(level);
+            depth.update(level.price, level.size);
+            if constexpr (ReportsLevels<Listener>)
+                change_level(side, level.price, level.size);
+        }
+        // remembers the new size of a level for notify_changes, a level keeps the place of its first change
+        void change_level(Orderside side, int price, int size)
+        {
+            if(changedLevels.size() <= SmallChanges)
+            {
+                for(ChangedLevel& changed : changedLevels)
+                {
+                    if(changed.side == side && changed.price == price)
+                    {
+                        changed.size = size;
+                        return;
+                    }
+                }
+            }
+            changedLevels.push_back(ChangedLevel{side, price, size, std::uint32_t(changedLevels.size())});
+        }
+
+        OrderNode* new_node();
+        void delete_node(OrderNode* node);
+        // releases the stops reached by the prices traded since the last call and executes them in turn, the trades of
+        // a triggered order releasing the next ones, called by the public methods once their operation is done
+        template<typename Listener>
+        void trigger_stops(Listener& listener);
+        // moves the stops reached by the traded prices to triggered and forgets the prices
+        void release_stops();
         // call to match orders / should aquire write lock to mutex
         // returns if the order is fullfilled or not during match
-        bool match(Orderside side, int clientId, int orderId, int price, int& quantity, MatchFunctor& matchFunctor);
+        template<typename Listener>
+        bool match(Orderside side, int clientId, int orderId, int price, int& quantity, Listener& listener);
     };
 
-}
\ No newline at end of file
+}
+
+#include "orderbook_impl.hpp"
@@ -0,0 +1,462 @@
+#pragma once
+// template methods of orderbook::Orderbook, included by orderbook.hpp
+#include <algorithm>
+#include <mutex>
+#include <tuple>
+
+namespace orderbook {
+
+template<typename Listener>
+Orderbook::IfListener<Listener> Orderbook::add_order(Orderside side, int clientId, int orderId, int price, int quantity, Listener& listener, TimeInForce timeInForce)
+{
+    auto lk = write_lock();
+    const BestLevels before = best_levels();
+    const bool added = add_locked(side, clientId, orderId, price, quantity, listener, timeInForce);
+    trigger_stops(listener);
+    notify_changes(before, listener);
+    return added;
+}
+
+template<typename Listener>
+Orderbook::IfListener<Listener> Orderbook::add_iceberg_order(Orderside side, int clientId, int orderId, int price, int quantity, int display, Listener& listener)
+{
+    auto lk = write_lock();
+    const BestLevels before = best_levels();
+    const bool added = add_locked(side, clientId, orderId, price, quantity, listener, TimeInForce::gtc, display);
+    trigger_stops(listener);
+    notify_changes(before, listener);
+    return added;
+}
+
+template<typename Listener>
+Orderbook::IfListener<Listener> Orderbook::cancel_order(int clientId, int orderId, Listener& listener)
+{
+    auto lk = write_lock();
+    const BestLevels before = best_levels();
+    const bool cancelled = cancel_locked(clientId, orderId, listener);
+    notify_changes(before, listener);
+    return cancelled;
+}
+
+template<typename Listener>
+Orderbook::IfListener<Listener> Orderbook::cancel_order(OrderHandle order, Listener& listener)
+{
+    auto lk = write_lock();
+    count(&OrderbookCounters::cancels);
+    OrderNode* node = const_cast<OrderNode*>(order);
+    placedOrders.erase(make_key(node->clientId, node->orderId));
+    const BestLevels before = best_levels();
+    cancel_node(node, listener);
+    notify_changes(before, listener);
+    return true;
+}
+
+template<typename Listener>
+Orderbook::IfListener<Listener> Orderbook::modify_order(int clientId, int orderId, int price, int quantity, Listener& listener)
+{
+    auto lk = write_lock();
+    const BestLevels before = best_levels();
+    const bool modified = modify_locked(clientId, orderId, price, quantity, listener);
+    trigger_stops(listener);
+    notify_changes(before, listener);
+    return modified;
+}
+
+template<typename Listener>
+std::size_t Orderbook::apply_batch(const BookCommand* commands, std::size_t size, Listener& listener, bool* accepted)
+{
+    static_assert(std::is_base_of_v<OrderbookListener, Listener>, "listeners must derive from OrderbookListener");
+    auto lk = write_lock();
+    std::size_t acceptedCount = 0;
+    for(std::size_t index = 0; index < size; ++index)
+    {
+        const BookCommand& command = commands[index];
+        const BestLevels before = best_levels();
+        bool result = false;
+        switch(command.type)
+        {
+        case BookCommand::Type::add:
+            result = add_locked(command.side, command.clientId, command.orderId, command.price, command.quantity, listener, command.timeInForce, command.display);
+            break;
+        case BookCommand::Type::cancel:
+            result = cancel_locked(command.clientId, command.orderId, listener);
+            break;
+        case BookCommand::Type::modify:
+            result = modify_locked(command.clientId, command.orderId, command.price, command.quantity, listener);
+            break;
+        }
+        trigger_stops(listener);
+        notify_changes(before, listener);
+        acceptedCount += result;
+        if(accepted)
+            accepted[index] = result;
+    }
+    return acceptedCount;
+}
+
+template<typename Listener>
+bool Orderbook::modify_locked(int clientId, int orderId, int price, int quantity, Listener& listener)
+{
+    auto iteOrder = placedOrders.find(make_key(clientId, orderId));
+    if(iteOrder == placedOrders.end() || price <= 0 || quantity <= 0)
+        return false;
+    OrderNode* node = iteOrder->second;
+    Orders* level = node->level;
+    const Orderside side = node->side;
+    const int displayed = level->quantity(node);
+    // the quantity of an iceberg order includes its hidden rest
+    const auto reserve = node->iceberg ? reserves.find(iteOrder->first) : reserves.end();
+    const int hidden = node->iceberg ? reserve->second.hidden : 0;
+    if(price == node->price && quantity == displayed + hidden)
+        return true;
+
+    count(&OrderbookCounters::modifies);
+    if(price == node->price && quantity < displayed + hidden)
+    {
+        count(&OrderbookCounters::modifiesInPlace);
+        // the hidden quantity is taken off first
+        const int shown = std::min(displayed, quantity);
+        if(node->iceberg)
+        {
+            level->hidden -= hidden - (quantity - shown);
+            reserve->second.hidden = quantity - shown;
+            if(reserve->second.hidden == 0)
+            {
+                reserves.erase(reserve);
+                node->iceberg = false;
+            }
+        }
+        level->reduce_order(node, shown);
+        if(side == Orderside::sell)
+            level_changed(side, asks, askDepth, *level, listener);
+        else
+            level_changed(side, bids, bidDepth, *level, listener);
+        listener.on_modify(side, clientId, orderId, price, shown);
+        return true;
+    }
+
+    // the order loses its time priority and matches again at its new price, keeping its node and index entry
+    const int display = unqueue_order(node, listener);
+    listener.on_cancel(side, clientId, orderId, node->price, displayed);
+    node->price = price;
+    if(match(side, clientId, orderId, price, quantity, listener))
+    {
+        // matching only erases the entries of resting orders, iteOrder is still valid
+        placedOrders.erase(iteOrder);
+        delete_node(node);
+    }
+    else
+    {
+        const int shown = queue_order(node, quantity, display, listener);
+        listener.on_add(side, clientId, orderId, price, shown);
+    }
+    return true;
+}
+
+template<typename Listener>
+int Orderbook::queue_order(OrderNode* node, int quantity, int display, Listener& listener)
+{
+    int hidden = 0;
+    if(display > 0 && quantity > display)
+    {
+        hidden = quantity - display;
+        quantity = display;
+        reserves.emplace(make_key(node->clientId, node->orderId), Reserve{display, hidden});
+        node->iceberg = true;
+    }
+    // level is created in place if it does not exist yet
+    auto queue = [this, node, quantity, hidden, &listener](auto& container, auto& depth)
+    {
+        Orders& level = container.level(node->price);
+        if(level.empty())
+            count(&OrderbookCounters::levelsCreated);
+        level.hidden += hidden;
+        container.add_order(level, node, quantity);
+        level_changed(node->side, container, depth, level, listener);
+    };
+    if(node->side == Orderside::sell)
+        queue(asks, askDepth);
+    else
+        queue(bids, bidDepth);
+    return quantity;
+}
+
+template<typename Listener>
+int Orderbook::unqueue_order(OrderNode* node, Listener& listener)
+{
+    int display = 0;
+    if(node->iceberg)
+    {
+        const auto reserve = reserves.find(make_key(node->clientId, node->orderId));
+        display = reserve->second.display;
+        node->level->hidden -= reserve->second.hidden;
+        reserves.erase(reserve);
+        node->iceberg = false;
+    }
+    auto unqueue = [this, node, &listener](auto& container, auto& depth)
+    {
+        Orders* level = node->level;
+        level->remove_order(node);
+        level_changed(node->side, container, depth, *level, listener);
+        // only an emptied level costs a lookup in the price map
+        if(level->empty())
+            container.erase(level);
+    };
+    if(node->side == Orderside::sell)
+        unqueue(asks, askDepth);
+    else
+        unqueue(bids, bidDepth);
+    return display;
+}
+
+template<typename Listener>
+bool Orderbook::add_locked(Orderside side, int clientId, int orderId, int price, int quantity, Listener& listener, TimeInForce timeInForce, int display)
+{
+    if(side != Orderside::sell && side != Orderside::buy)
+        return false;
+
+    const auto orderKey = make_key(clientId, orderId);
+    count(&OrderbookCounters::adds);
+    if(placedOrders.count(orderKey) || (!stopOrders.empty() && stopOrders.count(orderKey)))
+    {
+        count(&OrderbookCounters::duplicates);
+        return false; // order already exists
+    }
+
+    // answered from the running sums of the levels, a killed order leaves the book untouched
+    if(timeInForce == TimeInForce::fok && !(side == Orderside::buy ? asks.available(price, quantity) : bids.available(price, quantity)))
+    {
+        count(&OrderbookCounters::killed);
+        listener.on_expired(side, clientId, orderId, quantity);
+        return false;
+    }
+
+    const int ordered = quantity;
+    if (match(side, clientId, orderId, price, quantity, listener)) // check if order matches any exisiting orders
+        return true;
+    if(timeInForce != TimeInForce::gtc)
+    {
+        count(&OrderbookCounters::expired);
+        listener.on_expired(side, clientId, orderId, quantity);
+        return quantity < ordered;
+    }
+    if(price == 0)
+        return false;
+
+    OrderNode* node = new_node();
+    node->clientId = clientId;
+    node->orderId = orderId;
+    node->price = price;
+    node->side = side;
+    const int shown = queue_order(node, quantity, display, listener);
+    placedOrders.emplace(orderKey, node);
+    count(&OrderbookCounters::ordersRested);
+    listener.on_add(side, clientId, orderId, price, shown);
+    listener.on_rested(clientId, orderId, node);
+    return true;
+}
+
+template<typename Listener>
+bool Orderbook::cancel_locked(int clientId, int orderId, Listener& listener)
+{
+    count(&OrderbookCounters::cancels);
+    auto iteOrder = placedOrders.find(make_key(clientId, orderId));
+    if(iteOrder == placedOrders.end())
+    {
+        // a stop order waiting for its trigger is not in the book
+        const auto iteStop = stopOrders.empty() ? stopOrders.end() : stopOrders.find(make_key(clientId, orderId));
+        if(iteStop == stopOrders.end())
+        {
+            count(&OrderbookCounters::cancelMisses);
+            return false;
+        }
+        const StopOrder stop = iteStop->second->second;
+        (stop.side == Orderside::buy ? buyStops : sellStops).erase(iteStop->second);
+        stopOrders.erase(iteStop);
+        listener.on_cancel(stop.side, clientId, orderId, stop.price, stop.quantity);
+        return true;
+    }
+
+    OrderNode* node = iteOrder->second;
+    placedOrders.erase(iteOrder);
+    cancel_node(node, listener);
+    return true;
+}
+
+template<typename Listener>
+void Orderbook::cancel_node(OrderNode* node, Listener& listener)
+{
+    const int remaining = node->level->quantity(node);
+    unqueue_order(node, listener);
+    listener.on_cancel(node->side, node->clientId, node->orderId, node->price, remaining);
+    delete_node(node);
+}
+
+template<typename Listener>
+void Orderbook::trigger_stops(Listener& listener)
+{
+    if(stopOrders.empty())
+    {
+        tradedLow = std::numeric_limits<int>::max();
+        tradedHigh = 0;
+        return;
+    }
+    // a cascade is a loop over the released stops: the trades of each one release the next ones behind it
+    release_stops();
+    for(std::size_t index = 0; index < triggered.size(); ++index)
+    {
+        const StopOrder stop = triggered[index];
+        count(&OrderbookCounters::stopsTriggered);
+        listener.on_triggered(stop.side, stop.clientId, stop.orderId, stop.price, stop.quantity);
+        add_locked(stop.side, stop.clientId, stop.orderId, stop.price, stop.quantity, listener, TimeInForce::gtc);
+        release_stops();
+    }
+    triggered.clear();
+}
+
+template<typename Listener>
+void Orderbook::notify_changes(const BestLevels& before, Listener& listener)
+{
+    if constexpr (ReportsLevels<Listener>)
+    {
+        if(changedLevels.size() > SmallChanges)
+        {
+            // the changes of a level are next to each other once sorted, its first one takes the size of its last one
+            std::sort(changedLevels.begin(), changedLevels.end(), [](const ChangedLevel& left, const ChangedLevel& right)
+                {
+                    return std::tie(left.side, left.price, left.sequence) < std::tie(right.side, right.price, right.sequence);
+                });
+            auto kept = changedLevels.begin();
+            for(auto changed = changedLevels.begin() + 1; changed != changedLevels.end(); ++changed)
+            {
+                if(changed->side == kept->side && changed->price == kept->price)
+                    kept->size = changed->size;
+                else
+                    *++kept = *changed;
+            }
+            changedLevels.erase(kept + 1, changedLevels.end());
+            std::sort(changedLevels.begin(), changedLevels.end(), [](const ChangedLevel& left, const ChangedLevel& right) { return left.sequence < right.sequence; });
+        }
+        for(const ChangedLevel& changed : changedLevels)
+            listener.on_level(changed.side, changed.price, changed.size);
+        changedLevels.clear();
+    }
+    askDepth.publish(asks);
+    bidDepth.publish(bids);
+    const BestLevels after = best_levels();
+    if(after.ask == before.ask && after.bid == before.bid)
+        return;
+    publish_top_of_book(after);
+    if(after.ask != before.ask)
+        listener.on_top_of_book(Orderside::sell, after.ask.first, after.ask.second);
+    if(after.bid != before.bid)
+        listener.on_top_of_book(Orderside::buy, after.bid.first, after.bid.second);
+}
+
+template<typename Listener>
+bool Orderbook::match(Orderside side, int clientId, int orderId, int price, int& quantity, Listener& listener)
+{
+    // returns best level on the opposite side if the current order price crosses it
+    auto crossing = [](const Orderside side, int price, auto& asks, auto& bids) -> Orders*
+    {
+        if (side == Orderside::buy) // <- will get min ask
+        {
+            Orders* level = asks.best();
+            return level && (level->price <= price || price == 0) ? level : nullptr;
+        }
+        else if (side == Orderside::sell) // <- will get max bid
+        {
+            Orders* level = bids.best();
+            return level && (level->price >= price || price == 0) ? level : nullptr;
+        }
+        return nullptr;
+    };
+
+    // consume the level of ask or bid depending on orderside
+    // orders are taken from the front of the level queue in time priority: the orders filled entirely are
+    // found from the quantities alone, then released one by one, and the next one is filled partially
+    auto consume = [this, side, &listener](auto& container, auto& depth, Orders& level, int clientId, int orderId, int& quantity)
+    {
+        const int book_price = level.price;
+        long long consumed = 0;
+        const std::uint32_t end = level.whole_orders(quantity, consumed);
+        std::uint32_t released = 0;
+        for(std::uint32_t slot = level.head; slot < end; ++slot)
+        {
+            OrderNode* current = level.nodes[slot];
+            if(current == nullptr)
+                continue; // cancelled
+            ++released;
+            listener.on_fill(side, current->clientId, current->orderId, clientId, orderId, book_price, level.quantities[slot]);
+            count(&OrderbookCounters::fills);
+            if(current->iceberg)
+            {
+                replenished.push_back(current);
+                continue;
+            }
+            placedOrders.erase(make_key(current->clientId, current->orderId));
+            listener.on_filled(current->side, current->clientId, current->orderId);
+            delete_node(current);
+        }
+        quantity -= int(consumed);
+        level.pop_front(end, released, int(consumed));
+        // the next slices of the filled iceberg orders go to the back of the queue, in the order of their fills,
+        // the match loop comes back to this level if quantity is left
+        for(OrderNode* current : replenished)
+        {
+            const auto reserve = reserves.find(make_key(current->clientId, current->orderId));
+            const int slice = std::min(reserve->second.display, reserve->second.hidden);
+            reserve->second.hidden -= slice;
+            level.hidden -= slice;
+            if(reserve->second.hidden == 0)
+            {
+                reserves.erase(reserve);
+                current->iceberg = false;
+            }
+            container.add_order(level, current, slice);
+            count(&OrderbookCounters::replenishments);
+            listener.on_replenish(current->side, current->clientId, current->orderId, book_price, slice);
+        }
+        replenished.clear();
+        // only when the sweep stopped before the end of the queue: replenished slices may be smaller than quantity
+        if(!level.empty() && quantity > 0 && quantity < level.quantities[level.head])
+        {
+            // the front order is larger than what is left
+            OrderNode* current = level.front();
+            listener.on_fill(side, current->clientId, current->orderId, clientId, orderId, book_price, quantity);
+            count(&OrderbookCounters::fills);
+            level.quantities[current->slot] -= quantity;
+            level.size -= quantity;
+            quantity = 0;
+        }
+        level_changed(side == Orderside::buy ? Orderside::sell : Orderside::buy, container, depth, level, listener);
+        if(level.empty())
+        {
+            count(&OrderbookCounters::levelsSwept);
+            container.erase(&level);
+        }
+    };
+
+    Orders* level = nullptr;
+    bool aggressive = false;
+    while (quantity > 0 && (level = crossing(side, price, asks, bids)))
+    {
+        aggressive = true;
+        // the level trades at least once, read by the stop orders
+        tradedLow = std::min(tradedLow, level->price);
+        tradedHigh = std::max(tradedHigh, level->price);
+        if (side == Orderside::buy)
+        {
+            consume(asks, askDepth, *level, clientId, orderId, quantity);
+        }
+        else
+        {
+            consume(bids, bidDepth, *level, clientId, orderId, quantity);
+        }
+    }
+    if (aggressive)
+        count(&OrderbookCounters::aggressiveOrders);
+    return quantity > 0 ? false : true;
+}
+
+}
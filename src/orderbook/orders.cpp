@@ -1,25 +1,113 @@
 #include "orders.hpp"
+#include "pool.hpp"
 #include <algorithm>
 using namespace orderbook;
 
-bool Orders::operator==(const Orders& other) const
+void Orders::add_order(OrderNode* node, int quantity, Arena& arena)
 {
-    return size == other.size && orderDetails == orderDetails;
+    if(tail == capacity)
+    {
+        // sliding the live orders down is enough while at most half of the queue is live
+        compact(arena, capacity && count <= capacity / 2 ? capacity : std::max(InitialCapacity, capacity * 2));
+    }
+    node->level = this;
+    node->slot = tail;
+    quantities[tail] = quantity;
+    nodes[tail] = node;
+    ++tail;
+    ++count;
+    size += quantity;
 }
 
-bool Orders::add_order(int clientId, int orderId, int quantity)
+void Orders::remove_order(OrderNode* node)
 {
-    orderDetails.push_back(OrderDetails {clientId, orderId, quantity});
-    size += quantity;
-    return true;
+    size -= quantities[node->slot];
+    quantities[node->slot] = 0;
+    nodes[node->slot] = nullptr;
+    --count;
+    if(node->slot == head)
+        skip_tombstones();
+    node->level = nullptr;
+}
+
+std::uint32_t Orders::whole_orders(long long remaining, long long& consumed) const
+{
+    std::uint32_t end = head;
+    long long total = 0;
+    // whole blocks first, their sums vectorize
+    constexpr std::uint32_t Block = 8;
+    while(end + Block <= tail)
+    {
+        long long block = 0;
+        for(std::uint32_t index = 0; index < Block; ++index)
+            block += quantities[end + index];
+        if(total + block > remaining)
+            break;
+        total += block;
+        end += Block;
+    }
+    while(end < tail && total + quantities[end] <= remaining)
+        total += quantities[end++];
+    consumed = total;
+    return end;
+}
+
+void Orders::pop_front(std::uint32_t end, std::uint32_t released, int consumed)
+{
+    count -= released;
+    size -= consumed;
+    head = end;
+    skip_tombstones();
 }
 
-bool Orders::remove_order(int clientId, int orderId)
+void Orders::release(Arena& arena)
 {
-    auto ite = std::find_if(orderDetails.begin(), orderDetails.end(), [clientId, orderId](const auto& detail) { return detail.clientId == clientId && detail.orderId == orderId; });
-    if(ite == orderDetails.end())
-        return false;
-    size -= ite->quantity;
-    orderDetails.erase(ite);
-    return true;
-}
\ No newline at end of file
+    if(capacity)
+    {
+        arena.deallocate_array(quantities, capacity);
+        arena.deallocate_array(nodes, capacity);
+    }
+    quantities = nullptr;
+    nodes = nullptr;
+    head = tail = capacity = count = 0;
+    size = hidden = 0;
+}
+
+void Orders::skip_tombstones()
+{
+    while(head < tail && nodes[head] == nullptr)
+        ++head;
+    if(head == tail)
+        head = tail = 0;
+}
+
+void Orders::compact(Arena& arena, std::uint32_t newCapacity)
+{
+    int* newQuantities = quantities;
+    OrderNode** newNodes = nodes;
+    if(newCapacity != capacity)
+    {
+        newQuantities = arena.allocate_array<int>(newCapacity);
+        newNodes = arena.allocate_array<OrderNode*>(newCapacity);
+    }
+    std::uint32_t live = 0;
+    for(std::uint32_t index = head; index < tail; ++index)
+    {
+        if(OrderNode* node = nodes[index])
+        {
+            newQuantities[live] = quantities[index];
+            newNodes[live] = node;
+            node->slot = live++;
+        }
+    }
+    if(newCapacity != capacity && capacity)
+    {
+        arena.deallocate_array(quantities, capacity);
+        arena.deallocate_array(nodes, capacity);
+    }
+    quantities = newQuantities;
+    nodes = newNodes;
+    capacity = newCapacity;
+    head = 0;
+    tail = live;
+}
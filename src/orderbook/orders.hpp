@@ -1,37 +1,81 @@
 #pragma once
 #include "orderside.hpp"
 #include <cstddef>
-#include <vector>
+#include <cstdint>
 namespace orderbook {
+    class Arena;
+    struct Orders;
+
+    /**
+     * @brief A resting order in the orderbook
+     * The remaining quantity is kept by the level, in the slot of the order
+     */
+    struct OrderNode
+    {
+        int clientId;
+        int orderId;
+        int price;
+        Orderside side;
+        bool iceberg = false; // the display size and hidden rest of the order are in Orderbook::reserves
+        std::uint32_t slot = 0; // position in the queue of the level
+        Orders* level = nullptr; // price level the node is queued in
+    };
+
     /**
      * @brief Structure that maintain order details in order book
      * size variable will be updated as we add and remove orders
+     * Orders are queued in time priority in two parallel arrays: the remaining quantities, contiguous so that
+     * a sweep sums them without touching the orders, and the nodes, read only for the orders it fills.
+     * A cancelled order leaves a tombstone, a null node with quantity 0, the live slots are compacted when
+     * the queue runs out of room at its back.
      */
     struct Orders
     {
-        int size = 0; // size will change as the orders are matched
+        static constexpr std::uint32_t InitialCapacity = 8;
 
-        struct OrderDetails
-        {
-            int clientId;
-            int orderId;
-            int quantity;
-            bool operator==(const OrderDetails& other) const
-            {
-                return clientId == other.clientId && orderId == other.orderId;
-            }
-        };
+        int size = 0; // size will change as the orders are matched
+        int price = 0;
+        std::uint32_t head = 0; // first live slot, oldest order / first to be matched
+        std::uint32_t tail = 0; // after the newest order
+        std::uint32_t capacity = 0;
+        std::uint32_t count = 0; // live orders
+        int hidden = 0; // reserve of the iceberg orders of the level, not part of size
+        int* quantities = nullptr;
+        OrderNode** nodes = nullptr;
 
-        std::vector<OrderDetails> orderDetails;
         // constructor
-        // creates a valid order
+        // creates an empty price level
         Orders() = default;
-        Orders(Orders&&) = default;
+        Orders(Orders&&) = delete; // nodes point back to their level
         Orders(const Orders&) = delete;
-        bool operator==(const Orders& other) const;
         Orders& operator=(const Orders& other) = delete;
 
-        bool add_order(int clientId, int orderId, int size);
-        bool remove_order(int clientId, int orderId);
+        bool empty() const { return count == 0; }
+        OrderNode* front() const { return nodes[head]; }
+        int quantity(const OrderNode* node) const { return quantities[node->slot]; }
+        // displayed and hidden quantity
+        long long total() const { return (long long)size + hidden; }
+
+        // append order at the back of the queue, arrays are taken from arena
+        void add_order(OrderNode* node, int quantity, Arena& arena);
+        // remove order from anywhere in the queue
+        void remove_order(OrderNode* node);
+        // lowers the remaining quantity of node to quantity, keeping its place in the queue
+        void reduce_order(OrderNode* node, int quantity)
+        {
+            size -= quantities[node->slot] - quantity;
+            quantities[node->slot] = quantity;
+        }
+        // end of the orders at the front of the queue whose total quantity is at most remaining, sets their total to consumed
+        std::uint32_t whole_orders(long long remaining, long long& consumed) const;
+        // removes the slots before end, holding released orders of total quantity consumed which must have been freed
+        void pop_front(std::uint32_t end, std::uint32_t released, int consumed);
+        // frees the arrays, the level can be reused afterwards
+        void release(Arena& arena);
+
+    private:
+        void skip_tombstones();
+        // moves the live slots to the front of the arrays, into new arrays of newCapacity if given
+        void compact(Arena& arena, std::uint32_t newCapacity);
     };
-}
\ No newline at end of file
+}
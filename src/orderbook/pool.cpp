@@ -0,0 +1,20 @@
+#include "pool.hpp"
+#include <algorithm>
+using namespace orderbook;
+
+void Arena::grow(std::size_t sizeClass)
+{
+    const std::size_t blockSize = MinBlockSize << sizeClass;
+    // grow geometrically so that slabs stay few compared to blocks
+    const std::size_t count = std::max(blockCounts[sizeClass], std::max<std::size_t>(4096 / blockSize, 1));
+    std::unique_ptr<std::byte[]> slab(new std::byte[blockSize * count]);
+    for(std::size_t index = count; index > 0; --index)
+    {
+        auto block = reinterpret_cast<FreeBlock*>(slab.get() + (index - 1) * blockSize);
+        block->next = freeLists[sizeClass];
+        freeLists[sizeClass] = block;
+    }
+    blockCounts[sizeClass] += count;
+    reservedBytes += blockSize * count;
+    slabs.push_back(std::move(slab));
+}
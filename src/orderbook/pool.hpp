@@ -0,0 +1,122 @@
+#pragma once
+#include <array>
+#include <cstddef>
+#include <memory>
+#include <new>
+#include <vector>
+
+namespace orderbook {
+    /**
+     * @brief Slab allocator with free lists of power of two block sizes
+     * Blocks are carved from slabs which are only released when the arena is destroyed,
+     * freed blocks go back to their free list and are reused by the next allocation.
+     * Not thread safe, every Orderbook owns one and uses it under its own lock.
+     */
+    class Arena
+    {
+    public:
+        static constexpr std::size_t MinBlockSize = 16;
+        static constexpr std::size_t MaxBlockSize = std::size_t(1) << 16;
+
+        Arena() = default;
+        Arena(const Arena&) = delete;
+        Arena& operator=(const Arena&) = delete;
+
+        void* allocate(std::size_t bytes)
+        {
+            const std::size_t sizeClass = size_class(bytes);
+            FreeBlock* block = freeLists[sizeClass];
+            if(block == nullptr)
+            {
+                grow(sizeClass);
+                block = freeLists[sizeClass];
+            }
+            freeLists[sizeClass] = block->next;
+            return block;
+        }
+        void deallocate(void* pointer, std::size_t bytes)
+        {
+            const std::size_t sizeClass = size_class(bytes);
+            FreeBlock* block = static_cast<FreeBlock*>(pointer);
+            block->next = freeLists[sizeClass];
+            freeLists[sizeClass] = block;
+        }
+        // arrays of count T, blocks larger than MaxBlockSize come from the global allocator
+        template<typename T>
+        T* allocate_array(std::size_t count)
+        {
+            const std::size_t bytes = count * sizeof(T);
+            return static_cast<T*>(can_allocate(bytes) ? allocate(bytes) : ::operator new(bytes));
+        }
+        template<typename T>
+        void deallocate_array(T* pointer, std::size_t count)
+        {
+            const std::size_t bytes = count * sizeof(T);
+            if(can_allocate(bytes))
+                deallocate(pointer, bytes);
+            else
+                ::operator delete(pointer);
+        }
+        // bytes taken from the global allocator
+        std::size_t bytes_reserved() const { return reservedBytes; }
+
+        static bool can_allocate(std::size_t bytes) { return bytes <= MaxBlockSize; }
+
+    private:
+        struct FreeBlock
+        {
+            FreeBlock* next;
+        };
+        static constexpr std::size_t SizeClasses = 13; // 16 bytes .. 64 kilobytes
+
+        static std::size_t size_class(std::size_t bytes)
+        {
+            std::size_t sizeClass = 0;
+            while((MinBlockSize << sizeClass) < bytes)
+                ++sizeClass;
+            return sizeClass;
+        }
+        // adds a slab of blocks to the free list of sizeClass
+        void grow(std::size_t sizeClass);
+
+        std::array<FreeBlock*, SizeClasses> freeLists{};
+        std::array<std::size_t, SizeClasses> blockCounts{};
+        std::vector<std::unique_ptr<std::byte[]>> slabs;
+        std::size_t reservedBytes = 0;
+    };
+
+    /**
+     * @brief Standard allocator which takes single objects from an Arena
+     * Arrays (like hash buckets) and oversized requests fall back to the global allocator
+     */
+    template<typename T>
+    struct PoolAllocator
+    {
+        using value_type = T;
+
+        Arena* arena;
+
+        explicit PoolAllocator(Arena& arena) noexcept : arena(&arena) {}
+        template<typename U>
+        PoolAllocator(const PoolAllocator<U>& other) noexcept : arena(other.arena) {}
+
+        T* allocate(std::size_t n)
+        {
+            if(n == 1 && Arena::can_allocate(sizeof(T)))
+                return static_cast<T*>(arena->allocate(sizeof(T)));
+            return static_cast<T*>(::operator new(n * sizeof(T)));
+        }
+        void deallocate(T* pointer, std::size_t n) noexcept
+        {
+            if(n == 1 && Arena::can_allocate(sizeof(T)))
+                arena->deallocate(pointer, sizeof(T));
+            else
+                ::operator delete(pointer);
+        }
+
+        template<typename U>
+        bool operator==(const PoolAllocator<U>& other) const { return arena == other.arena; }
+        template<typename U>
+        bool operator!=(const PoolAllocator<U>& other) const { return arena != other.arena; }
+    };
+}
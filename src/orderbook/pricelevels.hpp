@@ -0,0 +1,438 @@
+#pragma once
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <memory>
+#include <unordered_map>
+#include <vector>
+
+#include "orders.hpp"
+#include "pool.hpp"
+
+namespace orderbook {
+    // storage used for the price levels of an orderbook
+    enum class LevelsBackend : short {
+        tree,   // red black tree of levels
+        ladder  // tick indexed array of levels around the traded prices, tree for the outliers
+    };
+
+    // aggregated size of the orders resting at a price
+    struct DepthLevel
+    {
+        int price = 0;
+        int quantity = 0;
+    };
+
+    /**
+     * @brief Price levels of one side of the orderbook, ordered from best to worst price by Compare
+     * With the ladder backend levels inside a window of ticks are stored in a contiguous array, found
+     * through a two level occupancy bitmap. The window is recentered when it is empty and a price falls
+     * outside of it, taking over the tree levels it then covers, otherwise such prices fall back to the tree.
+     * Once the quantity available up to a price is asked for, the sizes of the ladder levels are also summed in a
+     * Fenwick tree which answers it in O(log(ticks)) without walking the levels. The tree levels are summed in a sparse
+     * Fenwick tree over the whole price range, whose non zero nodes are kept in a hash map, O(32) per query or change.
+     */
+    template<typename Compare>
+    class PriceLevels
+    {
+        using Tree = std::map<int, Orders, Compare, PoolAllocator<std::pair<const int, Orders>>>;
+        template<typename Key>
+        using SumIndex = std::unordered_map<Key, long long, std::hash<Key>, std::equal_to<Key>, PoolAllocator<std::pair<const Key, long long>>>;
+        static constexpr bool Ascending = Compare()(0, 1);
+        static constexpr std::uint64_t TreeNodes = std::uint64_t(1) << 32; // a Fenwick node per price
+
+        Arena& arena; // also holds the queues of the levels
+        Tree tree;
+        std::unique_ptr<Orders[]> ladder;
+        std::vector<std::uint64_t> occupied; // bit per tick
+        std::vector<std::uint64_t> summary; // bit per non zero word of occupied
+        std::vector<long long> sums; // Fenwick tree of the sizes of the ladder levels, sums[i] covers ticks (i - lowbit(i), i]
+        std::vector<long long> sizes; // displayed and hidden quantity of every tick as last added to sums, both empty until available is called
+        SumIndex<std::uint64_t> treeSums; // non zero nodes of the Fenwick tree of the tree levels, by price_node
+        SumIndex<int> treeSizes; // total of every non empty tree level as last added to treeSums
+        bool summed = false; // sums are kept up to date since the first call to available
+        int base = 0; // price of ladder[0]
+        int ticks = 0;
+        std::size_t ladderLevels = 0;
+
+    public:
+        PriceLevels(Arena& arena, LevelsBackend backend, int ladderTicks)
+            : arena(arena), tree(PoolAllocator<int>(arena)), treeSums(0, std::hash<std::uint64_t>(), std::equal_to<std::uint64_t>(), PoolAllocator<int>(arena)),
+              treeSizes(0, std::hash<int>(), std::equal_to<int>(), PoolAllocator<int>(arena))
+        {
+            if(backend == LevelsBackend::ladder && ladderTicks > 0)
+            {
+                ticks = (ladderTicks + 63) / 64 * 64;
+                ladder.reset(new Orders[ticks]);
+                occupied.assign(ticks / 64, 0);
+                summary.assign((occupied.size() + 63) / 64, 0);
+            }
+        }
+
+        bool empty() const { return ladderLevels == 0 && tree.empty(); }
+        std::size_t size() const { return ladderLevels + tree.size(); }
+
+        // best level or nullptr when the side is empty
+        Orders* best()
+        {
+            Orders* fromLadder = ladderLevels ? &ladder[best_index()] : nullptr;
+            if(tree.empty())
+                return fromLadder;
+            Orders* fromTree = &tree.begin()->second;
+            if(fromLadder == nullptr || Compare()(fromTree->price, fromLadder->price))
+                return fromTree;
+            return fromLadder;
+        }
+        const Orders* best() const { return const_cast<PriceLevels*>(this)->best(); }
+
+        // returns level for price, creating an empty one if needed
+        Orders& level(int price)
+        {
+            if(!in_window(price) && ladderLevels == 0 && ticks > 0)
+                recenter(price);
+            if(in_window(price))
+            {
+                const int index = price - base;
+                Orders& found = ladder[index];
+                if(!is_occupied(index))
+                {
+                    // queue arrays were released when the level was erased
+                    set_occupied(index);
+                    found.price = price;
+                    ++ladderLevels;
+                }
+                return found;
+            }
+            auto [ite, created] = tree.try_emplace(price);
+            if(created)
+                ite->second.price = price;
+            return ite->second;
+        }
+
+        // remove level which has no orders left
+        void erase(Orders* level)
+        {
+            level->release(arena);
+            if(ticks > 0 && level >= ladder.get() && level < ladder.get() + ticks)
+            {
+                clear_occupied(int(level - ladder.get()));
+                --ladderLevels;
+            }
+            else
+            {
+                tree.erase(level->price);
+            }
+        }
+
+        // keeps the running sums up to date, called after the size of level changed, before it is erased
+        void resized(const Orders& level)
+        {
+            if(!summed)
+                return;
+            if(&level < ladder.get() || &level >= ladder.get() + ticks)
+            {
+                tree_resized(level.price, level.total());
+                return;
+            }
+            const int index = int(&level - ladder.get());
+            const long long delta = level.total() - sizes[index];
+            sizes[index] = level.total();
+            for(std::size_t node = std::size_t(index) + 1; node < sums.size(); node += node & (0 - node))
+                sums[node] += delta;
+        }
+
+        // returns true if at least quantity rests at price or better, at any price when price is 0, hidden quantity included
+        // ladder levels are summed in O(log(ticks)) and tree levels in O(32)
+        bool available(int price, long long quantity)
+        {
+            if(quantity <= 0)
+                return true;
+            if(!summed)
+                build_sums();
+            long long total = 0;
+            if(ladderLevels)
+            {
+                // ticks at price or better, [0, end) for asks and [begin, ticks) for bids
+                const int limit = price == 0 ? (Ascending ? ticks - 1 : 0) : price - base;
+                if constexpr (Ascending)
+                    total += prefix_sum(std::min(limit + 1, ticks));
+                else
+                    total += prefix_sum(ticks) - prefix_sum(std::max(limit, 0));
+                if(total >= quantity)
+                    return true;
+            }
+            if(!tree.empty())
+            {
+                // the nodes up to the one of price cover the prices at price or better
+                const std::uint64_t end = price == 0 ? TreeNodes : price_node(price);
+                for(std::uint64_t node = end; node > 0; node &= node - 1)
+                {
+                    const auto sum = treeSums.find(node);
+                    if(sum != treeSums.end())
+                        total += sum->second;
+                }
+            }
+            return total >= quantity;
+        }
+
+        // appends order to the queue of its level
+        void add_order(Orders& level, OrderNode* node, int quantity) { level.add_order(node, quantity, arena); }
+
+        void clear()
+        {
+            for(auto& [price, level] : tree)
+                level.release(arena);
+            for(std::size_t word = 0; word < occupied.size(); ++word)
+            {
+                for(std::uint64_t bits = occupied[word]; bits; bits &= bits - 1)
+                    ladder[word * 64 + __builtin_ctzll(bits)].release(arena);
+            }
+            tree.clear();
+            std::fill(occupied.begin(), occupied.end(), 0);
+            std::fill(summary.begin(), summary.end(), 0);
+            std::fill(sums.begin(), sums.end(), 0);
+            std::fill(sizes.begin(), sizes.end(), 0);
+            treeSums.clear();
+            treeSizes.clear();
+            ladderLevels = 0;
+        }
+
+        // calls visit(const Orders&) for every level from the best to the worst price until it returns false
+        template<typename Visit>
+        void for_each_level(Visit visit) const
+        {
+            // the ladder and the tree are both walked from their best level and merged
+            auto treeIte = tree.begin();
+            int index = ladderLevels ? best_index() : -1;
+            while(true)
+            {
+                const Orders* fromLadder = index >= 0 ? &ladder[index] : nullptr;
+                const Orders* fromTree = treeIte != tree.end() ? &treeIte->second : nullptr;
+                const Orders* level = nullptr;
+                if(fromTree && (fromLadder == nullptr || Compare()(fromTree->price, fromLadder->price)))
+                {
+                    level = fromTree;
+                    ++treeIte;
+                }
+                else if(fromLadder)
+                {
+                    level = fromLadder;
+                    index = next_index(index);
+                }
+                else
+                {
+                    return;
+                }
+                if(!visit(*level))
+                    return;
+            }
+        }
+
+        // copies the (price, size) of up to count best levels to out, returns how many were copied
+        std::size_t best_levels(DepthLevel* out, std::size_t count) const
+        {
+            std::size_t copied = 0;
+            if(count > 0)
+            {
+                for_each_level([out, count, &copied](const Orders& level)
+                    {
+                        out[copied++] = DepthLevel{level.price, level.size};
+                        return copied < count;
+                    });
+            }
+            return copied;
+        }
+
+        // creates empty tree levels on unused prices so that their nodes can be reserved in the arena
+        std::vector<int> hold_tree_levels(std::size_t count)
+        {
+            std::vector<int> prices;
+            prices.reserve(count);
+            for(int price = 1; prices.size() < count; ++price)
+            {
+                if(!in_window(price) && tree.try_emplace(price).second)
+                    prices.push_back(price);
+            }
+            return prices;
+        }
+        void release_tree_levels(const std::vector<int>& prices)
+        {
+            for(int price : prices)
+                tree.erase(price);
+        }
+
+    private:
+        // centers the empty window on price, the tree levels inside of it move to the ladder so that a price keeps a
+        // single level and its queue
+        void recenter(int price)
+        {
+            base = price - ticks / 2;
+            auto ite = tree.lower_bound(Ascending ? base : base + ticks - 1);
+            while(ite != tree.end() && in_window(ite->first))
+            {
+                const int index = ite->first - base;
+                if(summed)
+                    tree_resized(ite->first, 0);
+                move_level(ite->second, ladder[index]);
+                set_occupied(index);
+                ++ladderLevels;
+                resized(ladder[index]);
+                ite = tree.erase(ite);
+            }
+        }
+
+        // hands the queue of from over to the empty level to, its orders point back to it
+        static void move_level(Orders& from, Orders& to)
+        {
+            to.size = from.size;
+            to.price = from.price;
+            to.head = from.head;
+            to.tail = from.tail;
+            to.capacity = from.capacity;
+            to.count = from.count;
+            to.hidden = from.hidden;
+            to.quantities = from.quantities;
+            to.nodes = from.nodes;
+            for(std::uint32_t slot = to.head; slot < to.tail; ++slot)
+            {
+                if(to.nodes[slot])
+                    to.nodes[slot]->level = &to;
+            }
+            from.quantities = nullptr;
+            from.nodes = nullptr;
+            from.capacity = 0;
+        }
+
+        // sums the sizes of the levels, kept up to date by resized from then on
+        void build_sums()
+        {
+            summed = true;
+            for(const auto& [price, level] : tree)
+                tree_resized(price, level.total());
+            if(ticks == 0)
+                return;
+            sums.assign(ticks + 1, 0);
+            sizes.assign(ticks, 0);
+            for(int index = 0; index < ticks; ++index)
+            {
+                sizes[index] = is_occupied(index) ? ladder[index].total() : 0;
+                sums[index + 1] += sizes[index];
+                // a node adds its total to its parent, building the tree in O(ticks)
+                const std::size_t parent = std::size_t(index + 1) + ((index + 1) & -(index + 1));
+                if(parent < sums.size())
+                    sums[parent] += sums[index + 1];
+            }
+        }
+
+        // total size of the ticks before end
+        long long prefix_sum(int end) const
+        {
+            long long total = 0;
+            for(std::size_t node = std::size_t(std::clamp(end, 0, ticks)); node > 0; node &= node - 1)
+                total += sums[node];
+            return total;
+        }
+
+        // Fenwick node of price in [1, TreeNodes], in the order of the levels
+        static std::uint64_t price_node(int price)
+        {
+            const std::uint32_t ascending = std::uint32_t(price) ^ 0x80000000u;
+            return std::uint64_t(Ascending ? ascending : ~ascending) + 1;
+        }
+
+        // sets the total of the tree level at price in treeSums
+        void tree_resized(int price, long long total)
+        {
+            long long delta = total;
+            const auto size = treeSizes.find(price);
+            if(size != treeSizes.end())
+            {
+                delta -= size->second;
+                if(total == 0)
+                    treeSizes.erase(size);
+                else
+                    size->second = total;
+            }
+            else if(total != 0)
+            {
+                treeSizes.emplace(price, total);
+            }
+            if(delta == 0)
+                return;
+            for(std::uint64_t node = price_node(price); node <= TreeNodes; node += node & (0 - node))
+            {
+                const auto sum = treeSums.try_emplace(node, 0).first;
+                sum->second += delta;
+                if(sum->second == 0)
+                    treeSums.erase(sum);
+            }
+        }
+
+        bool in_window(int price) const { return price >= base && price - base < ticks; }
+
+        bool is_occupied(int index) const { return (occupied[index / 64] >> (index % 64)) & 1; }
+        void set_occupied(int index)
+        {
+            occupied[index / 64] |= std::uint64_t(1) << (index % 64);
+            summary[index / 4096] |= std::uint64_t(1) << ((index / 64) % 64);
+        }
+        void clear_occupied(int index)
+        {
+            occupied[index / 64] &= ~(std::uint64_t(1) << (index % 64));
+            if(occupied[index / 64] == 0)
+                summary[index / 4096] &= ~(std::uint64_t(1) << ((index / 64) % 64));
+        }
+
+        // index of the lowest (asks) or highest (bids) occupied tick, ladder must not be empty
+        int best_index() const
+        {
+            if constexpr (Ascending)
+            {
+                std::size_t group = 0;
+                while(summary[group] == 0)
+                    ++group;
+                const std::size_t word = group * 64 + __builtin_ctzll(summary[group]);
+                return int(word * 64 + __builtin_ctzll(occupied[word]));
+            }
+            else
+            {
+                std::size_t group = summary.size() - 1;
+                while(summary[group] == 0)
+                    --group;
+                const std::size_t word = group * 64 + 63 - __builtin_clzll(summary[group]);
+                return int(word * 64 + 63 - __builtin_clzll(occupied[word]));
+            }
+        }
+
+        // next occupied tick after index in the order of the levels, -1 if there is none
+        int next_index(int index) const
+        {
+            std::size_t word = std::size_t(index) / 64;
+            const int bit = index % 64;
+            if constexpr (Ascending)
+            {
+                std::uint64_t bits = bit == 63 ? 0 : occupied[word] & (~std::uint64_t(0) << (bit + 1));
+                while(bits == 0)
+                {
+                    if(++word == occupied.size())
+                        return -1;
+                    bits = occupied[word];
+                }
+                return int(word * 64 + __builtin_ctzll(bits));
+            }
+            else
+            {
+                std::uint64_t bits = occupied[word] & ((std::uint64_t(1) << bit) - 1);
+                while(bits == 0)
+                {
+                    if(word-- == 0)
+                        return -1;
+                    bits = occupied[word];
+                }
+                return int(word * 64 + 63 - __builtin_clzll(bits));
+            }
+        }
+    };
+}
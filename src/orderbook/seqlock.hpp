@@ -0,0 +1,59 @@
+#pragma once
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <type_traits>
+
+namespace orderbook {
+    /**
+     * @brief Value published by a single writer and read by any number of readers without locking
+     * The value is stored in relaxed atomic words guarded by a sequence counter, which is odd while a
+     * write is in progress. Readers retry until they copied the words between two equal even sequences.
+     */
+    template<typename T>
+    class SeqLock
+    {
+        static_assert(std::is_trivially_copyable_v<T>, "SeqLock needs a trivially copyable value");
+        static constexpr std::size_t Words = (sizeof(T) + sizeof(std::uint64_t) - 1) / sizeof(std::uint64_t);
+
+        alignas(64) std::atomic<std::uint64_t> sequence{0};
+        std::atomic<std::uint64_t> words[Words] = {};
+
+    public:
+        explicit SeqLock(const T& value = T()) { store(value); }
+
+        // only one thread may store at a time
+        void store(const T& value)
+        {
+            std::uint64_t buffer[Words] = {};
+            std::memcpy(buffer, &value, sizeof(T));
+            const std::uint64_t current = sequence.load(std::memory_order_relaxed);
+            sequence.store(current + 1, std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_release);
+            for(std::size_t word = 0; word < Words; ++word)
+                words[word].store(buffer[word], std::memory_order_relaxed);
+            sequence.store(current + 2, std::memory_order_release);
+        }
+
+        // returns a value stored as a whole, never blocks the writer
+        T load() const
+        {
+            std::uint64_t buffer[Words];
+            std::uint64_t before, after;
+            do
+            {
+                before = sequence.load(std::memory_order_acquire);
+                for(std::size_t word = 0; word < Words; ++word)
+                    buffer[word] = words[word].load(std::memory_order_relaxed);
+                std::atomic_thread_fence(std::memory_order_acquire);
+                after = sequence.load(std::memory_order_relaxed);
+            } while(before != after || (before & 1));
+            T value;
+            std::memcpy(&value, buffer, sizeof(T));
+            return value;
+        }
+
+        // number of stores since construction
+        std::uint64_t version() const { return sequence.load(std::memory_order_acquire) / 2 - 1; }
+    };
+}
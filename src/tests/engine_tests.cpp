@@ -0,0 +1,972 @@
+#include "engine/commands.hpp"
+#include "engine/journal.hpp"
+#include "engine/output.hpp"
+#include "engine/parser.hpp"
+#include "engine/pipeline.hpp"
+#include "engine/replay.hpp"
+#include "engine/sharded_engine.hpp"
+#include "engine/snapshot.hpp"
+#include "test_utils.hpp"
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <dirent.h>
+#include <fcntl.h>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <random>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <unistd.h>
+
+using namespace engine;
+
+// random replay over a few symbols with cancels, comments and flushes
+static std::string generate_input(unsigned seed, int lines)
+{
+    std::mt19937 gen{seed};
+    std::normal_distribution<> priceDistribution(100, 5);
+    std::uniform_int_distribution<int> quantityDistribution(1, 200);
+    const char* symbols[] = {"IBM", "AAPL", "MSFT", "VAL", "GOOG", "TSLA"};
+    std::vector<std::pair<int, int>> live;
+    std::stringstream ss;
+    int orderId = 0;
+    for(int line = 0; line < lines; ++line)
+    {
+        const int kind = gen() % 1000;
+        if(kind < 3)
+        {
+            ss << "F\n";
+            live.clear();
+        }
+        else if(kind < 10)
+        {
+            ss << "#name: scenario " << line << "\n";
+        }
+        else if(kind < 400 && !live.empty())
+        {
+            const size_t index = gen() % live.size();
+            ss << "C, " << live[index].first << ", " << live[index].second << "\n";
+            live[index] = live.back();
+            live.pop_back();
+        }
+        else
+        {
+            const int userId = 1 + gen() % 5;
+            const int price = gen() % 50 == 0 ? 0 : std::max(1, int(std::round(priceDistribution(gen))));
+            ss << "N, " << userId << ", " << symbols[gen() % 6] << ", " << price << ", " << quantityDistribution(gen) << ", " << (gen() % 2 ? 'B' : 'S') << ", " << ++orderId << "\n";
+            live.emplace_back(userId, orderId);
+        }
+    }
+    return ss.str();
+}
+
+static std::vector<Command> parse(const std::string& input, SymbolTable& symbols)
+{
+    return parse_commands(input.data(), input.data() + input.size(), symbols);
+}
+
+static std::vector<Command> parse(const std::string& input)
+{
+    SymbolTable symbols;
+    return parse(input, symbols);
+}
+
+static std::string run_serial(const std::string& input, bool binary = false)
+{
+    std::unique_ptr<OutputSink> out;
+    if(binary)
+        out.reset(new BinarySink);
+    else
+        out.reset(new TextSink);
+    SymbolTable symbols;
+    OrderbookManager orderbooks;
+    orderbooks.symbols = &symbols;
+    for(const Command& command : parse(input, symbols))
+        execute(command, orderbooks, *out);
+    return std::string(out->buffered());
+}
+
+int engine_test_parser()
+{
+    const std::string longComment = "#" + std::string(100, 'x');
+    const std::string input =
+        "N, 1, IBM, 10, 100, B, 1\n"
+        "N,2,VERYLONGSYMBOLNAME.EXCHANGE,11,50,S,102\n"
+        "\n"
+        "C, 1, 1\n"
+        "#name: scenario 1\n" +
+        longComment + "\n"
+        "N, 1, IBM, bad, 100, B, 1\n"
+        "X, unknown command\n"
+        "F\n"
+        "N, -3, IBM, 0, 7, S, 4";
+    SymbolTable symbols;
+    const auto commands = parse(input, symbols);
+    const size_t commentRecords = (longComment.size() + Command::TextCapacity - 1) / Command::TextCapacity;
+    assert_equal(commands.size(), 6 + commentRecords);
+
+    // symbols are interned in order of appearance
+    assert_equal(symbols.size(), size_t(2));
+    assert_equal(symbols.name(0), std::string("IBM"));
+    assert_equal(symbols.name(1), std::string("VERYLONGSYMBOLNAME.EXCHANGE"));
+
+    assert_equal(int(commands[0].type), int(CommandType::newOrder));
+    assert_equal(commands[0].order.userId, 1);
+    assert_equal(commands[0].order.symbol, SymbolId(0));
+    assert_equal(commands[0].order.price, 10);
+    assert_equal(commands[0].order.quantity, 100);
+    assert_equal(commands[0].side, Orderside::buy);
+    assert_equal(commands[0].order.orderId, 1);
+
+    assert_equal(commands[1].order.symbol, SymbolId(1));
+    assert_equal(commands[1].side, Orderside::sell);
+    assert_equal(commands[1].order.orderId, 102);
+
+    assert_equal(int(commands[2].type), int(CommandType::cancel));
+    assert_equal(commands[2].order.userId, 1);
+    assert_equal(commands[2].order.orderId, 1);
+
+    assert_equal(int(commands[3].type), int(CommandType::print));
+    assert_equal(commands[3].line(), std::string_view("#name: scenario 1"));
+
+    // long comments are split over several records
+    std::string comment;
+    size_t index = 4;
+    for(; commands[index].type == CommandType::text; ++index)
+        comment += commands[index].line();
+    assert_equal(int(commands[index].type), int(CommandType::print));
+    comment += commands[index].line();
+    assert_equal(comment, longComment);
+    assert_equal(index, 3 + commentRecords);
+
+    // malformed lines are skipped
+    assert_equal(int(commands[index + 1].type), int(CommandType::flush));
+    assert_equal(int(commands[index + 2].type), int(CommandType::newOrder));
+    assert_equal(commands[index + 2].order.userId, -3);
+    assert_equal(commands[index + 2].order.symbol, SymbolId(0));
+    assert_equal(commands[index + 2].order.price, 0);
+    return 0;
+}
+
+int engine_test_symbols()
+{
+    SymbolTable symbols;
+    assert_equal(symbols.find("IBM"), SymbolTable::None);
+    const int count = 10000;
+    for(int index = 0; index < count; ++index)
+        assert_equal(symbols.intern("SYM" + std::to_string(index)), SymbolId(index));
+    assert_equal(symbols.size(), size_t(count));
+    for(int index = count; index > 0; --index)
+    {
+        const std::string name = "SYM" + std::to_string(index - 1);
+        assert_equal(symbols.intern(name), SymbolId(index - 1));
+        assert_equal(symbols.find(name), SymbolId(index - 1));
+        assert_equal(symbols.name(SymbolId(index - 1)), name);
+    }
+    assert_equal(symbols.size(), size_t(count));
+    assert_equal(symbols.find("SYM"), SymbolTable::None);
+    assert_equal(symbols.intern(""), SymbolId(count));
+
+    // books are created on first use with the config of their symbol id
+    OrderbookManager orderbooks;
+    orderbooks.symbolConfigs[symbols.intern("LADDER")].backend = orderbook::LevelsBackend::ladder;
+    orderbooks[symbols.find("LADDER")];
+    assert_equal(orderbooks.orderbooks.size(), size_t(count + 2));
+    assert(!orderbooks.orderbooks[0], "unused symbols have no book");
+    assert(&orderbooks[3] == orderbooks.orderbooks[3].get(), "book should be kept");
+    return 0;
+}
+
+int engine_test_order_index()
+{
+    SymbolTable symbols;
+    const auto commands = parse(
+        "N, 1, IBM, 10, 100, B, 1\n"
+        "N, 2, AAPL, 11, 50, S, 2\n"
+        "N, 3, IBM, 10, 60, S, 3\n"
+        "N, 4, IBM, 10, 40, S, 4\n"
+        "N, 5, AAPL, 0, 80, B, 5\n"
+        "N, 6, AAPL, 12, 30, B, 6\n", symbols);
+    OrderbookManager orderbooks;
+    TextSink out;
+    for(const Command& command : commands)
+        execute(command, orderbooks, out);
+    // 1 is filled in two trades, 2 is swept by the market order, the remaining quantity of 5 is not kept
+    assert_equal(orderbooks.restingOrders.size(), size_t(1));
+    assert_equal(orderbooks.restingOrders.find(order_key(6, 6))->second.symbol, symbols.find("AAPL"));
+
+    out.clear();
+    for(const auto& cancel : parse("C, 1, 1\nC, 2, 2\nC, 5, 5\nC, 6, 6\nC, 6, 6\n"))
+        execute(cancel, orderbooks, out);
+    assert_equal(std::string(out.buffered()), std::string("C, 6, 6\nB, B, -, -\n"));
+    assert(orderbooks.restingOrders.empty(), "cancelled orders should leave the index");
+
+    execute(commands[0], orderbooks, out);
+    assert_equal(orderbooks.restingOrders.size(), size_t(1));
+    for(const auto& flush : parse("F\n"))
+        execute(flush, orderbooks, out);
+    assert(orderbooks.restingOrders.empty(), "flush should clear the index");
+
+    // a key reused on another symbol: the fill of one order keeps the other one cancellable
+    const std::string reused =
+        "N, 1, AAA, 10, 5, B, 1\n"
+        "N, 1, BBB, 10, 5, B, 1\n"
+        "N, 2, AAA, 10, 7, S, 7\n"
+        "C, 1, 1\n";
+    const std::string expected =
+        "A, 1, 1\nB, B, 10, 5\n"
+        "A, 1, 1\nB, B, 10, 5\n"
+        "A, 2, 7\nT, 1, 1, 2, 7, 10, 5\nB, S, 10, 2\nB, B, -, -\n"
+        "C, 1, 1\nB, B, -, -\n";
+    assert_equal(run_serial(reused), expected);
+    // both orders rest when the key is cancelled, on books of different shards
+    const std::string resting = reused + "F\nN, 1, AAA, 10, 5, B, 1\nN, 1, BBB, 11, 5, B, 1\nC, 1, 1\nC, 1, 1\n";
+    const std::string bothCancelled = run_serial(resting);
+    assert_equal(bothCancelled, expected + "\nA, 1, 1\nB, B, 10, 5\nA, 1, 1\nB, B, 11, 5\nC, 1, 1\nB, B, -, -\nC, 1, 1\nB, B, -, -\n");
+    for(size_t shards : {1, 2})
+    {
+        OrderbookManager prototype;
+        TextSink sharded;
+        ShardedEngine(shards, prototype, sharded).run(parse(resting));
+        assert_equal(std::string(sharded.buffered()), bothCancelled);
+    }
+
+    // the books of a reused key are cancelled by symbol name, not in the order the symbols were interned
+    const std::string byName =
+        "N, 1, ZZZ, 10, 5, B, 1\n"
+        "N, 2, ZZZ, 9, 6, B, 2\n"
+        "N, 1, AAA, 11, 5, B, 1\n"
+        "N, 2, AAA, 8, 7, B, 2\n"
+        "C, 1, 1\n";
+    assert_equal(run_serial(byName), std::string(
+        "A, 1, 1\nB, B, 10, 5\n"
+        "A, 2, 2\n"
+        "A, 1, 1\nB, B, 11, 5\n"
+        "A, 2, 2\n"
+        "C, 1, 1\nB, B, 8, 7\n"
+        "C, 1, 1\nB, B, 9, 6\n"));
+    return 0;
+}
+
+// getline and sscanf parser with a heap object per line, as the driver used to parse input
+int engine_test_level_feed()
+{
+    // one symbol so that the level changes all belong to the same book
+    std::mt19937 gen{31};
+    std::stringstream input;
+    for(int orderId = 1; orderId <= 20000; ++orderId)
+    {
+        if(gen() % 3 == 0)
+            input << "C, 1, " << 1 + gen() % orderId << "\n";
+        else
+            input << "N, 1, IBM, " << (gen() % 40 == 0 ? 0 : 80 + gen() % 40) << ", " << 1 + gen() % 100 << ", " << (gen() % 2 ? 'B' : 'S') << ", " << orderId << "\n";
+        if(orderId % 7000 == 0)
+            input << "F\n";
+    }
+    const auto commands = parse(input.str());
+    OrderbookManager orderbooks;
+    orderbooks.levelFeed = true;
+    TextSink out;
+    for(const Command& command : commands)
+        execute(command, orderbooks, out);
+
+    // the book rebuilt from the level changes alone agrees with every top of book line
+    std::map<int, int> levels[2]; // buy, sell
+    std::string withoutLevels;
+    std::istringstream lines{std::string(out.buffered())};
+    for(std::string line; std::getline(lines, line);)
+    {
+        if(line.empty())
+        {
+            levels[0].clear();
+            levels[1].clear();
+        }
+        else if(line[0] == 'L' || line[0] == 'B')
+        {
+            auto& book = levels[line[3] == 'S'];
+            if(line[0] == 'L')
+            {
+                int price = 0, quantity = 0;
+                std::sscanf(line.c_str() + 6, "%d, %d", &price, &quantity);
+                if(quantity == 0)
+                    book.erase(price);
+                else
+                    book[price] = quantity;
+                continue;
+            }
+            std::string best = "-, -";
+            if(!book.empty())
+            {
+                const auto& top = line[3] == 'S' ? *book.begin() : *book.rbegin();
+                best = std::to_string(top.first) + ", " + std::to_string(top.second);
+            }
+            assert_equal(line.substr(6), best);
+        }
+        withoutLevels += line + "\n";
+    }
+    // the level feed only adds lines
+    assert_equal(withoutLevels, run_serial(input.str()));
+
+    orderbook::DepthLevel depth[orderbook::MaxDepth];
+    for(const Orderside side : {Orderside::buy, Orderside::sell})
+    {
+        const auto& book = levels[side == Orderside::sell];
+        const size_t count = orderbooks[commands.back().order.symbol].depth(side, orderbook::MaxDepth, depth);
+        assert_equal(count, std::min(book.size(), orderbook::MaxDepth));
+        for(size_t index = 0; index < count; ++index)
+        {
+            const std::pair<int, int> level = side == Orderside::sell ? *std::next(book.begin(), index) : *std::next(book.rbegin(), index);
+            assert_equal(std::make_pair(depth[index].price, depth[index].quantity), level);
+        }
+    }
+    return 0;
+}
+
+int engine_test_snapshot()
+{
+    const std::string input = generate_input(41, 30000);
+    SymbolTable symbols;
+    const auto commands = parse(input, symbols);
+    const size_t taken = commands.size() / 2;
+
+    char path[] = "/tmp/engine_test_snapshotXXXXXX";
+    const int fd = mkstemp(path);
+    ::close(fd);
+
+    OrderbookManager orderbooks;
+    orderbooks.levelFeed = true;
+    TextSink out;
+    Snapshot snapshot;
+    {
+        SnapshotWriter writer;
+        for(size_t index = 0; index < commands.size(); ++index)
+        {
+            if(index == taken)
+            {
+                snapshot = capture_snapshot(orderbooks, symbols, index);
+                writer.write(capture_snapshot(orderbooks, symbols, index), path);
+                out.clear();
+            }
+            execute(commands[index], orderbooks, out);
+        }
+        writer.finish();
+    }
+    assert(!snapshot.books.empty(), "snapshot should hold orders");
+
+    // a restart from the snapshot which replays the commands after it gives the same output
+    OrderbookManager restored;
+    restored.levelFeed = true;
+    SymbolTable restoredSymbols;
+    restoredSymbols.intern("UNRELATED"); // ids are reassigned on restore
+    assert_equal(restore_snapshot(path, restored, restoredSymbols), std::uint64_t(taken));
+    assert_equal(encode_snapshot(capture_snapshot(restored, restoredSymbols, taken)), encode_snapshot(snapshot));
+    const auto tail = parse(input, restoredSymbols);
+    TextSink restoredOut;
+    for(size_t index = taken; index < tail.size(); ++index)
+        execute(tail[index], restored, restoredOut);
+    assert_equal(std::string(restoredOut.buffered()), std::string(out.buffered()));
+
+    // iceberg reserves and pending stops are part of the snapshot
+    OrderbookManager special;
+    SymbolTable specialSymbols;
+    orderbook::OrderbookListener quiet;
+    Orderbook& book = special[specialSymbols.intern("ICE")];
+    book.add_iceberg_order(Orderside::sell, 1, 1, 100, 50, 10, quiet);
+    book.add_order(Orderside::sell, 1, 2, 100, 5, quiet);
+    book.add_order(Orderside::buy, 1, 3, 90, 5, quiet);
+    book.add_stop_order(Orderside::buy, 2, 1, 100, 0, 20);
+    book.add_stop_order(Orderside::buy, 2, 2, 100, 101, 5);
+    book.add_stop_order(Orderside::sell, 2, 3, 90, 0, 5);
+    // a book only holding stops is kept
+    special[specialSymbols.intern("STOPS")].add_stop_order(Orderside::sell, 3, 1, 50, 0, 1);
+    const Snapshot specialSnapshot = capture_snapshot(special, specialSymbols, 7);
+    assert_equal(specialSnapshot.books.size(), size_t(2));
+    write_snapshot(specialSnapshot, path);
+    OrderbookManager reloaded;
+    SymbolTable reloadedSymbols;
+    assert_equal(restore_snapshot(path, reloaded, reloadedSymbols), std::uint64_t(7));
+    assert_equal(encode_snapshot(capture_snapshot(reloaded, reloadedSymbols, 7)), encode_snapshot(specialSnapshot));
+    // both books go on the same way: slices are replenished and the stops triggered
+    TextSink specialOut, reloadedOut;
+    for(const auto& command : parse("N, 4, ICE, 100, 30, B, 1\nN, 5, ICE, 90, 5, S, 2\n", specialSymbols))
+        execute(command, special, specialOut);
+    for(const auto& command : parse("N, 4, ICE, 100, 30, B, 1\nN, 5, ICE, 90, 5, S, 2\n", reloadedSymbols))
+        execute(command, reloaded, reloadedOut);
+    assert_equal(std::string(reloadedOut.buffered()), std::string(specialOut.buffered()));
+    assert_equal(encode_snapshot(capture_snapshot(reloaded, reloadedSymbols, 9)), encode_snapshot(capture_snapshot(special, specialSymbols, 9)));
+    if(ORDERBOOK_STATS)
+        assert_equal(reloaded[reloadedSymbols.find("ICE")].stats().counters.stopsTriggered, uint64_t(3));
+
+    // a damaged file is refused
+    std::string encoded = encode_snapshot(snapshot);
+    encoded[encoded.size() / 2] ^= 1;
+    std::ofstream(path, std::ios::binary | std::ios::trunc) << encoded;
+    bool refused = false;
+    try
+    {
+        OrderbookManager damaged;
+        SymbolTable damagedSymbols;
+        restore_snapshot(path, damaged, damagedSymbols);
+    }
+    catch(const std::runtime_error&)
+    {
+        refused = true;
+    }
+    std::remove(path);
+    assert(refused, "corrupted snapshot should be refused");
+    return 0;
+}
+
+// removes directory and the files in it
+static void remove_directory(const std::string& directory)
+{
+    if(DIR* dir = ::opendir(directory.c_str()))
+    {
+        while(const dirent* entry = ::readdir(dir))
+        {
+            if(entry->d_name[0] != '.')
+                std::remove((directory + "/" + entry->d_name).c_str());
+        }
+        ::closedir(dir);
+    }
+    ::rmdir(directory.c_str());
+}
+
+int engine_test_journal()
+{
+    const std::string input = generate_input(43, 30000);
+    SymbolTable symbols;
+    const auto commands = parse(input, symbols);
+    const size_t taken = commands.size() / 3;
+
+    for(JournalSync sync : {JournalSync::group, JournalSync::async})
+    {
+        char path[] = "/tmp/engine_test_journalXXXXXX";
+        assert(::mkdtemp(path) != nullptr, "temporary directory");
+        const std::string directory = path;
+
+        // small segments and batches so that the run rotates segments and splits symbol names across them
+        JournalConfig config;
+        config.sync = sync;
+        config.segmentBytes = JournalRecordSize * 200;
+        config.batchBytes = JournalRecordSize * 16;
+        config.ringCapacity = 64;
+
+        OrderbookManager orderbooks;
+        TextSink out;
+        std::string expectedTail;
+        Snapshot snapshot;
+        {
+            JournalWriter journal(directory, symbols, 0, config);
+            for(size_t index = 0; index < commands.size(); ++index)
+            {
+                if(index == taken)
+                {
+                    snapshot = capture_snapshot(orderbooks, symbols, index);
+                    expectedTail.assign(out.buffered());
+                }
+                assert_equal(journal.append(commands[index]), std::uint64_t(index));
+                execute(commands[index], orderbooks, out);
+            }
+            journal.finish();
+            assert_equal(journal.durable(), std::uint64_t(commands.size()));
+        }
+        const std::string expected(out.buffered());
+        expectedTail = expected.substr(expectedTail.size());
+
+        // replaying the whole journal into fresh books gives the same output
+        {
+            OrderbookManager replayed;
+            SymbolTable replayedSymbols;
+            replayedSymbols.intern("UNRELATED"); // ids are remapped on replay
+            TextSink replayedOut;
+            const std::uint64_t end = JournalReader(directory).replay(replayedSymbols, 0, [&](const Command& command)
+                {
+                    execute(command, replayed, replayedOut);
+                });
+            assert_equal(end, std::uint64_t(commands.size()));
+            assert_equal(std::string(replayedOut.buffered()), expected);
+        }
+
+        // a snapshot plus the journal after it gives the output of the tail
+        {
+            char snapshotPath[] = "/tmp/engine_test_journal_snapshotXXXXXX";
+            ::close(mkstemp(snapshotPath));
+            write_snapshot(snapshot, snapshotPath);
+            OrderbookManager restored;
+            SymbolTable restoredSymbols;
+            const std::uint64_t sequence = restore_snapshot(snapshotPath, restored, restoredSymbols);
+            std::remove(snapshotPath);
+            TextSink restoredOut;
+            JournalReader(directory).replay(restoredSymbols, sequence, [&](const Command& command)
+                {
+                    execute(command, restored, restoredOut);
+                });
+            assert_equal(std::string(restoredOut.buffered()), expectedTail);
+        }
+
+        // a damaged record before the last segment is refused
+        {
+            char segment[64];
+            std::snprintf(segment, sizeof(segment), "/journal-%020llu.log", 0ull);
+            std::fstream file(directory + segment, std::ios::binary | std::ios::in | std::ios::out);
+            file.seekp(JournalRecordSize * 150 + 5);
+            file.put('\x7f');
+            file.close();
+            bool refused = false;
+            try
+            {
+                SymbolTable damagedSymbols;
+                JournalReader(directory).replay(damagedSymbols, 0, [](const Command&) {});
+            }
+            catch(const std::runtime_error&)
+            {
+                refused = true;
+            }
+            assert(refused, "corrupted journal should be refused");
+        }
+        remove_directory(directory);
+    }
+    return 0;
+}
+
+namespace legacy {
+    struct InputCommand
+    {
+        virtual ~InputCommand() = default;
+    };
+    struct PrintCommand : InputCommand
+    {
+        std::string line;
+        PrintCommand(std::string&& line) : line(std::move(line)) {}
+    };
+    struct NewOrderCommand : InputCommand
+    {
+        int userId;
+        std::string symbol;
+        int price;
+        int quantity;
+        Orderside side;
+        int orderId;
+        NewOrderCommand(int userId, const std::string& symbol, int price, int quantity, Orderside side, int orderId)
+            : userId(userId), symbol(symbol), price(price), quantity(quantity), side(side), orderId(orderId) {}
+    };
+    struct CancelOrderCommand : InputCommand
+    {
+        int userId;
+        int orderId;
+        CancelOrderCommand(int userId, int orderId) : userId(userId), orderId(orderId) {}
+    };
+    struct FlushCommand : InputCommand {};
+
+    using InputCommandPtr = std::unique_ptr<InputCommand>;
+    std::vector<InputCommandPtr> ParseInputCommands(std::istream& stream)
+    {
+        std::string line;
+        std::vector<InputCommandPtr> commands;
+        while (std::getline(stream, line))
+        {
+            if (line.empty())
+                continue;
+            switch (*line.begin())
+            {
+            case '#':
+                commands.push_back(InputCommandPtr(new PrintCommand(std::move(line))));
+                break;
+            case 'N':
+            {
+                int userId, price, quantity, orderId;
+                char symbol[100];
+                char side;
+                sscanf(line.c_str(), "N, %d, %99[^,], %d, %d, %c, %d", &userId, symbol, &price, &quantity, &side, &orderId);
+                commands.push_back(InputCommandPtr(new NewOrderCommand(userId, symbol, price, quantity, side == 'B' ? Orderside::buy : Orderside::sell, orderId)));
+            }
+            break;
+            case 'C':
+            {
+                int userId, orderId;
+                sscanf(line.c_str(), "C, %d, %d", &userId, &orderId);
+                commands.push_back(InputCommandPtr(new CancelOrderCommand(userId, orderId)));
+            }
+            break;
+            case 'F':
+                commands.push_back(InputCommandPtr(new FlushCommand));
+                break;
+            default:
+                break;
+            }
+        }
+        return commands;
+    }
+}
+
+// compares the getline/sscanf parser with the memory mapped parser on a generated file
+int engine_bench_parser(const char ** argv)
+{
+    const int lines = argv[2] ? std::stoi(argv[2]) : 1000000;
+    char path[] = "/tmp/engine_bench_parserXXXXXX";
+    const int fd = mkstemp(path);
+    assert(fd >= 0, "cannot create temporary file");
+    close(fd);
+    {
+        std::ofstream file(path);
+        file << generate_input(7, lines);
+    }
+
+    auto report = [lines](const char* name, std::chrono::nanoseconds time, size_t bytes, size_t commands)
+    {
+        const double seconds = std::chrono::duration<double>(time).count();
+        std::cerr << name << ": " << commands << " commands, " << lines / seconds / 1e6 << " M lines/s, "
+                  << bytes / seconds / (1 << 20) << " MB/s\n";
+    };
+
+    {
+        auto start = std::chrono::steady_clock::now();
+        std::ifstream file(path);
+        const auto commands = legacy::ParseInputCommands(file);
+        report("getline + sscanf", std::chrono::steady_clock::now() - start, MappedFile(path).size(), commands.size());
+    }
+    {
+        auto start = std::chrono::steady_clock::now();
+        MappedFile file(path);
+        SymbolTable symbols;
+        const auto commands = parse_commands(file.begin(), file.end(), symbols);
+        report("mmap + CommandParser", std::chrono::steady_clock::now() - start, file.size(), commands.size());
+    }
+    std::remove(path);
+    return 0;
+}
+
+int engine_test_sharded_output()
+{
+    const std::string input = generate_input(42, 50000);
+    const std::string expected = run_serial(input);
+    assert(expected.size() > input.size() / 2, "replay should produce output");
+
+    const auto commands = parse(input);
+    for(size_t shards : {1, 2, 5})
+    {
+        OrderbookManager prototype;
+        TextSink out;
+        ShardedEngine(shards, prototype, out).run(commands);
+        assert_equal(std::string(out.buffered()), expected);
+    }
+
+    // a cancel goes to the partitions its key was placed on, until their orders are reported ended
+    SymbolTable symbols;
+    const auto orders = parse("N, 1, AAA, 10, 5, B, 1\nN, 1, BBB, 10, 5, B, 1\nC, 1, 1\nC, 2, 2\n", symbols);
+    CommandRouter router(2, {0, 1});
+    const auto cancelled = [&router, &orders]()
+        {
+            const Route routed = router.route(orders[2]);
+            return routed.kind == Route::Kind::one ? int(routed.partition) : routed.kind == Route::Kind::cancel ? 2 : -1;
+        };
+    assert(router.route(orders[3]).kind == Route::Kind::none, "a cancel of an unknown key should be dropped");
+    router.route(orders[0]);
+    assert_equal(cancelled(), 0);
+    router.route(orders[1]);
+    assert_equal(cancelled(), 2);
+    router.ended(order_key(1, 1), 0);
+    assert_equal(cancelled(), 1);
+    router.route(orders[1]);
+    router.ended(order_key(1, 1), 1);
+    assert_equal(cancelled(), 1);
+    router.ended(order_key(1, 1), 1);
+    assert_equal(cancelled(), -1);
+    assert_equal(router.keys(), size_t(0));
+    return 0;
+}
+
+int engine_test_partitioned_replay()
+{
+    const std::string input = generate_input(44, 50000);
+    SymbolTable symbols;
+    const auto commands = parse(input, symbols);
+    const auto count = [&commands](CommandType type)
+        {
+            return std::count_if(commands.begin(), commands.end(), [type](const Command& command) { return command.type == type; });
+        };
+    const auto orders = count(CommandType::newOrder), cancels = count(CommandType::cancel), flushes = count(CommandType::flush);
+    for(bool levelFeed : {false, true})
+    {
+        OrderbookManager prototype;
+        prototype.levelFeed = levelFeed;
+        OrderbookManager orderbooks;
+        orderbooks.levelFeed = levelFeed;
+        TextSink expected;
+        for(const Command& command : commands)
+            execute(command, orderbooks, expected);
+
+        for(size_t partitions : {1, 2, 5, 16})
+        {
+            TextSink out;
+            const ReplayReport report = replay_partitioned(commands, partitions, prototype, out);
+            assert_equal(std::string(out.buffered()), std::string(expected.buffered()));
+            // every symbol is owned by exactly one partition and every key is used once, so only flushes are sent to
+            // several partitions
+            assert_equal(report.partitions.size(), partitions);
+            size_t symbolCount = 0, executed = 0;
+            for(const ReplayPartition& partition : report.partitions)
+            {
+                symbolCount += partition.symbols;
+                executed += partition.commands;
+            }
+            assert_equal(symbolCount, symbols.size());
+            assert_equal(executed, size_t(orders + cancels + flushes * partitions));
+        }
+    }
+
+    // routed as by ShardedEngine: a key reused on books of two partitions is cancelled in both
+    const std::string reused = "N, 1, AAA, 10, 5, B, 1\nN, 1, BBB, 10, 5, B, 1\nN, 2, AAA, 10, 7, S, 7\nC, 1, 1\n"
+        "N, 1, AAA, 10, 5, B, 1\nN, 1, BBB, 11, 5, B, 1\nN, 3, AAA, 12, 5, S, 2\nC, 1, 1\nC, 1, 1\n";
+    OrderbookManager prototype;
+    TextSink out;
+    replay_partitioned(parse(reused), 2, prototype, out);
+    assert_equal(std::string(out.buffered()), run_serial(reused));
+    return 0;
+}
+
+int engine_test_pipeline()
+{
+    const std::string input = generate_input(11, 20000) + "#comment at the end without new line " + std::string(60, '-');
+    const std::string expected = run_serial(input);
+
+    int fds[2];
+    assert(pipe(fds) == 0, "cannot create pipe");
+    std::thread writer([&input, fds]()
+        {
+            // uneven writes so that lines are split between reads
+            for(size_t offset = 0; offset < input.size();)
+            {
+                const size_t length = std::min<size_t>(input.size() - offset, 1 + offset % 97);
+                const ssize_t written = write(fds[1], input.data() + offset, length);
+                offset += written > 0 ? size_t(written) : 0;
+            }
+            close(fds[1]);
+        });
+
+    // tiny ring and read buffer to exercise back pressure and lines longer than a read
+    SymbolTable symbols;
+    CommandPipeline pipeline(symbols, 8, 16);
+    OrderbookManager orderbooks;
+    TextSink out;
+    pipeline.run(fds[0], [&orderbooks, &out](const Command& command) { execute(command, orderbooks, out); });
+    writer.join();
+    close(fds[0]);
+    assert_equal(std::string(out.buffered()), expected);
+
+    // a consumer throwing while the producer waits for room in the full ring stops and joins it
+    const std::string file = "/tmp/engine_test_pipeline.csv";
+    {
+        std::ofstream stream(file, std::ios::binary);
+        stream << input;
+    }
+    const int fd = open(file.c_str(), O_RDONLY);
+    assert(fd >= 0, "cannot open input");
+    size_t consumed = 0;
+    bool thrown = false;
+    try
+    {
+        pipeline.run(fd, [&consumed](const Command&)
+            {
+                if(++consumed == 100)
+                    throw std::logic_error("consumer failed");
+            });
+    }
+    catch(const std::logic_error& e)
+    {
+        thrown = std::string(e.what()) == "consumer failed";
+    }
+    close(fd);
+    assert(thrown, "consumer exception not rethrown");
+    assert_equal(consumed, size_t(100));
+
+    // the pipeline can run again, and an error of the producer is rethrown by run
+    TextSink again;
+    OrderbookManager fresh;
+    const int reopened = open(file.c_str(), O_RDONLY);
+    pipeline.run(reopened, [&fresh, &again](const Command& command) { execute(command, fresh, again); });
+    close(reopened);
+    std::remove(file.c_str());
+    assert_equal(std::string(again.buffered()), expected);
+    thrown = false;
+    try
+    {
+        pipeline.run(-1, [](const Command&) {});
+    }
+    catch(const std::runtime_error& e)
+    {
+        thrown = std::string(e.what()).find("Cannot read input") == 0;
+    }
+    assert(thrown, "producer error not rethrown");
+    return 0;
+}
+
+int engine_test_output()
+{
+    TextSink text;
+    text.acknowledged(1, 2);
+    text.traded(-7, 2147483647, 0, -2147483647 - 1, 10, 100);
+    text.top_of_book(Orderside::sell, 11, 50);
+    text.top_of_book(Orderside::buy, -1, -1);
+    text.cancelled(3, 4);
+    text.text("#name: ", false);
+    text.text("scenario", true);
+    text.flushed();
+    const std::string expected =
+        "A, 1, 2\n"
+        "T, -7, 2147483647, 0, -2147483648, 10, 100\n"
+        "B, S, 11, 50\n"
+        "B, B, -, -\n"
+        "C, 3, 4\n"
+        "#name: scenario\n"
+        "\n";
+    assert_equal(std::string(text.buffered()), expected);
+
+    // binary events decode to the same text
+    BinarySink binary;
+    binary.acknowledged(1, 2);
+    binary.traded(-7, 2147483647, 0, -2147483647 - 1, 10, 100);
+    binary.top_of_book(Orderside::sell, 11, 50);
+    binary.top_of_book(Orderside::buy, -1, -1);
+    binary.cancelled(3, 4);
+    binary.text("#name: ", false);
+    binary.text("scenario", true);
+    binary.flushed();
+    assert_equal(binary.buffered().size(), 8 * BinarySink::EventSize);
+    assert_equal(binary.buffered().substr(0, 12), std::string("\x01\0\0\0\x01\0\0\0\x02\0\0\0", 12));
+    TextSink decoded;
+    replay_events(binary.buffered(), decoded);
+    assert_equal(std::string(decoded.buffered()), expected);
+
+    const std::string input = generate_input(5, 20000) + "#" + std::string(100, 'x') + "\n";
+    const std::string serial = run_serial(input);
+    TextSink replayed;
+    replay_events(run_serial(input, true), replayed);
+    assert_equal(std::string(replayed.buffered()), serial);
+
+    // a small buffer is written to the file descriptor in several batches
+    char path[] = "/tmp/engine_test_outputXXXXXX";
+    const int fd = mkstemp(path);
+    assert(fd >= 0, "cannot create temporary file");
+    {
+        TextSink file(fd, 256);
+        OrderbookManager orderbooks;
+        for(const Command& command : parse(input))
+            execute(command, orderbooks, file);
+        assert(file.buffered().size() <= 256, "buffer should be written once full");
+    }
+    close(fd);
+    std::ifstream written(path, std::ios::binary);
+    std::stringstream content;
+    content << written.rdbuf();
+    std::remove(path);
+    assert_equal(content.str(), serial);
+    return 0;
+}
+
+int engine_bench_output(const char ** argv)
+{
+    const int count = std::atoi(argv[2]);
+    auto report = [count](const char* name, std::chrono::steady_clock::duration elapsed, size_t bytes)
+    {
+        const double seconds = std::chrono::duration<double>(elapsed).count();
+        std::cout << name << ": " << seconds << "s, " << count / seconds / 1e6 << "M events/s, " << bytes << " bytes\n";
+    };
+
+    size_t expected = 0;
+    {
+        const auto start = std::chrono::steady_clock::now();
+        std::stringstream out;
+        for(int index = 0; index < count; ++index)
+        {
+            std::stringstream trades;
+            trades << "T, " << index % 7 << ", " << index << ", " << index % 5 << ", " << index - 1 << ", " << 100 + index % 13 << ", " << 1 + index % 200 << "\n";
+            out << "A, " << index % 7 << ", " << index << "\n" << trades.str();
+        }
+        expected = out.str().size();
+        report("ostream", std::chrono::steady_clock::now() - start, expected);
+    }
+    for(bool binary : {false, true})
+    {
+        const auto start = std::chrono::steady_clock::now();
+        std::unique_ptr<OutputSink> out;
+        if(binary)
+            out.reset(new BinarySink);
+        else
+            out.reset(new TextSink);
+        for(int index = 0; index < count; ++index)
+        {
+            out->acknowledged(index % 7, index);
+            out->traded(index % 7, index, index % 5, index - 1, 100 + index % 13, 1 + index % 200);
+        }
+        report(binary ? "BinarySink" : "TextSink", std::chrono::steady_clock::now() - start, out->buffered().size());
+        if(!binary)
+            assert_equal(out->buffered().size(), expected);
+    }
+    return 0;
+}
+
+int run_engine_tests(const char ** argv)
+{
+    const char * testName = argv[1];
+    if(std::strcmp("engine_test_parser", testName) == 0)
+    {
+        return engine_test_parser();
+    }
+    else if(std::strcmp("engine_test_symbols", testName) == 0)
+    {
+        return engine_test_symbols();
+    }
+    else if(std::strcmp("engine_test_order_index", testName) == 0)
+    {
+        return engine_test_order_index();
+    }
+    else if(std::strcmp("engine_test_level_feed", testName) == 0)
+    {
+        return engine_test_level_feed();
+    }
+    else if(std::strcmp("engine_test_snapshot", testName) == 0)
+    {
+        return engine_test_snapshot();
+    }
+    else if(std::strcmp("engine_test_journal", testName) == 0)
+    {
+        return engine_test_journal();
+    }
+    else if(std::strcmp("engine_bench_parser", testName) == 0)
+    {
+        return engine_bench_parser(argv);
+    }
+    else if(std::strcmp("engine_test_partitioned_replay", testName) == 0)
+    {
+        return engine_test_partitioned_replay();
+    }
+    else if(std::strcmp("engine_test_pipeline", testName) == 0)
+    {
+        return engine_test_pipeline();
+    }
+    else if(std::strcmp("engine_test_sharded_output", testName) == 0)
+    {
+        return engine_test_sharded_output();
+    }
+    else if(std::strcmp("engine_test_output", testName) == 0)
+    {
+        return engine_test_output();
+    }
+    else if(std::strcmp("engine_bench_output", testName) == 0)
+    {
+        return engine_bench_output(argv);
+    }
+    else
+    {
+        return -1;
+    }
+}
@@ -0,0 +1,3 @@
+#pragma once
+
+int run_engine_tests(const char ** argv);
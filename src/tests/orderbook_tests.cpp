@@ -1,24 +1,63 @@
+#include "bench/histogram.hpp"
 #include "orderbook/orderbook.hpp"
 #include "test_utils.hpp"
+#include <algorithm>
+#include <cmath>
 #include <cstring>
 #include <vector>
 #include <iostream>
+#include <limits>
+#include <map>
+#include <set>
 #include <chrono>
 #include <random>
+#include <thread>
+#include <atomic>
+#include <cstdlib>
+#include <memory>
+#include <new>
 
 using namespace orderbook;
-int orderbook_test_empty_orderbook()
+
+// counts calls to the global allocator so tests can check that hot paths do not allocate
+// every form is replaced so that each allocation is released by the matching function
+static size_t globalAllocations = 0;
+static void* counted_allocate(size_t size, size_t alignment)
 {
-    Orderbook book;
+    ++globalAllocations;
+    if(size == 0)
+        size = 1;
+    void* pointer = alignment <= alignof(std::max_align_t) ? std::malloc(size)
+        : std::aligned_alloc(alignment, (size + alignment - 1) / alignment * alignment);
+    if(pointer == nullptr)
+        throw std::bad_alloc();
+    return pointer;
+}
+void* operator new(size_t size) { return counted_allocate(size, alignof(std::max_align_t)); }
+void* operator new[](size_t size) { return counted_allocate(size, alignof(std::max_align_t)); }
+void* operator new(size_t size, std::align_val_t alignment) { return counted_allocate(size, size_t(alignment)); }
+void* operator new[](size_t size, std::align_val_t alignment) { return counted_allocate(size, size_t(alignment)); }
+void operator delete(void* pointer) noexcept { std::free(pointer); }
+void operator delete[](void* pointer) noexcept { std::free(pointer); }
+void operator delete(void* pointer, size_t) noexcept { std::free(pointer); }
+void operator delete[](void* pointer, size_t) noexcept { std::free(pointer); }
+void operator delete(void* pointer, std::align_val_t) noexcept { std::free(pointer); }
+void operator delete[](void* pointer, std::align_val_t) noexcept { std::free(pointer); }
+void operator delete(void* pointer, size_t, std::align_val_t) noexcept { std::free(pointer); }
+void operator delete[](void* pointer, size_t, std::align_val_t) noexcept { std::free(pointer); }
+
+int orderbook_test_empty_orderbook(const OrderbookConfig& config)
+{
+    Orderbook book(config);
     assert_equal(book.get_max_bid(), std::pair(-1, -1));
     assert_equal(book.get_min_ask(), std::pair(-1, -1));
     assert_equal(book.cancel_order(1,1), false);
     return 0;
 }
 
-int orderbook_test_add_orders()
+int orderbook_test_add_orders(const OrderbookConfig& config)
 {
-    Orderbook book;
+    Orderbook book(config);
     assert_equal(book.add_order(Orderside::buy, 1, 1, 100, 100, nullptr), true);
     assert_equal(book.add_order(Orderside::sell, 2, 1, 110, 100, nullptr), true);
     assert_equal(book.get_max_bid(), std::pair(100, 100));
@@ -43,9 +82,9 @@ int orderbook_test_add_orders()
     return 0;
 }
 
-int orderbook_test_cancel_orders()
+int orderbook_test_cancel_orders(const OrderbookConfig& config)
 {
-    Orderbook book;
+    Orderbook book(config);
     book.add_order(Orderside::buy, 1, 1, 100, 100, nullptr);
     book.add_order(Orderside::sell, 2, 1, 110, 100, nullptr);
     book.add_order(Orderside::buy, 2, 2, 100, 100, nullptr);
@@ -115,9 +154,49 @@ void print_matches(const std::vector<Match>& matches)
     }
 }
 
-int orderbook_test_match_buy_side()
+int orderbook_test_cancel_priority(const OrderbookConfig& config)
 {
-    Orderbook book;
+    Orderbook book(config);
+    std::vector<Match> recent_matches;
+    Orderbook::MatchFunctor functor = [&recent_matches](Orderside side, int a, int b, int c, int d, int p, int q) -> bool
+    {
+        recent_matches.push_back(Match{side, a, b, c, d, p, q});
+        return true;
+    };
+
+    // queue of four orders on the same level, cancel from the middle and both ends
+    book.add_order(Orderside::buy, 1, 1, 100, 10, functor);
+    book.add_order(Orderside::buy, 1, 2, 100, 20, functor);
+    book.add_order(Orderside::buy, 1, 3, 100, 30, functor);
+    book.add_order(Orderside::buy, 1, 4, 100, 40, functor);
+    book.add_order(Orderside::buy, 1, 5, 100, 50, functor);
+    assert_equal(book.cancel_order(1, 3), true);
+    assert_equal(book.cancel_order(1, 1), true);
+    assert_equal(book.cancel_order(1, 5), true);
+    assert_equal(book.cancel_order(1, 3), false);
+    assert_equal(book.get_max_bid(), std::make_pair(100, 60));
+
+    // remaining orders keep their time priority
+    assert_equal(book.add_order(Orderside::sell, 2, 101, 100, 30, functor), true);
+    assert_equal(recent_matches, 
+        std::vector<Match>(
+            { 
+                Match{Orderside::sell, 1, 2, 2, 101, 100, 20},
+                Match{Orderside::sell, 1, 4, 2, 101, 100, 10},
+            }
+        ));
+    assert_equal(book.get_max_bid(), std::make_pair(100, 30));
+
+    // filled orders leave the book and can not be cancelled
+    assert_equal(book.cancel_order(1, 2), false);
+    assert_equal(book.cancel_order(1, 4), true);
+    assert_equal(book.get_max_bid(), std::make_pair(-1, -1));
+    return 0;
+}
+
+int orderbook_test_match_buy_side(const OrderbookConfig& config)
+{
+    Orderbook book(config);
     std::vector<Match> recent_matches;
     Orderbook::MatchFunctor functor = [&recent_matches](Orderside side, int a, int b, int c, int d, int p, int q) -> bool
     {
@@ -208,9 +287,9 @@ int orderbook_test_match_buy_side()
     return 0;
 }
 
-int orderbook_test_match_sell_side()
+int orderbook_test_match_sell_side(const OrderbookConfig& config)
 {
-    Orderbook book;
+    Orderbook book(config);
     std::vector<Match> recent_matches;
     Orderbook::MatchFunctor functor = [&recent_matches](Orderside side, int a, int b, int c, int d, int p, int q) -> bool
     {
@@ -297,9 +376,9 @@ int orderbook_test_match_sell_side()
     return 0;
 }
 
-int orderbook_test_market_orders()
+int orderbook_test_market_orders(const OrderbookConfig& config)
 {
-    Orderbook book;
+    Orderbook book(config);
     std::vector<Match> recent_matches;
     Orderbook::MatchFunctor functor = [&recent_matches](Orderside side, int a, int b, int c, int d, int p, int q) -> bool
     {
@@ -385,9 +464,9 @@ int orderbook_test_market_orders()
     return 0;
 }
 
-int orderbook_test_flush()
+int orderbook_test_flush(const OrderbookConfig& config)
 {
-    Orderbook book;
+    Orderbook book(config);
     book.add_order(Orderside::buy, 1, 1, 100, 100, nullptr);
     book.add_order(Orderside::sell, 2, 2, 102, 100, nullptr);
     assert_equal(book.get_max_bid(), std::pair(100, 100));
@@ -402,9 +481,1079 @@ int orderbook_test_flush()
     return 0;
 }
 
-int orderbook_bench(const char ** argv)
+int orderbook_test_ladder_window(const OrderbookConfig&)
+{
+    OrderbookConfig config;
+    config.backend = LevelsBackend::ladder;
+    config.ladderTicks = 64;
+    Orderbook book(config);
+    std::vector<Match> recent_matches;
+    Orderbook::MatchFunctor functor = [&recent_matches](Orderside side, int a, int b, int c, int d, int p, int q) -> bool
+    {
+        recent_matches.push_back(Match{side, a, b, c, d, p, q});
+        return true;
+    };
+
+    // window is centered on the first price, prices far away go to the tree
+    book.add_order(Orderside::sell, 1, 1, 1000, 10, functor);
+    book.add_order(Orderside::sell, 1, 2, 1010, 20, functor);
+    book.add_order(Orderside::sell, 1, 3, 5000, 30, functor);
+    book.add_order(Orderside::sell, 1, 4, 900, 40, functor);
+    assert_equal(book.get_min_ask(), std::make_pair(900, 40));
+    book.add_order(Orderside::buy, 2, 1, 800, 10, functor);
+    book.add_order(Orderside::buy, 2, 2, 10, 20, functor);
+    book.add_order(Orderside::buy, 2, 3, 820, 30, functor);
+    assert_equal(book.get_max_bid(), std::make_pair(820, 30));
+
+    // sweep through tree and ladder levels in price order
+    assert_equal(book.add_order(Orderside::buy, 3, 1, 0, 100, functor), true);
+    assert_equal(recent_matches, 
+        std::vector<Match>(
+            { 
+                Match{Orderside::buy, 1, 4, 3, 1, 900, 40},
+                Match{Orderside::buy, 1, 1, 3, 1, 1000, 10},
+                Match{Orderside::buy, 1, 2, 3, 1, 1010, 20},
+                Match{Orderside::buy, 1, 3, 3, 1, 5000, 30},
+            }
+        ));
+    assert_equal(book.get_min_ask(), std::make_pair(-1, -1));
+    recent_matches.clear();
+
+    // empty window is recentered on the next price
+    book.add_order(Orderside::sell, 1, 5, 7000, 10, functor);
+    book.add_order(Orderside::sell, 1, 6, 7001, 10, functor);
+    book.add_order(Orderside::sell, 1, 7, 6990, 10, functor);
+    assert_equal(book.get_min_ask(), std::make_pair(6990, 10));
+    assert_equal(book.cancel_order(1, 7), true);
+    assert_equal(book.get_min_ask(), std::make_pair(7000, 10));
+
+    assert_equal(book.cancel_order(2, 3), true);
+    assert_equal(book.get_max_bid(), std::make_pair(800, 10));
+    assert_equal(book.cancel_order(2, 1), true);
+    assert_equal(book.get_max_bid(), std::make_pair(10, 20));
+    assert_equal(book.add_order(Orderside::sell, 3, 2, 5, 30, functor), true);
+    assert_equal(recent_matches, std::vector<Match>({ Match{Orderside::sell, 2, 2, 3, 2, 10, 20} }));
+    assert_equal(book.get_max_bid(), std::make_pair(-1, -1));
+    assert_equal(book.get_min_ask(), std::make_pair(5, 10));
+
+    // a recentered window takes over the tree levels it covers, a price keeps one level and its time priority
+    Orderbook moved(config);
+    OrderbookListener quiet;
+    moved.add_order(Orderside::sell, 1, 1, 1000, 10, functor);
+    moved.add_order(Orderside::sell, 1, 2, 2000, 10, functor);
+    moved.add_order(Orderside::sell, 1, 3, 2010, 10, functor);
+    // the running sums of the ladder are built and must count the moved levels
+    assert_equal(moved.add_order(Orderside::buy, 4, 1, 999, 1, quiet, TimeInForce::fok), false);
+    moved.cancel_order(1, 1);
+    moved.add_order(Orderside::sell, 1, 4, 2000, 10, functor);
+    assert_equal(moved.stats().askLevels, size_t(2));
+    assert_equal(moved.get_min_ask(), std::make_pair(2000, 20));
+    assert_equal(moved.add_order(Orderside::buy, 4, 2, 2010, 30, quiet, TimeInForce::fok), true);
+    moved.add_order(Orderside::buy, 2, 1, 1000, 10, functor);
+    moved.add_order(Orderside::buy, 2, 2, 20, 10, functor);
+    moved.add_order(Orderside::buy, 2, 3, 10, 10, functor);
+    moved.cancel_order(2, 1);
+    moved.add_order(Orderside::buy, 2, 4, 20, 10, functor);
+    assert_equal(moved.stats().bidLevels, size_t(2));
+    recent_matches.clear();
+    moved.add_order(Orderside::sell, 3, 1, 10, 25, functor);
+    assert_equal(recent_matches,
+        std::vector<Match>(
+            {
+                Match{Orderside::sell, 2, 2, 3, 1, 20, 10},
+                Match{Orderside::sell, 2, 4, 3, 1, 20, 10},
+                Match{Orderside::sell, 2, 3, 3, 1, 10, 5},
+            }
+        ));
+    assert_equal(moved.get_max_bid(), std::make_pair(10, 5));
+    assert_equal(moved.stats().restingOrders, moved.stats().indexedOrders);
+    return 0;
+}
+
+int orderbook_test_concurrent_top_of_book(const OrderbookConfig& config)
+{
+    Orderbook book(config);
+    const int iterations = 200000;
+    const int readerCount = 3;
+    std::atomic<bool> done{false};
+    std::atomic<int> failures{0};
+
+    // every state published by the writer has at most one bid (price, price) and one ask (price + 1000, 2 * (price + 1000))
+    // and when both are present they were placed in the same iteration
+    auto reader = [&book, &done, &failures]()
+    {
+        std::uint64_t lastSequence = 0;
+        while(!done.load(std::memory_order_relaxed))
+        {
+            const TopOfBook top = book.top_of_book();
+            const bool bidValid = (top.bidPrice == -1 && top.bidQuantity == -1) || top.bidPrice == top.bidQuantity;
+            const bool askValid = (top.askPrice == -1 && top.askQuantity == -1) || 2 * top.askPrice == top.askQuantity;
+            const bool pairValid = top.bidPrice == -1 || top.askPrice == -1 || top.askPrice == top.bidPrice + 1000;
+            if(!bidValid || !askValid || !pairValid || top.sequence < lastSequence)
+                failures.fetch_add(1);
+            lastSequence = top.sequence;
+        }
+    };
+
+    std::vector<std::thread> readers;
+    for(int index = 0; index < readerCount; ++index)
+        readers.emplace_back(reader);
+
+    OrderbookListener listener;
+    for(int iteration = 0; iteration < iterations; ++iteration)
+    {
+        const int price = 1 + iteration % 500;
+        book.add_order(Orderside::buy, 1, iteration, price, price, listener);
+        book.add_order(Orderside::sell, 2, iteration, price + 1000, 2 * (price + 1000), listener);
+        book.cancel_order(1, iteration, listener);
+        book.cancel_order(2, iteration, listener);
+    }
+    done = true;
+    for(auto& thread : readers)
+        thread.join();
+
+    assert_equal(failures.load(), 0);
+    assert_equal(book.top_of_book().sequence, std::uint64_t(4 * iterations));
+    return 0;
+}
+
+// the order index and the order nodes follow the live orders: filled orders leave them during the sweep
+int orderbook_test_order_index(const OrderbookConfig& config)
+{
+    struct LiveOrders : OrderbookListener
+    {
+        std::set<std::pair<int, int>> live;
+        void on_add(Orderside, int clientId, int orderId, int, int) { live.emplace(clientId, orderId); }
+        void on_filled(Orderside, int clientId, int orderId) { live.erase({clientId, orderId}); }
+        void on_cancel(Orderside, int clientId, int orderId, int, int) { live.erase({clientId, orderId}); }
+    };
+
+    Orderbook book(config);
+    LiveOrders listener;
+    std::mt19937 gen{21};
+    std::normal_distribution<> priceDistribution(100, 4);
+    std::uniform_int_distribution<int> quantityDistribution(1, 100);
+    std::uniform_int_distribution<int> clientDistribution(1, 20);
+    const int operations = 200000;
+    std::vector<std::pair<int, int>> placed;
+    size_t peak = 0;
+    for(int operation = 0; operation < operations; ++operation)
+    {
+        if(operation % 3 == 2)
+        {
+            // cancels one of the last orders placed, which may be filled already
+            const auto& order = placed[placed.size() - 1 - gen() % std::min<size_t>(placed.size(), 100)];
+            book.cancel_order(order.first, order.second, listener);
+        }
+        else
+        {
+            const int clientId = clientDistribution(gen);
+            // order ids are reused, an order id is free again once its order is filled or cancelled
+            const int orderId = operation % 5000;
+            const Orderside side = operation % 2 ? Orderside::buy : Orderside::sell;
+            const int price = std::max(1, int(std::lround(priceDistribution(gen))));
+            const bool free = listener.live.count({clientId, orderId}) == 0;
+            assert_equal(book.add_order(side, clientId, orderId, price, quantityDistribution(gen), listener), free);
+            placed.emplace_back(clientId, orderId);
+        }
+        if(operation % 997 == 0)
+        {
+            const OrderbookStats stats = book.stats();
+            assert_equal(stats.restingOrders, listener.live.size());
+            assert_equal(stats.indexedOrders, listener.live.size());
+            assert_equal(stats.allocatedNodes, listener.live.size());
+            peak = std::max(peak, listener.live.size());
+        }
+    }
+    // memory follows the resting book, not the orders placed so far
+    assert(peak < size_t(operations) / 10, "the book should stay small");
+
+    // a filled order can not be cancelled any more and its id can be reused
+    book.flush();
+    listener.live.clear();
+    assert(book.add_order(Orderside::sell, 1, 1, 100, 10, listener), "order should rest");
+    assert(book.add_order(Orderside::buy, 2, 1, 100, 10, listener), "order should fill");
+    assert(!book.cancel_order(1, 1, listener), "filled order should not be cancelled");
+    assert(book.add_order(Orderside::sell, 1, 1, 100, 10, listener), "filled order id should be free");
+    const OrderbookStats stats = book.stats();
+    assert_equal(stats.restingOrders, size_t(1));
+    assert_equal(stats.indexedOrders, size_t(1));
+    assert_equal(stats.allocatedNodes, size_t(1));
+    return 0;
+}
+
+int orderbook_test_stats(const OrderbookConfig& config)
+{
+    Orderbook book(config);
+    OrderbookListener listener;
+    book.add_order(Orderside::buy, 1, 1, 10, 100, listener);
+    book.add_order(Orderside::buy, 1, 2, 10, 50, listener);
+    book.add_order(Orderside::buy, 1, 3, 9, 10, listener);
+    book.add_order(Orderside::buy, 1, 1, 8, 10, listener);
+    book.add_order(Orderside::sell, 2, 2, 11, 5, listener);
+
+    OrderbookStats stats = book.stats();
+    assert_equal(stats.bidLevels, size_t(2));
+    assert_equal(stats.askLevels, size_t(1));
+    assert_equal(stats.restingOrders, size_t(4));
+    assert(stats.bytesReserved > 0, "arena should hold the orders");
+
+    // sweeps both bid levels
+    book.add_order(Orderside::sell, 2, 1, 9, 160, listener);
+    book.cancel_order(2, 2, listener);
+    book.cancel_order(2, 2, listener);
+
+    stats = book.stats();
+    assert_equal(stats.bidLevels, size_t(0));
+    assert_equal(stats.askLevels, size_t(0));
+    assert_equal(stats.restingOrders, size_t(0));
+    const OrderbookCounters& counters = stats.counters;
+    if(ORDERBOOK_STATS)
+    {
+        assert_equal(counters.adds, uint64_t(6));
+        assert_equal(counters.duplicates, uint64_t(1));
+        assert_equal(counters.ordersRested, uint64_t(4));
+        assert_equal(counters.levelsCreated, uint64_t(3));
+        assert_equal(counters.aggressiveOrders, uint64_t(1));
+        assert_equal(counters.fills, uint64_t(3));
+        assert_equal(counters.levelsSwept, uint64_t(2));
+        assert_equal(counters.cancels, uint64_t(2));
+        assert_equal(counters.cancelMisses, uint64_t(1));
+    }
+    else
+    {
+        assert_equal(counters.adds, uint64_t(0));
+        assert_equal(counters.fills, uint64_t(0));
+    }
+    assert_equal(counters.lockContended, uint64_t(0));
+    return 0;
+}
+
+// records every event of the book
+struct EventLog : OrderbookListener
 {
-    Orderbook book;
+    std::vector<std::vector<int>> events;
+    void on_fill(Orderside side, int a, int b, int c, int d, int p, int q) { events.push_back({0, int(side), a, b, c, d, p, q}); }
+    void on_filled(Orderside side, int clientId, int orderId) { events.push_back({1, int(side), clientId, orderId}); }
+    void on_add(Orderside side, int clientId, int orderId, int p, int q) { events.push_back({2, int(side), clientId, orderId, p, q}); }
+    void on_cancel(Orderside side, int clientId, int orderId, int p, int q) { events.push_back({3, int(side), clientId, orderId, p, q}); }
+    void on_top_of_book(Orderside side, int p, int q) { events.push_back({4, int(side), p, q}); }
+    void on_modify(Orderside side, int clientId, int orderId, int p, int q) { events.push_back({5, int(side), clientId, orderId, p, q}); }
+    void on_expired(Orderside side, int clientId, int orderId, int q) { events.push_back({6, int(side), clientId, orderId, q}); }
+    void on_replenish(Orderside side, int clientId, int orderId, int p, int q) { events.push_back({7, int(side), clientId, orderId, p, q}); }
+    void on_triggered(Orderside side, int clientId, int orderId, int p, int q) { events.push_back({8, int(side), clientId, orderId, p, q}); }
+};
+
+int orderbook_test_apply_batch(const OrderbookConfig& config)
+{
+    std::mt19937 gen{17};
+    std::vector<BookCommand> commands;
+    for(int index = 0; index < 20000; ++index)
+    {
+        BookCommand command;
+        const int kind = gen() % 10;
+        command.type = kind < 6 ? BookCommand::Type::add : kind < 9 ? BookCommand::Type::cancel : BookCommand::Type::modify;
+        command.side = gen() % 2 ? Orderside::buy : Orderside::sell;
+        command.clientId = 1 + gen() % 3;
+        command.orderId = int(gen() % 2000);
+        command.price = gen() % 20 == 0 ? 0 : 90 + int(gen() % 20);
+        command.quantity = 1 + int(gen() % 100);
+        command.timeInForce = TimeInForce(gen() % 3);
+        commands.push_back(command);
+    }
+
+    Orderbook single(config);
+    EventLog singleEvents;
+    std::vector<bool> singleResults;
+    for(const BookCommand& command : commands)
+    {
+        switch(command.type)
+        {
+        case BookCommand::Type::add:
+            singleResults.push_back(single.add_order(command.side, command.clientId, command.orderId, command.price, command.quantity, singleEvents, command.timeInForce));
+            break;
+        case BookCommand::Type::cancel:
+            singleResults.push_back(single.cancel_order(command.clientId, command.orderId, singleEvents));
+            break;
+        case BookCommand::Type::modify:
+            singleResults.push_back(single.modify_order(command.clientId, command.orderId, command.price, command.quantity, singleEvents));
+            break;
+        }
+    }
+
+    Orderbook batched(config);
+    EventLog batchedEvents;
+    std::unique_ptr<bool[]> batchedResults(new bool[commands.size()]);
+    size_t accepted = 0;
+    // batches of uneven sizes
+    for(size_t begin = 0, size = 1; begin < commands.size(); begin += size, size = size * 2 % 61 + 1)
+    {
+        size = std::min(size, commands.size() - begin);
+        accepted += batched.apply_batch(commands.data() + begin, size, batchedEvents, batchedResults.get() + begin);
+    }
+
+    assert_equal(accepted, size_t(std::count(singleResults.begin(), singleResults.end(), true)));
+    for(size_t index = 0; index < commands.size(); ++index)
+        assert_equal(batchedResults[index], bool(singleResults[index]));
+    assert(batchedEvents.events == singleEvents.events, "batch should produce the same events");
+    assert_equal(batched.get_max_bid(), single.get_max_bid());
+    assert_equal(batched.get_min_ask(), single.get_min_ask());
+    return 0;
+}
+
+int orderbook_test_modify_order(const OrderbookConfig& config)
+{
+    Orderbook book(config);
+    EventLog log;
+    book.add_order(Orderside::buy, 1, 1, 100, 10, log);
+    book.add_order(Orderside::buy, 1, 2, 100, 10, log);
+
+    // a smaller quantity keeps the time priority
+    log.events.clear();
+    assert(book.modify_order(1, 1, 100, 4, log), "modify should be accepted");
+    assert(log.events == std::vector<std::vector<int>>({{5, int(Orderside::buy), 1, 1, 100, 4}, {4, int(Orderside::buy), 100, 14}}), "size down should be modified in place");
+    log.events.clear();
+    book.add_order(Orderside::sell, 2, 1, 100, 5, log);
+    assert_equal(log.events[0], std::vector<int>({0, int(Orderside::sell), 1, 1, 2, 1, 100, 4}));
+    assert_equal(log.events[2], std::vector<int>({0, int(Orderside::sell), 1, 2, 2, 1, 100, 1}));
+
+    // a larger quantity goes to the back of the queue
+    book.add_order(Orderside::buy, 1, 3, 100, 10, log);
+    assert(book.modify_order(1, 2, 100, 20, log), "modify should be accepted");
+    log.events.clear();
+    book.add_order(Orderside::sell, 2, 2, 100, 5, log);
+    assert_equal(log.events[0], std::vector<int>({0, int(Orderside::sell), 1, 3, 2, 2, 100, 5}));
+
+    // a new price crossing the other side matches first, the top of book is reported once per side
+    book.add_order(Orderside::sell, 2, 3, 101, 5, log);
+    log.events.clear();
+    assert(book.modify_order(1, 3, 101, 8, log), "modify should be accepted");
+    const std::vector<std::vector<int>> moved = {
+        {3, int(Orderside::buy), 1, 3, 100, 5},
+        {0, int(Orderside::buy), 2, 3, 1, 3, 101, 5},
+        {1, int(Orderside::sell), 2, 3},
+        {2, int(Orderside::buy), 1, 3, 101, 3},
+        {4, int(Orderside::sell), -1, -1},
+        {4, int(Orderside::buy), 101, 3}};
+    assert(log.events == moved, "a moved order should be cancelled, matched and added back");
+    assert_equal(book.get_max_bid(), std::make_pair(101, 3));
+
+    // an order filled while moving leaves the book
+    book.add_order(Orderside::sell, 2, 4, 102, 10, log);
+    assert(book.modify_order(1, 3, 102, 3, log), "modify should be accepted");
+    assert(!book.cancel_order(1, 3, log), "filled order should leave the book");
+    assert_equal(book.get_min_ask(), std::make_pair(102, 7));
+
+    // invalid modifies leave the book untouched
+    log.events.clear();
+    assert(!book.modify_order(9, 9, 100, 1, log), "unknown order should be refused");
+    assert(!book.modify_order(1, 2, 0, 1, log), "market price should be refused");
+    assert(!book.modify_order(1, 2, 100, 0, log), "empty quantity should be refused");
+    assert(book.modify_order(1, 2, 100, 20, log), "unchanged order should be accepted");
+    assert(log.events.empty(), "refused modifies should not report events");
+
+    // random modifies keep the levels, the depth and the order index consistent
+    std::mt19937 gen{23};
+    for(int operation = 0; operation < 50000; ++operation)
+    {
+        const int clientId = 1 + int(gen() % 3);
+        const int orderId = int(gen() % 500);
+        const int price = 90 + int(gen() % 20);
+        const int quantity = 1 + int(gen() % 50);
+        switch(gen() % 4)
+        {
+        case 0:
+        case 1:
+            book.add_order(gen() % 2 ? Orderside::buy : Orderside::sell, clientId, orderId, price, quantity, log);
+            break;
+        case 2:
+            book.cancel_order(clientId, orderId, log);
+            break;
+        default:
+            // mostly size downs
+            book.modify_order(clientId, orderId, gen() % 3 ? price : 0, quantity, log);
+            book.modify_order(clientId, orderId, price, quantity, log);
+            break;
+        }
+        log.events.clear();
+        if(operation % 101 == 0)
+        {
+            std::vector<RestingOrder> orders;
+            book.export_orders(orders);
+            std::map<int, int> asks, bids;
+            for(const RestingOrder& order : orders)
+                (order.side == Orderside::sell ? asks : bids)[order.price] += order.quantity;
+            DepthLevel depth[MaxDepth];
+            const size_t askCount = book.depth(Orderside::sell, MaxDepth, depth);
+            assert_equal(askCount, std::min(asks.size(), MaxDepth));
+            for(size_t index = 0; index < askCount; ++index)
+            {
+                const std::pair<int, int> level = *std::next(asks.begin(), index);
+                assert_equal(std::make_pair(depth[index].price, depth[index].quantity), level);
+            }
+            const size_t bidCount = book.depth(Orderside::buy, MaxDepth, depth);
+            assert_equal(bidCount, std::min(bids.size(), MaxDepth));
+            for(size_t index = 0; index < bidCount; ++index)
+            {
+                const std::pair<int, int> level = *std::next(bids.rbegin(), index);
+                assert_equal(std::make_pair(depth[index].price, depth[index].quantity), level);
+            }
+            const OrderbookStats stats = book.stats();
+            assert_equal(stats.restingOrders, orders.size());
+            assert_equal(stats.indexedOrders, orders.size());
+            assert_equal(stats.allocatedNodes, orders.size());
+        }
+    }
+    return 0;
+}
+
+int orderbook_test_time_in_force(const OrderbookConfig& config)
+{
+    // a ladder narrower than the prices so that the liquidity is summed over ladder and tree levels
+    OrderbookConfig narrow = config;
+    narrow.ladderTicks = 64;
+    Orderbook book(narrow);
+    EventLog log;
+    book.add_order(Orderside::sell, 1, 1, 101, 10, log);
+    book.add_order(Orderside::sell, 1, 2, 102, 10, log);
+
+    // not enough at 101, killed without touching the book
+    log.events.clear();
+    const TopOfBook top = book.top_of_book();
+    assert(!book.add_order(Orderside::buy, 2, 1, 101, 11, log, TimeInForce::fok), "order should be killed");
+    assert(log.events == std::vector<std::vector<int>>({{6, int(Orderside::buy), 2, 1, 11}}), "a killed order should only expire");
+    assert_equal(book.top_of_book().sequence, top.sequence);
+
+    // enough up to 102
+    assert(book.add_order(Orderside::buy, 2, 2, 102, 15, log, TimeInForce::fok), "order should fill");
+    assert_equal(book.get_min_ask(), std::make_pair(102, 5));
+
+    // the rest of an immediate or cancel order does not rest
+    log.events.clear();
+    assert(book.add_order(Orderside::buy, 2, 3, 102, 10, log, TimeInForce::ioc), "order should trade");
+    assert_equal(log.events[0], std::vector<int>({0, int(Orderside::buy), 1, 2, 2, 3, 102, 5}));
+    assert_equal(log.events[2], std::vector<int>({6, int(Orderside::buy), 2, 3, 5}));
+    assert_equal(book.get_max_bid(), std::make_pair(-1, -1));
+    assert(!book.cancel_order(2, 3, log), "expired order should not rest");
+    assert(!book.add_order(Orderside::sell, 2, 4, 100, 10, log, TimeInForce::ioc), "order without trade should be refused");
+    assert_equal(book.get_min_ask(), std::make_pair(-1, -1));
+
+    // market fill or kill orders take any price
+    book.add_order(Orderside::buy, 1, 3, 50, 10, log);
+    book.add_order(Orderside::buy, 1, 4, 300, 10, log);
+    assert(!book.add_order(Orderside::sell, 2, 5, 0, 21, log, TimeInForce::fok), "order should be killed");
+    assert(book.add_order(Orderside::sell, 2, 6, 0, 20, log, TimeInForce::fok), "order should fill");
+    assert_equal(book.get_max_bid(), std::make_pair(-1, -1));
+
+    // fill or kill orders against the quantity summed from the exported orders
+    std::mt19937 gen{29};
+    for(int operation = 0; operation < 20000; ++operation)
+    {
+        const Orderside side = gen() % 2 ? Orderside::buy : Orderside::sell;
+        const int clientId = 1 + int(gen() % 3);
+        const int orderId = int(gen() % 1000);
+        // prices drift so that the ladder window is recentered and outliers go to the tree
+        const int price = 1 + int((gen() % 150) + operation / 100);
+        const int quantity = 1 + int(gen() % 300);
+        switch(gen() % 5)
+        {
+        case 0:
+        case 1:
+            book.add_order(side, clientId, orderId, price + (side == Orderside::buy ? -20 : 20), quantity, log);
+            break;
+        case 2:
+            book.cancel_order(clientId, orderId, log);
+            break;
+        case 3:
+            book.modify_order(clientId, orderId, price, quantity, log);
+            break;
+        default:
+        {
+            std::vector<RestingOrder> before;
+            book.export_orders(before);
+            const int limit = gen() % 10 ? price : 0;
+            long long available = 0;
+            for(const RestingOrder& order : before)
+            {
+                if(order.side != side && (limit == 0 || (side == Orderside::buy ? order.price <= limit : order.price >= limit)))
+                    available += order.quantity;
+            }
+            const bool filled = book.add_order(side, 4, operation, limit, quantity, log, TimeInForce::fok);
+            assert_equal(filled, available >= quantity);
+            std::vector<RestingOrder> after;
+            book.export_orders(after);
+            if(!filled)
+                assert_equal(after.size(), before.size());
+            assert(!book.cancel_order(4, operation, log), "fill or kill order should not rest");
+        }
+        break;
+        }
+        log.events.clear();
+    }
+
+    // tree levels over the whole price range, summed without walking them
+    OrderbookConfig treeConfig = config;
+    treeConfig.backend = LevelsBackend::tree;
+    Orderbook tree(treeConfig);
+    const int highest = std::numeric_limits<int>::max();
+    for(int round = 0; round < 2; ++round)
+    {
+        for(int level = 0; level < 1000; ++level)
+            tree.add_order(Orderside::sell, 1, level, 1000 + level * 1000, 10, log);
+        tree.add_order(Orderside::sell, 1, 1000, highest, 5, log);
+        tree.add_iceberg_order(Orderside::buy, 2, 1, 1, 30, 10, log);
+        tree.add_order(Orderside::buy, 2, 2, 2, 10, log);
+        assert(!tree.add_order(Orderside::buy, 3, 1, 1000 + 499 * 1000, 5001, log, TimeInForce::fok), "order should be killed");
+        assert(tree.add_order(Orderside::buy, 3, 2, 1000 + 499 * 1000, 5000, log, TimeInForce::fok), "order should fill");
+        assert(!tree.add_order(Orderside::buy, 3, 3, highest - 1, 5001, log, TimeInForce::fok), "order should be killed");
+        assert(!tree.add_order(Orderside::buy, 3, 4, 0, 5006, log, TimeInForce::fok), "order should be killed");
+        assert(tree.add_order(Orderside::buy, 3, 5, 0, 5005, log, TimeInForce::fok), "order should fill");
+        assert_equal(tree.get_min_ask(), std::make_pair(-1, -1));
+        // the hidden quantity of the iceberg is summed with the levels
+        assert(!tree.add_order(Orderside::sell, 3, 6, 2, 11, log, TimeInForce::fok), "order should be killed");
+        assert(!tree.add_order(Orderside::sell, 3, 7, 1, 41, log, TimeInForce::fok), "order should be killed");
+        assert(tree.add_order(Orderside::sell, 3, 8, 1, 40, log, TimeInForce::fok), "order should fill");
+        assert_equal(tree.get_max_bid(), std::make_pair(-1, -1));
+        tree.add_order(Orderside::buy, 2, 3, 7, 10, log);
+        tree.flush();
+        assert(!tree.add_order(Orderside::sell, 3, 9, 0, 1, log, TimeInForce::fok), "flushed book should be empty");
+    }
+    return 0;
+}
+
+int orderbook_test_iceberg(const OrderbookConfig& config)
+{
+    Orderbook book(config);
+    EventLog log;
+    assert(book.add_iceberg_order(Orderside::sell, 1, 1, 100, 100, 10, log), "iceberg should rest");
+    book.add_order(Orderside::sell, 1, 2, 100, 5, log);
+    // only the displayed slice is in the level
+    assert_equal(book.get_min_ask(), std::make_pair(100, 15));
+
+    // the filled slice is replenished at the back of the queue, behind the other order
+    log.events.clear();
+    book.add_order(Orderside::buy, 2, 1, 100, 12, log);
+    const std::vector<std::vector<int>> sliced = {
+        {0, int(Orderside::buy), 1, 1, 2, 1, 100, 10},
+        {7, int(Orderside::sell), 1, 1, 100, 10},
+        {0, int(Orderside::buy), 1, 2, 2, 1, 100, 2},
+        {4, int(Orderside::sell), 100, 13}};
+    assert(log.events == sliced, "slice should be filled and replenished");
+
+    // a sweep goes around the queue again while quantity is left
+    log.events.clear();
+    book.add_order(Orderside::buy, 2, 2, 100, 30, log);
+    std::vector<int> fills;
+    for(const auto& event : log.events)
+    {
+        if(event[0] == 0)
+            fills.push_back(event[7]);
+    }
+    assert_equal(fills, std::vector<int>({3, 10, 10, 7}));
+    assert_equal(book.get_min_ask(), std::make_pair(100, 3));
+
+    // hidden quantity counts as liquidity
+    assert(!book.add_order(Orderside::buy, 2, 3, 100, 64, log, TimeInForce::fok), "order should be killed");
+    assert(book.add_order(Orderside::buy, 2, 4, 100, 63, log, TimeInForce::fok), "order should fill the iceberg");
+    assert(!book.cancel_order(1, 1, log), "filled iceberg should leave the book");
+    assert_equal(book.get_min_ask(), std::make_pair(-1, -1));
+
+    // a reduced iceberg loses hidden quantity first and keeps its priority
+    book.add_iceberg_order(Orderside::buy, 1, 3, 90, 50, 20, log);
+    book.add_order(Orderside::buy, 1, 4, 90, 5, log);
+    assert(book.modify_order(1, 3, 90, 25, log), "modify should be accepted");
+    assert_equal(book.get_max_bid(), std::make_pair(90, 25));
+    assert(book.modify_order(1, 3, 90, 15, log), "modify should be accepted");
+    assert_equal(book.get_max_bid(), std::make_pair(90, 20));
+    log.events.clear();
+    book.add_order(Orderside::sell, 2, 5, 90, 16, log);
+    assert_equal(log.events[0], std::vector<int>({0, int(Orderside::sell), 1, 3, 2, 5, 90, 15}));
+    assert(!book.cancel_order(1, 3, log), "filled iceberg should leave the book");
+
+    // a sweep through many small slices
+    Orderbook deep(config);
+    OrderbookListener quiet;
+    deep.add_iceberg_order(Orderside::sell, 1, 1, 100, 100000, 1, quiet);
+    deep.add_iceberg_order(Orderside::sell, 1, 2, 100, 100000, 3, quiet);
+    const auto start = std::chrono::steady_clock::now();
+    assert(deep.add_order(Orderside::buy, 2, 1, 100, 200000, quiet), "order should fill both icebergs");
+    const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    std::cout << "200000 quantity swept through 1 and 3 lots slices in " << seconds * 1e3 << " ms" << std::endl;
+    assert_equal(deep.get_min_ask(), std::make_pair(-1, -1));
+    if(ORDERBOOK_STATS)
+        assert_equal(deep.stats().counters.replenishments, uint64_t(99999 + 33333));
+    assert_equal(deep.stats().allocatedNodes, size_t(0));
+
+    // random flow with icebergs: levels, depth, liquidity and exported orders stay consistent
+    Orderbook random(config);
+    std::mt19937 gen{31};
+    for(int operation = 0; operation < 30000; ++operation)
+    {
+        const Orderside side = gen() % 2 ? Orderside::buy : Orderside::sell;
+        const int clientId = 1 + int(gen() % 3);
+        const int orderId = int(gen() % 500);
+        const int price = 90 + int(gen() % 20);
+        const int quantity = 1 + int(gen() % 200);
+        switch(gen() % 6)
+        {
+        case 0:
+            random.add_order(side, clientId, orderId, price, quantity, log);
+            break;
+        case 1:
+        case 2:
+            random.add_iceberg_order(side, clientId, orderId, price, quantity, 1 + int(gen() % 20), log);
+            break;
+        case 3:
+            random.cancel_order(clientId, orderId, log);
+            break;
+        case 4:
+            random.modify_order(clientId, orderId, gen() % 2 ? price : 0, quantity, log);
+            random.modify_order(clientId, orderId, price, quantity / 2 + 1, log);
+            break;
+        default:
+        {
+            std::vector<RestingOrder> orders;
+            random.export_orders(orders);
+            long long available = 0;
+            for(const RestingOrder& order : orders)
+            {
+                if(order.side != side && (side == Orderside::buy ? order.price <= price : order.price >= price))
+                    available += order.quantity + order.hidden;
+            }
+            assert_equal(random.add_order(side, 4, operation, price, quantity, log, TimeInForce::fok), available >= quantity);
+        }
+        break;
+        }
+        log.events.clear();
+        if(operation % 97 == 0)
+        {
+            std::vector<RestingOrder> orders;
+            random.export_orders(orders);
+            std::map<int, int> asks, bids;
+            for(const RestingOrder& order : orders)
+            {
+                (order.side == Orderside::sell ? asks : bids)[order.price] += order.quantity;
+                assert(order.hidden == 0 || (order.quantity <= order.display && order.display > 0), "slice should not exceed the display");
+            }
+            const std::pair<int, int> minAsk = asks.empty() ? std::make_pair(-1, -1) : std::make_pair(asks.begin()->first, asks.begin()->second);
+            const std::pair<int, int> maxBid = bids.empty() ? std::make_pair(-1, -1) : std::make_pair(bids.rbegin()->first, bids.rbegin()->second);
+            assert_equal(random.get_min_ask(), minAsk);
+            assert_equal(random.get_max_bid(), maxBid);
+            assert_equal(random.stats().indexedOrders, orders.size());
+
+            // restored orders rebuild the same book, reserves included
+            Orderbook restored(config);
+            for(const RestingOrder& order : orders)
+                assert(restored.restore_order(order), "order should be restored");
+            std::vector<RestingOrder> again;
+            restored.export_orders(again);
+            assert_equal(again.size(), orders.size());
+            for(size_t index = 0; index < orders.size(); ++index)
+            {
+                assert_equal(again[index].orderId, orders[index].orderId);
+                assert_equal(again[index].quantity, orders[index].quantity);
+                assert_equal(again[index].hidden, orders[index].hidden);
+                assert_equal(again[index].display, orders[index].display);
+            }
+        }
+    }
+    return 0;
+}
+
+// fills and triggered stops of the events, in order
+std::vector<std::vector<int>> trades(const EventLog& log)
+{
+    std::vector<std::vector<int>> trades;
+    for(const auto& event : log.events)
+    {
+        if(event[0] == 0 || event[0] == 8)
+            trades.push_back(event);
+    }
+    return trades;
+}
+
+int orderbook_test_stop_orders(const OrderbookConfig& config)
+{
+    Orderbook book(config);
+    EventLog log;
+    book.add_order(Orderside::sell, 1, 1, 100, 10, log);
+    book.add_order(Orderside::sell, 1, 2, 101, 10, log);
+    book.add_order(Orderside::sell, 1, 3, 102, 10, log);
+    book.add_order(Orderside::buy, 1, 4, 98, 10, log);
+    assert(book.add_stop_order(Orderside::buy, 2, 1, 101, 0, 5), "stop should be pending");
+    assert(book.add_stop_order(Orderside::buy, 2, 2, 102, 102, 15), "stop limit should be pending");
+    assert(book.add_stop_order(Orderside::sell, 2, 3, 97, 97, 5), "stop limit should be pending");
+    assert(book.add_stop_order(Orderside::sell, 2, 4, 99, 0, 3), "stop should be pending");
+    assert(!book.add_stop_order(Orderside::buy, 2, 1, 103, 0, 5), "pending stop should not be added twice");
+    assert(!book.add_order(Orderside::buy, 2, 1, 90, 5, log), "pending stop should not be added twice");
+    assert(!book.add_stop_order(Orderside::buy, 2, 5, 0, 0, 5), "stop price should be positive");
+    assert_equal(book.stats().pendingStops, size_t(4));
+    assert_equal(book.stats().restingOrders, size_t(4));
+
+    // a pending stop is cancelled with its limit price
+    log.events.clear();
+    assert(book.cancel_order(2, 4, log), "pending stop should be cancelled");
+    assert_equal(log.events, std::vector<std::vector<int>>({{3, int(Orderside::sell), 2, 4, 0, 3}}));
+    assert(!book.cancel_order(2, 4, log), "stop should be cancelled once");
+
+    // a trade below the stop price does not trigger it
+    log.events.clear();
+    book.add_order(Orderside::buy, 3, 1, 100, 10, log);
+    assert_equal(trades(log).size(), size_t(1));
+
+    // the stop is triggered by the trade at its price and executed right after it, in the same operation
+    log.events.clear();
+    book.add_order(Orderside::buy, 3, 2, 101, 1, log);
+    const std::vector<std::vector<int>> stopped = {
+        {0, int(Orderside::buy), 1, 2, 3, 2, 101, 1},
+        {8, int(Orderside::buy), 2, 1, 0, 5},
+        {0, int(Orderside::buy), 1, 2, 2, 1, 101, 5}};
+    assert_equal(trades(log), stopped);
+    assert_equal(book.get_min_ask(), std::make_pair(101, 4));
+
+    // a stop limit order rests what it can not fill at its limit price
+    log.events.clear();
+    book.add_order(Orderside::buy, 3, 3, 102, 5, log);
+    const std::vector<std::vector<int>> limited = {
+        {0, int(Orderside::buy), 1, 2, 3, 3, 101, 4},
+        {0, int(Orderside::buy), 1, 3, 3, 3, 102, 1},
+        {8, int(Orderside::buy), 2, 2, 102, 15},
+        {0, int(Orderside::buy), 1, 3, 2, 2, 102, 9}};
+    assert_equal(trades(log), limited);
+    assert_equal(book.get_max_bid(), std::make_pair(102, 6));
+    assert_equal(book.get_min_ask(), std::make_pair(-1, -1));
+
+    // sell stops are triggered by a trade at or below their price
+    book.add_order(Orderside::sell, 3, 4, 97, 16, log);
+    assert_equal(book.stats().pendingStops, size_t(1));
+    book.add_order(Orderside::buy, 1, 5, 97, 10, log);
+    log.events.clear();
+    book.add_order(Orderside::sell, 3, 5, 97, 1, log);
+    assert_equal(trades(log).size(), size_t(3));
+    assert_equal(book.get_max_bid(), std::make_pair(97, 4));
+    assert_equal(book.stats().pendingStops, size_t(0));
+    if(ORDERBOOK_STATS)
+        assert_equal(book.stats().counters.stopsTriggered, uint64_t(3));
+
+    // a cascade where every triggered stop trades one level lower and triggers the next one
+    Orderbook cascade(config);
+    OrderbookListener quiet;
+    const int levels = 20000;
+    for(int price = 1; price <= levels; ++price)
+        cascade.add_order(Orderside::buy, 1, price, price, 1, quiet);
+    for(int price = 2; price <= levels; ++price)
+        cascade.add_stop_order(Orderside::sell, 2, price, price, 0, 1);
+    // far stops are never looked at
+    for(int stop = 0; stop < 10000; ++stop)
+        cascade.add_stop_order(Orderside::buy, 3, stop, levels + 1 + stop, 0, 1);
+    const auto start = std::chrono::steady_clock::now();
+    cascade.add_order(Orderside::sell, 4, 1, levels, 1, quiet);
+    const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    std::cout << levels - 1 << " stops triggered in cascade in " << seconds * 1e3 << " ms" << std::endl;
+    assert_equal(cascade.get_max_bid(), std::make_pair(-1, -1));
+    assert_equal(cascade.stats().pendingStops, size_t(10000));
+    if(ORDERBOOK_STATS)
+        assert_equal(cascade.stats().counters.stopsTriggered, uint64_t(levels - 1));
+
+    // random flow: a stop is triggered only after a trade reaching it, and none reached stays pending
+    Orderbook random(config);
+    std::map<std::pair<int, int>, std::pair<Orderside, int>> pending; // (clientId, orderId) -> side, stop price
+    std::mt19937 gen{47};
+    for(int operation = 0; operation < 30000; ++operation)
+    {
+        const Orderside side = gen() % 2 ? Orderside::buy : Orderside::sell;
+        const int clientId = 1 + int(gen() % 3);
+        const int orderId = int(gen() % 300);
+        const int price = 90 + int(gen() % 20);
+        log.events.clear();
+        switch(gen() % 4)
+        {
+        case 0:
+        {
+            const int stopPrice = 90 + int(gen() % 20);
+            if(random.add_stop_order(side, clientId, orderId, stopPrice, gen() % 3 ? price : 0, 1 + int(gen() % 30)))
+                pending[{clientId, orderId}] = {side, stopPrice};
+        }
+        break;
+        case 1:
+            if(random.cancel_order(clientId, orderId, log))
+                pending.erase({clientId, orderId});
+            break;
+        default:
+            random.add_order(side, clientId, orderId, price, 1 + int(gen() % 40), log);
+            break;
+        }
+        int low = std::numeric_limits<int>::max(), high = 0;
+        for(const auto& event : log.events)
+        {
+            if(event[0] == 0)
+            {
+                low = std::min(low, event[6]);
+                high = std::max(high, event[6]);
+            }
+            else if(event[0] == 8)
+            {
+                const auto stop = pending.find({event[2], event[3]});
+                assert(stop != pending.end(), "triggered stop should be pending");
+                const bool reached = stop->second.first == Orderside::buy ? high >= stop->second.second : low <= stop->second.second;
+                assert(reached, "stop should be triggered by a trade before it");
+                pending.erase(stop);
+            }
+        }
+        for(const auto& stop : pending)
+        {
+            const bool reached = stop.second.first == Orderside::buy ? high >= stop.second.second : low <= stop.second.second;
+            assert(!reached, "stop reached by a trade should be triggered");
+        }
+        assert_equal(random.stats().pendingStops, pending.size());
+    }
+    if(ORDERBOOK_STATS)
+        assert(random.stats().counters.stopsTriggered > 1000, "random flow should trigger stops");
+    return 0;
+}
+
+// events of an operation with the level changes, code 9
+struct LevelLog : EventLog
+{
+    void on_level(Orderside side, int p, int q) { events.push_back({9, int(side), p, q}); }
+
+    // events of code of the last operation
+    std::vector<std::vector<int>> of(int code) const
+    {
+        std::vector<std::vector<int>> found;
+        for(const auto& event : events)
+        {
+            if(event[0] == code)
+                found.push_back(event);
+        }
+        return found;
+    }
+    // the changes are reported once the operation is done, levels first
+    void check_order() const
+    {
+        int previous = 0;
+        for(const auto& event : events)
+        {
+            if(previous == 9 || previous == 4)
+                assert(event[0] == 9 || event[0] == 4, "levels should be reported at the end of the operation");
+            assert(!(previous == 4 && event[0] == 9), "levels should come before the top of book");
+            previous = event[0];
+        }
+    }
+};
+
+int orderbook_test_coalesced_events(const OrderbookConfig& config)
+{
+    Orderbook book(config);
+    LevelLog log;
+
+    // a larger quantity at the same price moves the order to the back of its level: one change of the level
+    book.add_order(Orderside::buy, 1, 1, 100, 10, log);
+    log.events.clear();
+    assert(book.modify_order(1, 1, 100, 40, log), "order should be modified");
+    log.check_order();
+    assert_equal(log.of(9), std::vector<std::vector<int>>({{9, int(Orderside::buy), 100, 40}}));
+    assert_equal(log.of(4), std::vector<std::vector<int>>({{4, int(Orderside::buy), 100, 40}}));
+    // with another order in the level, and to another price
+    book.add_order(Orderside::buy, 2, 1, 100, 5, log);
+    log.events.clear();
+    assert(book.modify_order(1, 1, 100, 50, log), "order should be modified");
+    assert_equal(log.of(9), std::vector<std::vector<int>>({{9, int(Orderside::buy), 100, 55}}));
+    log.events.clear();
+    assert(book.modify_order(1, 1, 101, 50, log), "order should be modified");
+    log.check_order();
+    assert_equal(log.of(9), std::vector<std::vector<int>>({{9, int(Orderside::buy), 100, 5}, {9, int(Orderside::buy), 101, 50}}));
+    assert_equal(log.of(4), std::vector<std::vector<int>>({{4, int(Orderside::buy), 101, 50}}));
+    book.flush();
+
+    // a cascade of stops sweeping the bids reports each level and the top of book once
+    book.add_order(Orderside::buy, 1, 1, 100, 10, log);
+    book.add_order(Orderside::buy, 1, 2, 99, 10, log);
+    book.add_order(Orderside::buy, 1, 3, 98, 10, log);
+    book.add_order(Orderside::buy, 1, 4, 97, 10, log);
+    assert(book.add_stop_order(Orderside::sell, 2, 1, 100, 0, 10), "stop should be pending");
+    assert(book.add_stop_order(Orderside::sell, 2, 2, 99, 0, 10), "stop should be pending");
+    assert(book.add_stop_order(Orderside::sell, 2, 3, 98, 98, 15), "stop limit should be pending");
+    log.events.clear();
+    book.add_order(Orderside::sell, 3, 1, 100, 10, log);
+    log.check_order();
+    assert_equal(log.of(8).size(), size_t(3));
+    assert_equal(log.of(9), std::vector<std::vector<int>>({
+        {9, int(Orderside::buy), 100, 0},
+        {9, int(Orderside::buy), 99, 0},
+        {9, int(Orderside::buy), 98, 0},
+        {9, int(Orderside::sell), 98, 15}}));
+    assert_equal(log.of(4), std::vector<std::vector<int>>({{4, int(Orderside::sell), 98, 15}, {4, int(Orderside::buy), 97, 10}}));
+    book.flush();
+
+    // an iceberg swept several times within one order
+    assert(book.add_iceberg_order(Orderside::sell, 1, 1, 100, 100, 10, log), "iceberg should rest");
+    book.add_order(Orderside::sell, 2, 1, 100, 10, log);
+    book.add_order(Orderside::sell, 2, 2, 101, 10, log);
+    log.events.clear();
+    book.add_order(Orderside::buy, 3, 1, 100, 55, log);
+    log.check_order();
+    assert(log.of(7).size() > 1, "iceberg should be replenished several times");
+    assert_equal(book.get_min_ask(), std::make_pair(100, 5));
+    assert_equal(log.of(9), std::vector<std::vector<int>>({{9, int(Orderside::sell), 100, 5}}));
+    assert_equal(log.of(4), std::vector<std::vector<int>>({{4, int(Orderside::sell), 100, 5}}));
+    // swept through to the next level
+    log.events.clear();
+    book.add_order(Orderside::buy, 3, 2, 101, 60, log);
+    assert_equal(log.of(9), std::vector<std::vector<int>>({{9, int(Orderside::sell), 100, 0}, {9, int(Orderside::sell), 101, 5}}));
+    assert_equal(log.of(4), std::vector<std::vector<int>>({{4, int(Orderside::sell), 101, 5}}));
+
+    // many changes, the iceberg level is swept once per slice
+    book.flush();
+    assert(book.add_iceberg_order(Orderside::sell, 1, 1, 100, 100, 10, log), "iceberg should rest");
+    for(int price = 101; price <= 109; ++price)
+        book.add_order(Orderside::sell, 2, price, price, 10, log);
+    log.events.clear();
+    book.add_order(Orderside::buy, 3, 3, 110, 150, log);
+    log.check_order();
+    assert_equal(log.of(7).size(), size_t(9));
+    std::vector<std::vector<int>> swept;
+    for(int price = 100; price <= 105; ++price)
+        swept.push_back({9, int(Orderside::sell), price, 0});
+    assert_equal(log.of(9), swept);
+    assert_equal(log.of(4), std::vector<std::vector<int>>({{4, int(Orderside::sell), 106, 10}}));
+
+    // an operation which changes nothing reports nothing
+    log.events.clear();
+    assert(!book.cancel_order(9, 9, log), "unknown order should not be cancelled");
+    assert(log.events.empty(), "a missed cancel should not report changes");
+    return 0;
+}
+
+// aggregated size per price of each side, rebuilt from the events of the book
+struct DepthModel : OrderbookListener
+{
+    std::map<int, int> asks, bids;
+    std::map<int, int>& levels(Orderside side) { return side == Orderside::sell ? asks : bids; }
+    void change(Orderside side, int price, int quantity)
+    {
+        auto& side_levels = levels(side);
+        if((side_levels[price] += quantity) == 0)
+            side_levels.erase(price);
+    }
+    // fills are reported with the side of the incoming order
+    void on_fill(Orderside side, int, int, int, int, int price, int quantity) { change(side == Orderside::buy ? Orderside::sell : Orderside::buy, price, -quantity); }
+    void on_add(Orderside side, int, int, int price, int quantity) { change(side, price, quantity); }
+    void on_cancel(Orderside side, int, int, int price, int quantity) { change(side, price, -quantity); }
+};
+
+int orderbook_test_depth(const OrderbookConfig& config)
+{
+    // a ladder narrower than the prices so that the depth merges ladder and tree levels
+    OrderbookConfig narrow = config;
+    narrow.ladderTicks = 64;
+    Orderbook book(narrow);
+    std::atomic<bool> done{false};
+    std::atomic<int> failures{0};
+
+    // every published snapshot must be ordered from best to worst with live levels
+    auto reader = [&book, &done, &failures]()
+    {
+        DepthLevel levels[MaxDepth];
+        while(!done.load(std::memory_order_relaxed))
+        {
+            for(Orderside side : {Orderside::buy, Orderside::sell})
+            {
+                const size_t count = book.depth(side, MaxDepth, levels);
+                for(size_t index = 0; index < count; ++index)
+                {
+                    const bool ordered = index == 0 || (side == Orderside::sell ? levels[index - 1].price < levels[index].price : levels[index - 1].price > levels[index].price);
+                    if(!ordered || levels[index].quantity <= 0)
+                        failures.fetch_add(1);
+                }
+            }
+        }
+    };
+    std::thread readerThread(reader);
+
+    std::mt19937 gen{23};
+    DepthModel model;
+    DepthLevel levels[MaxDepth];
+    for(int iteration = 0; iteration < 50000; ++iteration)
+    {
+        const int kind = gen() % 10;
+        const Orderside side = gen() % 2 ? Orderside::buy : Orderside::sell;
+        const int orderId = int(gen() % 3000);
+        if(kind < 6)
+        {
+            // wide enough to have more levels than the cache, sometimes crossing the spread
+            const int price = side == Orderside::buy ? 60 + int(gen() % 45) : 96 + int(gen() % 45);
+            book.add_order(side, 1, orderId, kind == 0 ? 0 : price, 1 + int(gen() % 50), model);
+        }
+        else
+        {
+            book.cancel_order(1, orderId, model);
+        }
+
+        for(Orderside checked : {Orderside::buy, Orderside::sell})
+        {
+            std::vector<std::pair<int, int>> expected;
+            if(checked == Orderside::sell)
+            {
+                for(auto ite = model.asks.begin(); ite != model.asks.end() && expected.size() < MaxDepth; ++ite)
+                    expected.emplace_back(ite->first, ite->second);
+            }
+            else
+            {
+                for(auto ite = model.bids.rbegin(); ite != model.bids.rend() && expected.size() < MaxDepth; ++ite)
+                    expected.emplace_back(ite->first, ite->second);
+            }
+            std::vector<std::pair<int, int>> actual;
+            const size_t count = book.depth(checked, MaxDepth, levels);
+            for(size_t index = 0; index < count; ++index)
+                actual.emplace_back(levels[index].price, levels[index].quantity);
+            assert_equal(actual, expected);
+        }
+    }
+    done = true;
+    readerThread.join();
+    assert_equal(failures.load(), 0);
+
+    // fewer levels than asked for, and flush empties the depth
+    assert_equal(book.depth(Orderside::buy, 2, levels), size_t(2));
+    book.flush();
+    assert_equal(book.depth(Orderside::buy, MaxDepth, levels), size_t(0));
+    assert_equal(book.depth(Orderside::sell, MaxDepth, levels), size_t(0));
+    return 0;
+}
+
+int orderbook_test_reserve(const OrderbookConfig& config)
+{
+    Orderbook book(config);
+    book.reserve(1000, 100);
+
+    const size_t allocationsBefore = globalAllocations;
+    for(int round = 0; round < 10; ++round)
+    {
+        // rest 500 orders on each side over 100 levels
+        for(int order = 0; order < 500; ++order)
+        {
+            book.add_order(Orderside::buy, 1, order, 100 + order % 100, 10, nullptr);
+            book.add_order(Orderside::sell, 2, order, 300 + order % 100, 10, nullptr);
+        }
+        // cancel half of them and sweep the rest
+        for(int order = 0; order < 500; order += 2)
+        {
+            assert_equal(book.cancel_order(1, order), true);
+            assert_equal(book.cancel_order(2, order), true);
+        }
+        assert_equal(book.add_order(Orderside::sell, 3, round, 0, 250 * 10, nullptr), true);
+        assert_equal(book.add_order(Orderside::buy, 4, round, 0, 250 * 10, nullptr), true);
+        assert_equal(book.get_max_bid(), std::make_pair(-1, -1));
+        assert_equal(book.get_min_ask(), std::make_pair(-1, -1));
+    }
+    assert_equal(globalAllocations, allocationsBefore);
+    return 0;
+}
+
+int orderbook_bench(const char ** argv, const OrderbookConfig& config)
+{
+    Orderbook book(config);
     size_t iterations = std::stoll(argv[2]);
     std::vector<Match> recent_matches;
     std::random_device rd;
@@ -420,7 +1569,7 @@ int orderbook_bench(const char ** argv)
     };
     for(size_t iteration = 0; iteration < iterations; ++iteration)
     {
-        Orderside side = (rand() / RAND_MAX) > 0.5 ? Orderside::buy : Orderside::sell;
+        Orderside side = gen() % 2 ? Orderside::buy : Orderside::sell;
         int price = std::round(nor_dist(gen));
         if(price < 1)
             price = 1;
@@ -433,40 +1582,183 @@ int orderbook_bench(const char ** argv)
     return 0;
 }
 
+int orderbook_test_latency_histogram()
+{
+    bench::LatencyHistogram histogram;
+    assert_equal(histogram.percentile(50), uint64_t(0));
+    for(uint64_t value = 1; value <= 100; ++value)
+        histogram.record(value);
+    // small values are exact
+    assert_equal(histogram.percentile(50), uint64_t(50));
+    assert_equal(histogram.percentile(99), uint64_t(99));
+    assert_equal(histogram.percentile(100), uint64_t(100));
+    assert_equal(histogram.min(), uint64_t(1));
+
+    bench::LatencyHistogram large;
+    for(uint64_t value = 1; value <= 1000000; ++value)
+        large.record(value * 1000);
+    large.merge(histogram);
+    assert_equal(large.count(), uint64_t(1000100));
+    assert_equal(large.max(), uint64_t(1000000000));
+    assert_equal(large.percentile(100), large.max());
+    for(double percentile : {50.0, 90.0, 99.0, 99.9})
+    {
+        const double exact = percentile / 100 * 1000100 * 1000;
+        const double error = std::abs(double(large.percentile(percentile)) - exact) / exact;
+        assert(error < 1.0 / 64, "percentiles should be within the bucket precision");
+    }
+    return 0;
+}
+
+// sweeps of market orders through resting orders, to compare the cost of a fill with MatchFunctor and a listener
+int orderbook_bench_sweep(const char ** argv, const OrderbookConfig& config)
+{
+    const size_t iterations = std::stoll(argv[2]);
+    const int ordersPerSweep = 100;
+
+    struct FillCounter : OrderbookListener
+    {
+        long long fills = 0;
+        long long quantity = 0;
+        void on_fill(Orderside, int, int, int, int, int, int q)
+        {
+            ++fills;
+            quantity += q;
+        }
+    };
+
+    auto run = [&](auto& listener) -> std::chrono::nanoseconds
+    {
+        Orderbook book(config);
+        book.reserve(ordersPerSweep, ordersPerSweep);
+        auto start = std::chrono::steady_clock::now();
+        for(size_t iteration = 0; iteration < iterations; ++iteration)
+        {
+            const Orderside side = iteration % 2 ? Orderside::buy : Orderside::sell;
+            for(int order = 0; order < ordersPerSweep; ++order)
+                book.add_order(side, 1, order, 100 + order % 10, 10, listener);
+            book.add_order(side == Orderside::buy ? Orderside::sell : Orderside::buy, 2, iteration, 0, ordersPerSweep * 10, listener);
+        }
+        return std::chrono::steady_clock::now() - start;
+    };
+
+    FillCounter listener;
+    long long functorFills = 0;
+    Orderbook::MatchFunctor functor = [&functorFills](Orderside, int, int, int, int, int, int) -> bool
+    {
+        ++functorFills;
+        return true;
+    };
+    const auto listenerTime = run(listener);
+    const auto functorTime = run(functor);
+    assert_equal(listener.fills, functorFills);
+
+    std::cerr << "sweeps with " << listener.fills << " fills: listener " << double(listenerTime.count()) / listener.fills
+              << " ns/fill, MatchFunctor " << double(functorTime.count()) / functorFills << " ns/fill\n";
+    return 0;
+}
+
 int run_orderbook_tests(const char ** argv)
 {
     const char * testName = argv[1];
+    // tests run against the backend named by the last argument, tree by default
+    OrderbookConfig config;
+    for(const char ** arg = argv + 2; *arg; ++arg)
+    {
+        if(std::strcmp("ladder", *arg) == 0)
+            config.backend = LevelsBackend::ladder;
+    }
     if(std::strcmp("orderbook_test_empty_orderbook", testName) == 0)
     {
-        return orderbook_test_empty_orderbook();
+        return orderbook_test_empty_orderbook(config);
     }
     else if(std::strcmp("orderbook_test_add_orders", testName) == 0)
     {
-        return orderbook_test_add_orders();
+        return orderbook_test_add_orders(config);
     }
     else if(std::strcmp("orderbook_test_cancel_orders", testName) == 0)
     {
-        return orderbook_test_cancel_orders();
+        return orderbook_test_cancel_orders(config);
+    }
+    else if(std::strcmp("orderbook_test_cancel_priority", testName) == 0)
+    {
+        return orderbook_test_cancel_priority(config);
     }
     else if(std::strcmp("orderbook_test_match_buy_side", testName) == 0)
     {
-        return orderbook_test_match_buy_side();
+        return orderbook_test_match_buy_side(config);
     }
     else if(std::strcmp("orderbook_test_match_sell_side", testName) == 0)
     {
-        return orderbook_test_match_sell_side();
+        return orderbook_test_match_sell_side(config);
     }
     else if(std::strcmp("orderbook_test_market_orders", testName) == 0)
     {
-        return orderbook_test_market_orders();
+        return orderbook_test_market_orders(config);
+    }
+    else if(std::strcmp("orderbook_test_ladder_window", testName) == 0)
+    {
+        return orderbook_test_ladder_window(config);
+    }
+    else if(std::strcmp("orderbook_test_concurrent_top_of_book", testName) == 0)
+    {
+        return orderbook_test_concurrent_top_of_book(config);
+    }
+    else if(std::strcmp("orderbook_test_reserve", testName) == 0)
+    {
+        return orderbook_test_reserve(config);
     }
     else if(std::strcmp("orderbook_bench", testName) == 0)
     {
-        return orderbook_bench(argv);
+        return orderbook_bench(argv, config);
+    }
+    else if(std::strcmp("orderbook_test_modify_order", testName) == 0)
+    {
+        return orderbook_test_modify_order(config);
+    }
+    else if(std::strcmp("orderbook_test_time_in_force", testName) == 0)
+    {
+        return orderbook_test_time_in_force(config);
+    }
+    else if(std::strcmp("orderbook_test_iceberg", testName) == 0)
+    {
+        return orderbook_test_iceberg(config);
+    }
+    else if(std::strcmp("orderbook_test_stop_orders", testName) == 0)
+    {
+        return orderbook_test_stop_orders(config);
+    }
+    else if(std::strcmp("orderbook_test_coalesced_events", testName) == 0)
+    {
+        return orderbook_test_coalesced_events(config);
+    }
+    else if(std::strcmp("orderbook_test_apply_batch", testName) == 0)
+    {
+        return orderbook_test_apply_batch(config);
+    }
+    else if(std::strcmp("orderbook_test_depth", testName) == 0)
+    {
+        return orderbook_test_depth(config);
+    }
+    else if(std::strcmp("orderbook_test_order_index", testName) == 0)
+    {
+        return orderbook_test_order_index(config);
+    }
+    else if(std::strcmp("orderbook_test_stats", testName) == 0)
+    {
+        return orderbook_test_stats(config);
+    }
+    else if(std::strcmp("orderbook_test_latency_histogram", testName) == 0)
+    {
+        return orderbook_test_latency_histogram();
+    }
+    else if(std::strcmp("orderbook_bench_sweep", testName) == 0)
+    {
+        return orderbook_bench_sweep(argv, config);
     }
     else if(std::strcmp("orderbook_test_flush", testName) == 0)
     {
-        return orderbook_test_flush();
+        return orderbook_test_flush(config);
     }
     else
     {
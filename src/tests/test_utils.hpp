@@ -2,7 +2,8 @@
 #include <stdexcept>
 #include <sstream>
 #include <iostream>
-void assert(bool condition, const char* message)
+#include <type_traits>
+inline void assert(bool condition, const char* message)
 {
     if(!condition)
     {
@@ -10,15 +11,30 @@ void assert(bool condition, const char* message)
     }
 }
 
-void assert(bool condition, std::string message)
+inline void assert(bool condition, std::string message)
 {
     assert(condition, message.c_str());
 }
 
+// compares integers of different signedness by value, a negative one is never equal to an unsigned one
 template<typename A, typename B>
-void assert_equal(const A& a, const B& b, const char* file, int line)
+inline bool test_equal(const A& a, const B& b)
 {
-    if( !(a == b) )
+    if constexpr (std::is_integral_v<A> && std::is_integral_v<B> && std::is_signed_v<A> != std::is_signed_v<B>)
+    {
+        if constexpr (std::is_signed_v<A>)
+            return a >= 0 && std::make_unsigned_t<A>(a) == b;
+        else
+            return b >= 0 && a == std::make_unsigned_t<B>(b);
+    }
+    else
+        return a == b;
+}
+
+template<typename A, typename B>
+inline void assert_equal(const A& a, const B& b, const char* file, int line)
+{
+    if( !test_equal(a, b) )
     {
         std::stringstream ss;
         ss << "equal assert fail at " << file << "@" << line;
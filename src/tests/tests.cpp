@@ -1,4 +1,5 @@
 #include "orderbook_tests.hpp"
+#include "engine_tests.hpp"
 #include <iostream>
 #include <cstring>
 
@@ -10,6 +11,10 @@ int main(int argc, const char ** argv)
         {
             return run_orderbook_tests(argv);
         }
+        else if( std::strncmp(argv[1], "engine", 6) == 0 )
+        {
+            return run_engine_tests(argv);
+        }
         else
         {
             std::cout << "no test named " << argv[1];